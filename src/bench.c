@@ -0,0 +1,501 @@
+#include "disk.h"
+#include "sfs.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Runs a fixed set of workloads against a fresh file system each and prints the results as
+// JSON: throughput, latency percentiles, block I/O and heap allocations per operation. Runs
+// are repeatable for a given set of options, so the output of two versions can be compared.
+
+#define MAX_THREADS 64
+#define IO_SIZE BLOCKSIZE
+#define APPEND_SIZE 64
+#define FILE_BLOCKS 64 // size of the files truncated and removed
+
+typedef struct bench_opts {
+    int disk_mb;
+    int ops;
+    int threads[MAX_THREADS];
+    int thread_counts;
+    int wide; // directories in the wide tree
+    int depth; // levels of the deep tree
+    unsigned seed;
+    format_opts format;
+    char* trace; // file the block I/O of the whole run is traced to, NULL for none
+    const char* device; // name of the device model
+    disk_model model; // device the disk behaves like
+} bench_opts;
+
+typedef struct result {
+    const char* name;
+    int threads;
+    long ops;
+    double seconds;
+    long bytes; // data moved, 0 for metadata workloads
+    uint64_t* lat; // latency of each op in ns
+    uint32_t reads;
+    uint32_t writes;
+    uint64_t device_ns; // virtual time the device model spent, 0 without a model
+    uint64_t allocs; // heap allocations made during the run
+} result;
+
+static bench_opts opts;
+static disk* diskptr;
+static int first_result = 1;
+
+// Heap allocations of the whole program, counted by linking with --wrap for each allocator
+// call (see the Makefile). Calls libc makes internally are not seen.
+static uint64_t heap_allocs = 0;
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void* __real_aligned_alloc(size_t alignment, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+void* __wrap_aligned_alloc(size_t alignment, size_t size) {
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __real_aligned_alloc(alignment, size);
+}
+
+static uint64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000ull + t.tv_nsec;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(uint64_t* sorted, long n, double p) {
+    if(n == 0)
+        return 0;
+    long i = (long) (p*n);
+    if(i >= n)
+        i = n-1;
+    return sorted[i]/1000.0;
+}
+
+static void report(result* r) {
+    qsort(r->lat, r->ops, sizeof(uint64_t), cmp_u64);
+    printf("%s\n    {\"name\": \"%s\", \"threads\": %d, \"ops\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.1f, ",
+        first_result ? "" : ",", r->name, r->threads, r->ops, r->seconds, r->seconds > 0 ? r->ops/r->seconds : 0);
+    if(r->bytes)
+        printf("\"mb_per_sec\": %.2f, ", r->seconds > 0 ? r->bytes/r->seconds/(1024*1024) : 0);
+    if(opts.model.kind != DISK_RAM)
+        printf("\"device_seconds\": %.6f, \"device_ops_per_sec\": %.1f, ", r->device_ns/1e9, r->device_ns ? r->ops/(r->device_ns/1e9) : 0);
+    printf("\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, \"reads_per_op\": %.3f, \"writes_per_op\": %.3f, \"allocs_per_op\": %.3f}",
+        percentile(r->lat, r->ops, 0.5), percentile(r->lat, r->ops, 0.99), percentile(r->lat, r->ops, 0.999),
+        r->ops ? r->reads/(double) r->ops : 0, r->ops ? r->writes/(double) r->ops : 0, r->ops ? r->allocs/(double) r->ops : 0);
+    first_result = 0;
+    free(r->lat);
+    fflush(stdout);
+}
+
+// Formats and mounts a fresh file system; not part of any measurement.
+static void fresh_fs() {
+    if(format_ex(diskptr, &opts.format) < 0 || mount(diskptr) < 0 || init_dirsys(diskptr) < 0) {
+        fprintf(stderr, "Could not set up the file system.\n");
+        exit(1);
+    }
+}
+
+static void start(result* r, const char* name, int threads, long ops) {
+    memset(r, 0, sizeof(result));
+    r->name = name;
+    r->threads = threads;
+    r->ops = ops;
+    r->lat = (uint64_t*) calloc(ops ? ops : 1, sizeof(uint64_t));
+    if(!r->lat) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    r->reads = diskptr->reads;
+    r->writes = diskptr->writes;
+    disk_sim_stats sim;
+    disk_sim_totals(diskptr, &sim);
+    r->device_ns = sim.elapsed_ns;
+    r->allocs = __atomic_load_n(&heap_allocs, __ATOMIC_RELAXED);
+}
+
+static void stop(result* r, uint64_t begin) {
+    r->seconds = (now_ns()-begin)/1e9;
+    r->reads = diskptr->reads - r->reads;
+    r->writes = diskptr->writes - r->writes;
+    disk_sim_stats sim;
+    disk_sim_totals(diskptr, &sim);
+    r->device_ns = sim.elapsed_ns - r->device_ns;
+    r->allocs = __atomic_load_n(&heap_allocs, __ATOMIC_RELAXED) - r->allocs;
+}
+
+// Threaded workloads: each thread works on its own files and records its latencies in its
+// own slice of the result.
+typedef struct worker {
+    int id;
+    int kind;
+    long ops;
+    uint64_t* lat;
+    int* files;
+    int nfiles;
+    unsigned seed;
+    int failed;
+} worker;
+
+enum { W_CREATE, W_SEQ_WRITE, W_SEQ_READ, W_RAND_WRITE, W_RAND_READ, W_APPEND };
+
+static const int chunks_per_file = MAXBLOCKS*BLOCKSIZE/IO_SIZE;
+
+static void* run_worker(void* arg) {
+    worker* w = (worker*) arg;
+    char* buffer = (char*) malloc(IO_SIZE);
+    memset(buffer, w->id+1, IO_SIZE);
+    for(long i=0; i<w->ops; i++) {
+        int file = w->files ? w->files[(i/chunks_per_file) % w->nfiles] : 0;
+        int offset = (i % chunks_per_file)*IO_SIZE;
+        int ret = 0;
+        if(w->kind == W_RAND_WRITE || w->kind == W_RAND_READ) {
+            long chunks = w->ops < (long) w->nfiles*chunks_per_file ? w->ops : (long) w->nfiles*chunks_per_file;
+            long chunk = rand_r(&w->seed) % chunks;
+            file = w->files[chunk/chunks_per_file];
+            offset = (chunk % chunks_per_file)*IO_SIZE;
+        }
+        uint64_t t = now_ns();
+        switch(w->kind) {
+        case W_CREATE:
+            ret = create_file();
+            break;
+        case W_SEQ_WRITE:
+        case W_RAND_WRITE:
+            ret = write_i(file, buffer, IO_SIZE, offset) == IO_SIZE ? 0 : -1;
+            break;
+        case W_SEQ_READ:
+        case W_RAND_READ:
+            ret = read_i(file, buffer, IO_SIZE, offset) == IO_SIZE ? 0 : -1;
+            break;
+        case W_APPEND:
+            file = w->files[(i/(chunks_per_file*(IO_SIZE/APPEND_SIZE))) % w->nfiles];
+            offset = (i % (chunks_per_file*(IO_SIZE/APPEND_SIZE)))*APPEND_SIZE;
+            ret = write_i(file, buffer, APPEND_SIZE, offset) == APPEND_SIZE ? 0 : -1;
+            break;
+        }
+        w->lat[i] = now_ns()-t;
+        if(ret < 0)
+            w->failed = 1;
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void run_threads(result* r, worker* workers, int threads) {
+    pthread_t tids[MAX_THREADS];
+    uint64_t begin = now_ns();
+    for(int i=0; i<threads; i++)
+        pthread_create(tids+i, NULL, run_worker, workers+i);
+    for(int i=0; i<threads; i++)
+        pthread_join(tids[i], NULL);
+    stop(r, begin);
+    for(int i=0; i<threads; i++) {
+        if(workers[i].failed)
+            fprintf(stderr, "%s: some operations failed.\n", r->name);
+    }
+}
+
+static worker* make_workers(result* r, int kind, int threads, long per_thread, int files_each) {
+    worker* workers = (worker*) calloc(threads, sizeof(worker));
+    for(int i=0; i<threads; i++) {
+        workers[i].id = i;
+        workers[i].kind = kind;
+        workers[i].ops = per_thread;
+        workers[i].lat = r->lat + i*per_thread;
+        workers[i].seed = opts.seed + i;
+        workers[i].nfiles = files_each;
+        if(files_each) {
+            workers[i].files = (int*) malloc(files_each*sizeof(int));
+            for(int j=0; j<files_each; j++)
+                workers[i].files[j] = create_file();
+        }
+    }
+    return workers;
+}
+
+static void reuse_workers(result* r, worker* workers, int kind, int threads, long per_thread) {
+    for(int i=0; i<threads; i++) {
+        workers[i].kind = kind;
+        workers[i].ops = per_thread;
+        workers[i].lat = r->lat + i*per_thread;
+        workers[i].seed = opts.seed + i;
+        workers[i].failed = 0;
+    }
+}
+
+static void free_workers(worker* workers, int threads) {
+    for(int i=0; i<threads; i++)
+        free(workers[i].files);
+    free(workers);
+}
+
+static void bench_format_mount() {
+    result r;
+    int rounds = 20;
+    start(&r, "format_mount", 1, rounds);
+    uint64_t begin = now_ns();
+    for(int i=0; i<rounds; i++) {
+        uint64_t t = now_ns();
+        if(format_ex(diskptr, &opts.format) < 0 || mount(diskptr) < 0)
+            fprintf(stderr, "format_mount failed.\n");
+        r.lat[i] = now_ns()-t;
+    }
+    stop(&r, begin);
+    report(&r);
+}
+
+static void bench_io(int threads) {
+    result r;
+    long per_thread = opts.ops/threads;
+    long ops = per_thread*threads;
+    int files_each = (per_thread + chunks_per_file-1)/chunks_per_file;
+
+    fresh_fs();
+    start(&r, "create_file", threads, ops);
+    worker* workers = make_workers(&r, W_CREATE, threads, per_thread, 0);
+    run_threads(&r, workers, threads);
+    report(&r);
+    free_workers(workers, threads);
+
+    fresh_fs();
+    start(&r, "seq_write", threads, ops);
+    workers = make_workers(&r, W_SEQ_WRITE, threads, per_thread, files_each);
+    r.bytes = ops*IO_SIZE;
+    run_threads(&r, workers, threads);
+    report(&r);
+
+    int kinds[] = {W_SEQ_READ, W_RAND_READ, W_RAND_WRITE};
+    const char* names[] = {"seq_read", "rand_read", "rand_write"};
+    for(int k=0; k<3; k++) {
+        start(&r, names[k], threads, ops);
+        reuse_workers(&r, workers, kinds[k], threads, per_thread);
+        r.bytes = ops*IO_SIZE;
+        run_threads(&r, workers, threads);
+        report(&r);
+    }
+    free_workers(workers, threads);
+
+    fresh_fs();
+    start(&r, "append_small", threads, ops);
+    workers = make_workers(&r, W_APPEND, threads, per_thread, 1 + per_thread/(chunks_per_file*(IO_SIZE/APPEND_SIZE)));
+    r.bytes = ops*APPEND_SIZE;
+    run_threads(&r, workers, threads);
+    report(&r);
+    free_workers(workers, threads);
+}
+
+// Files of FILE_BLOCKS blocks, cut to half their size and then removed.
+static void bench_truncate_remove() {
+    result r;
+    int nfiles = opts.ops/FILE_BLOCKS;
+    if(nfiles < 1)
+        nfiles = 1;
+    int* files = (int*) malloc(nfiles*sizeof(int));
+    char* data = (char*) calloc(FILE_BLOCKS, BLOCKSIZE);
+    fresh_fs();
+    for(int i=0; i<nfiles; i++) {
+        files[i] = create_file();
+        if(files[i] < 0 || write_i(files[i], data, FILE_BLOCKS*BLOCKSIZE, 0) != FILE_BLOCKS*BLOCKSIZE) {
+            nfiles = i;
+            break;
+        }
+    }
+    start(&r, "fit_to_size", 1, nfiles);
+    uint64_t begin = now_ns();
+    for(int i=0; i<nfiles; i++) {
+        uint64_t t = now_ns();
+        if(fit_to_size(files[i], FILE_BLOCKS*BLOCKSIZE/2) < 0)
+            fprintf(stderr, "fit_to_size failed.\n");
+        r.lat[i] = now_ns()-t;
+    }
+    stop(&r, begin);
+    report(&r);
+    start(&r, "remove_file", 1, nfiles);
+    begin = now_ns();
+    for(int i=0; i<nfiles; i++) {
+        uint64_t t = now_ns();
+        if(remove_file(files[i]) < 0)
+            fprintf(stderr, "remove_file failed.\n");
+        r.lat[i] = now_ns()-t;
+    }
+    stop(&r, begin);
+    report(&r);
+    free(files);
+    free(data);
+}
+
+// Path level operations on a wide tree (many entries in one directory) and a deep one.
+// The directory layer is not safe for concurrent callers, so these run in one thread.
+static void bench_paths() {
+    result r;
+    char path[MAX_LEN*4];
+    fresh_fs();
+    create_dir("wide");
+    start(&r, "create_dir_wide", 1, opts.wide);
+    uint64_t begin = now_ns();
+    for(int i=0; i<opts.wide; i++) {
+        snprintf(path, sizeof(path), "wide/d%d", i);
+        uint64_t t = now_ns();
+        if(create_dir(path) < 0)
+            fprintf(stderr, "create_dir failed.\n");
+        r.lat[i] = now_ns()-t;
+    }
+    stop(&r, begin);
+    report(&r);
+    unsigned seed = opts.seed;
+    long lookups = opts.ops/10 > 0 ? opts.ops/10 : 1;
+    start(&r, "find_dir_wide", 1, lookups);
+    begin = now_ns();
+    for(long i=0; i<lookups; i++) {
+        snprintf(path, sizeof(path), "wide/d%d", (int) (rand_r(&seed) % opts.wide));
+        uint64_t t = now_ns();
+        if(find_dir(path) < 0)
+            fprintf(stderr, "find_dir failed.\n");
+        r.lat[i] = now_ns()-t;
+    }
+    stop(&r, begin);
+    report(&r);
+
+    start(&r, "create_dir_deep", 1, opts.depth);
+    strcpy(path, "deep");
+    begin = now_ns();
+    for(int i=0; i<opts.depth; i++) {
+        uint64_t t = now_ns();
+        if(create_dir(path) < 0)
+            fprintf(stderr, "create_dir failed.\n");
+        r.lat[i] = now_ns()-t;
+        strcat(path, "/d");
+    }
+    stop(&r, begin);
+    report(&r);
+    path[strlen(path)-2] = '\0';
+    start(&r, "find_dir_deep", 1, lookups);
+    begin = now_ns();
+    for(long i=0; i<lookups; i++) {
+        uint64_t t = now_ns();
+        if(find_dir(path) < 0)
+            fprintf(stderr, "find_dir failed.\n");
+        r.lat[i] = now_ns()-t;
+    }
+    stop(&r, begin);
+    report(&r);
+}
+
+static void usage(char* prog) {
+    fprintf(stderr, "usage: %s [-s disk_mb] [-n ops] [-t threads[,threads...]] [-w wide] [-d depth] [-r seed] [-i inode_size] [-b block_size] [-f 32|64] [-c] [-T trace] [-D ram|hdd|ssd|nvme]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    opts.disk_mb = 256;
+    opts.ops = 20000;
+    opts.threads[0] = 1;
+    opts.thread_counts = 1;
+    opts.wide = 2000;
+    opts.depth = 64;
+    opts.seed = 1;
+    opts.device = "ram";
+    int c;
+    while((c = getopt(argc, argv, "s:n:t:w:d:r:i:b:f:cT:D:")) != -1) {
+        switch(c) {
+        case 's': opts.disk_mb = atoi(optarg); break;
+        case 'n': opts.ops = atoi(optarg); break;
+        case 'w': opts.wide = atoi(optarg); break;
+        case 'd': opts.depth = atoi(optarg); break;
+        case 'r': opts.seed = atoi(optarg); break;
+        case 'i': opts.format.inode_size = atoi(optarg); break;
+        case 'b': opts.format.block_size = atoi(optarg); break;
+        case 'f':
+            if(atoi(optarg) != 32 && atoi(optarg) != 64)
+                usage(argv[0]);
+            opts.format.format = (atoi(optarg) == 64) ? SFS_FORMAT_64 : SFS_FORMAT_32;
+            break;
+        case 'c': opts.format.checksums = 1; break;
+        case 'T': opts.trace = optarg; break;
+        case 'D':
+            if(disk_model_preset(disk_model_kind(optarg), &opts.model) < 0)
+                usage(argv[0]);
+            opts.device = optarg;
+            break;
+        case 't': {
+            opts.thread_counts = 0;
+            for(char* tok = strtok(optarg, ","); tok && opts.thread_counts < MAX_THREADS; tok = strtok(NULL, ",")) {
+                int n = atoi(tok);
+                if(n < 1 || n > MAX_THREADS)
+                    usage(argv[0]);
+                opts.threads[opts.thread_counts++] = n;
+            }
+            break;
+        }
+        default: usage(argv[0]);
+        }
+    }
+    if(opts.disk_mb < 1 || opts.ops < 1 || opts.wide < 1 || opts.depth < 1 || !opts.thread_counts)
+        usage(argv[0]);
+    diskptr = create_disk((uint64_t) opts.disk_mb*1024*1024);
+    if(!diskptr) {
+        fprintf(stderr, "Could not create the disk.\n");
+        return 1;
+    }
+    if(disk_set_model(diskptr, &opts.model) < 0) {
+        fprintf(stderr, "Could not set the device model.\n");
+        return 1;
+    }
+    // a first format tells what the metadata of this layout costs
+    super_block* sb = (super_block*) malloc(BLOCKSIZE);
+    if(!sb || format_ex(diskptr, &opts.format) < 0 || read_block(diskptr, 0, sb) < 0) {
+        fprintf(stderr, "Could not format the disk.\n");
+        return 1;
+    }
+    if(opts.trace && trace_start(diskptr, opts.trace, 1 << 16) < 0) {
+        fprintf(stderr, "Could not start tracing to %s.\n", opts.trace);
+        return 1;
+    }
+    printf("{\n  \"config\": {\"disk_mb\": %d, \"ops\": %d, \"threads\": [", opts.disk_mb, opts.ops);
+    for(int i=0; i<opts.thread_counts; i++)
+        printf("%s%d", i ? ", " : "", opts.threads[i]);
+    printf("], \"wide\": %d, \"depth\": %d, \"seed\": %u, \"format\": %d, \"inode_size\": %u, \"block_size\": %u, \"checksums\": %s, \"device\": \"%s\",",
+        opts.wide, opts.depth, opts.seed, WIDE_FORMAT(sb) ? 64 : 32, (uint32_t) INODE_SIZE(sb), FS_BLOCK_SIZE(sb),
+        opts.format.checksums ? "true" : "false", opts.device);
+    printf(" \"metadata_blocks\": %u, \"map_entries\": %u, \"max_file_bytes\": %lu},\n  \"results\": [",
+        sb->data_block_idx, (uint32_t) MAP_ENTRIES(sb), (unsigned long) (MAX_FILE_BLOCKS(sb)*FS_BLOCK_SIZE(sb)));
+    free(sb);
+    bench_format_mount();
+    for(int i=0; i<opts.thread_counts; i++)
+        bench_io(opts.threads[i]);
+    bench_truncate_remove();
+    bench_paths();
+    printf("\n  ]\n}\n");
+    if(opts.trace) {
+        long dropped = trace_stop();
+        if(dropped)
+            fprintf(stderr, "Trace of %s lost %ld records.\n", opts.trace, dropped);
+    }
+    free_disk(diskptr);
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include "crc32c.h"
+#include <string.h>
+#include <pthread.h>
+
+#define POLY 0x82F63B78 // reflected Castagnoli polynomial
+
+// The crc32 instruction has a latency of three cycles but a throughput of one, so large
+// buffers are split into three lanes whose CRCs are computed together and then combined.
+// Combining shifts a lane's CRC over LANE bytes of zeros, which is linear and done with
+// one table per byte of the CRC.
+#define LANE 1360 // 3*LANE+16 == 4096, a block is three lanes and a short tail
+
+static uint32_t table[256];
+static uint32_t shift_table[4][256];
+static int use_sse42;
+static pthread_once_t table_once = PTHREAD_ONCE_INIT; // sfsck makes its first calls from many threads
+
+static void init_table() {
+    for(uint32_t i=0; i<256; i++) {
+        uint32_t crc = i;
+        for(int k=0; k<8; k++)
+            crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+        table[i] = crc;
+    }
+    for(int k=0; k<4; k++) {
+        for(uint32_t i=0; i<256; i++) {
+            uint32_t crc = i << (8*k);
+            for(int n=0; n<LANE; n++)
+                crc = table[crc & 0xff] ^ (crc >> 8);
+            shift_table[k][i] = crc;
+        }
+    }
+#if defined(__x86_64__)
+    use_sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+#else
+    use_sse42 = 0;
+#endif
+}
+
+static uint32_t shift_lane(uint32_t crc) {
+    return shift_table[0][crc & 0xff] ^ shift_table[1][(crc >> 8) & 0xff] ^ shift_table[2][(crc >> 16) & 0xff] ^ shift_table[3][crc >> 24];
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t len) {
+    while(len--)
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len) {
+    uint64_t crc64 = crc;
+    while(len >= 3*LANE) {
+        uint64_t crc1 = 0, crc2 = 0;
+        for(int i=0; i<LANE; i+=8) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p+i, 8);
+            memcpy(&w1, p+LANE+i, 8);
+            memcpy(&w2, p+2*LANE+i, 8);
+            crc64 = _mm_crc32_u64(crc64, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+        }
+        crc64 = shift_lane(shift_lane((uint32_t) crc64) ^ (uint32_t) crc1) ^ (uint32_t) crc2;
+        p += 3*LANE;
+        len -= 3*LANE;
+    }
+    while(len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t) crc64;
+    while(len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&table_once, init_table);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if(use_sse42)
+        return ~crc32c_hw(crc, (const unsigned char*) data, len);
+#endif
+    return ~crc32c_sw(crc, (const unsigned char*) data, len);
+}
@@ -0,0 +1,5 @@
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-32C (Castagnoli), using the SSE4.2 crc32 instruction when the CPU has it.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
@@ -1,16 +1,29 @@
 #include "disk.h"
 #include "sfs.h"
-#include <libgen.h>
+#include "stats.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 #define ROOT_INODE 0
+#define MAX_OPEN_DIRS 64
+
+typedef struct dir_handle {
+    int in_use;
+    int inumber;
+    int offset; // directory file offset of the first buffered item
+    int buffered; // items in buffer
+    int next; // next buffered item to look at
+    int chunk; // items read at a time, see chunk_items
+    dir_item* buffer;
+} dir_handle;
 
 static int dir_initialized = 0;
+static dir_handle dir_handles[MAX_OPEN_DIRS];
+static int lookup_entry(int par_inode, char* name, dir_item* found, int* freespot);
 
 int init_dirsys(disk* diskptr) {
-    int root_inode = create_file();
+    int root_inode = create_dir_file();
     if(root_inode < 0) {
         return -1;
     } else if(root_inode!=ROOT_INODE) {
@@ -21,100 +34,138 @@ int init_dirsys(disk* diskptr) {
     return 0;
 }
 
+// dir_items read from a directory file at a time: the fewest that end on a block boundary,
+// so consecutive reads start on one and each block is read once per listing. With 264 byte
+// items that is a run of 33 blocks whatever the block size.
+static int chunk_items() {
+    uint32_t a = fs_block_size(), b = sizeof(dir_item);
+    while(b) {
+        uint32_t t = a%b;
+        a = b;
+        b = t;
+    }
+    return fs_block_size()/a;
+}
+
+// Paths are resolved one component at a time from the root directory, parsed in place in a
+// copy on the stack. A relative path starts at the root as well, "." naming the root itself.
+// Inode of directory dirpath, or -1. above is set to whether inode ancestor is the directory
+// or one of the directories on the way to it.
+static int walk_dir(char* dirpath, int ancestor, int* above) {
+    char path[MAX_PATH_LEN];
+    if(strlen(dirpath) >= MAX_PATH_LEN) {
+        printf("Path too long.\n");
+        return -1;
+    }
+    strcpy(path, dirpath);
+    char* save;
+    char* name = strtok_r(path, "/", &save);
+    if(name && dirpath[0] != '/' && !strcmp(name, "."))
+        name = strtok_r(NULL, "/", &save);
+    int inumber = ROOT_INODE;
+    *above = (inumber == ancestor);
+    for(; name; name = strtok_r(NULL, "/", &save)) {
+        dir_item current;
+        int freespot;
+        if(lookup_entry(inumber, name, &current, &freespot) < 0 || !current.is_dir)
+            return -1;
+        inumber = current.inumber;
+        *above |= (inumber == ancestor);
+    }
+    return inumber;
+}
+
 int find_dir(char* dirpath) {
+    STAT_OP(OP_FIND_DIR);
     if(!dir_initialized) {
         printf("Directory system not initialized.\n");
         return -1;
     }
-    char* dirc = strdup(dirpath);
-    char* basec = strdup(dirpath);
-    char* parent = dirname(dirc);
-    char* base = basename(basec);
-    dir_item* current = (dir_item*) malloc(sizeof(dir_item));
-    if(!current) {
-        free(dirc);
-        free(basec);
+    int above;
+    return walk_dir(dirpath, -1, &above);
+}
+
+// Splits path into its parent directory and last component the way dirname and basename
+// do, in place in copy, a MAX_PATH_LEN buffer of the caller.
+static int split_path(char* path, char* copy, char** parent, char** base) {
+    size_t len = strlen(path);
+    if(len >= MAX_PATH_LEN) {
+        printf("Path too long.\n");
         return -1;
     }
-    int retval = -1;
-    if(!strcmp(parent, "/") || !strcmp(parent, ".")) {
-        //if searching for root inode itself
-        if((!strcmp(parent, "/") && !strcmp(base, "/")) || (!strcmp(parent, ".") && !strcmp(base, "."))) {
-            free(dirc);
-            free(basec);
-            free(current);
-            return ROOT_INODE;
-        }
-        //search the root inode
-        int offset = 0;
-        while(offset < get_filesize(ROOT_INODE)) {
-            if(read_i(ROOT_INODE, (char*) current, sizeof(dir_item), offset) < 0) {
-                goto err;
-            }
-            //printf("%s %s", current->filename, base);
-            if(strcmp(current->filename, base)==0) {
-                if(!current->valid || !current->is_dir) {
-                    goto err;
-                } else {
-                    retval = current->inumber;
-                    break;
-                }
-            }
-            offset += sizeof(dir_item);
-        }
+    memcpy(copy, path, len+1);
+    while(len > 1 && copy[len-1] == '/')
+        copy[--len] = '\0';
+    char* slash = strrchr(copy, '/');
+    if(!slash) {
+        *parent = ".";
+        *base = len ? copy : ".";
+    } else if(len == 1) {
+        *parent = *base = copy;
     } else {
-        int parinode = find_dir(parent);
-        if(parinode < 0)
-            goto err;
-        int offset = 0;
-        while(offset < get_filesize(parinode)) {
-            if(read_i(parinode, (char*) current, sizeof(dir_item), offset) < 0) {
-                goto err;
-            }
-            if(strcmp(current->filename, base)==0) {
-                if(!current->valid || !current->is_dir) {
-                    goto err;
-                } else {
-                    retval = current->inumber;
-                    break;
-                }
-            }
-            offset += sizeof(dir_item);
+        *base = slash+1;
+        while(slash > copy && slash[-1] == '/')
+            slash--;
+        if(slash == copy) {
+            *parent = "/";
+        } else {
+            *slash = '\0';
+            *parent = copy;
         }
     }
-    free(current);
-    free(dirc);
-    free(basec);
-    return retval;
-    err:
-        free(current);
-        free(dirc);
-        free(basec);
+    return 0;
+}
+
+// Offset of the valid entry called name in directory par_inode, -1 if there is none and -2 on
+// errors. freespot is set to the first invalid entry, or -1 if the directory has no hole.
+static int lookup_entry(int par_inode, char* name, dir_item* found, int* freespot) {
+    int size = get_filesize(par_inode);
+    if(size < 0)
+        return -2;
+    *freespot = -1;
+    for(int offset=0; offset<size; offset+=sizeof(dir_item)) {
+        if(read_i(par_inode, (char*) found, sizeof(dir_item), offset) < 0)
+            return -2;
+        if(!found->valid) {
+            if(*freespot < 0)
+                *freespot = offset;
+        } else if(strcmp(found->filename, name)==0) {
+            return offset;
+        }
+    }
+    return -1;
+}
+
+static int dir_is_empty(int inumber) {
+    dir_item current;
+    int size = get_filesize(inumber);
+    if(size < 0)
         return -1;
+    for(int offset=0; offset<size; offset+=sizeof(dir_item)) {
+        if(read_i(inumber, (char*) &current, sizeof(dir_item), offset) < 0)
+            return -1;
+        if(current.valid)
+            return 0;
+    }
+    return 1;
 }
 
 int create_dir(char *dirpath) {
+    STAT_OP(OP_CREATE_DIR);
     if(!dir_initialized) {
         printf("Directory system not initialized.\n");
         return -1;
     }
-    char* dirc = strdup(dirpath);
-    char* basec = strdup(dirpath);
-    char* parent = dirname(dirc);
-    char* base = basename(basec);
+    char path[MAX_PATH_LEN];
+    char *parent, *base;
+    if(split_path(dirpath, path, &parent, &base) < 0)
+        return -1;
     if(strlen(base) >= MAX_LEN) {
         printf("Directory name too long.\n");
-        free(dirc);
-        free(basec);
         return -1;
     }
     int par_inode = find_dir(parent);
-    dir_item* current = (dir_item*) malloc(sizeof(dir_item));
-    if(!current) {
-        free(dirc);
-        free(basec);
-        return -1;
-    }
+    dir_item current;
     if(par_inode < 0) {
         printf("Parent directory not found.\n");
         goto err;
@@ -122,148 +173,160 @@ int create_dir(char *dirpath) {
     int offset = 0;
     int freespot = -1;
     while(offset < get_filesize(par_inode)) {
-        if(read_i(par_inode, (char*) current, sizeof(dir_item), offset) < 0) {
+        if(read_i(par_inode, (char*) &current, sizeof(dir_item), offset) < 0) {
             goto err;
         }
-        if(strcmp(current->filename, base)==0) {
+        if(current.valid && strcmp(current.filename, base)==0) {
             //duplicate directory name
             printf("Duplicate directory name.\n");
             goto err;
         }
-        if(!current->valid) {
+        if(!current.valid) {
             freespot = offset;
         }
         offset += sizeof(dir_item);
     }
     //initialize the dir_item for the new directory
-    strcpy(current->filename, base);
-    current->filename_len = strlen(base);
-    current->is_dir = 1;
-    current->valid = 1;
-    current->inumber = create_file();
-    if(current->inumber < 0) {
+    strcpy(current.filename, base);
+    current.filename_len = strlen(base);
+    current.is_dir = 1;
+    current.valid = 1;
+    current.inumber = create_dir_file();
+    if(current.inumber < 0) {
         printf("Unable to create directory file.\n");
         goto err;
     }
+    if(quota_adopt(par_inode, current.inumber) < 0) {
+        remove_file(current.inumber);
+        goto err;
+    }
     //update the parent directory
     if(freespot>0) {
-        if(write_i(par_inode, (char*) current, sizeof(dir_item), freespot) < 0) {
+        if(write_i(par_inode, (char*) &current, sizeof(dir_item), freespot) < 0) {
             printf("Parent directory update failed.\n");
-            remove_file(current->inumber);
+            remove_file(current.inumber);
             goto err;
         }
     } else {
-        if(write_i(par_inode, (char*) current, sizeof(dir_item), get_filesize(par_inode)) < 0) {
+        if(write_i(par_inode, (char*) &current, sizeof(dir_item), get_filesize(par_inode)) < 0) {
             printf("Parent directory update failed.\n");
-            remove_file(current->inumber);
+            remove_file(current.inumber);
             goto err;
         }
     }
-    free(dirc);
-    free(basec);
-    free(current);
     return 0;
     err:
-        free(dirc);
-        free(basec);
-        free(current);
         return -1;
 }
 
-int remove_dir(char *dirpath) {
-    if(!dir_initialized) {
-        printf("Directory system not initialized.\n");
-        return -1;
-    }
-    char* basec = strdup(dirpath);
-    char* dirc = strdup(dirpath);
-    char* parent = dirname(dirc);
-    char* base = basename(basec);
+static int push_inumber(int** array, int* size, int* count, int inumber) {
+    if(*count == *size) {
+        int* grown = (int*) realloc(*array, 2*(*size)*sizeof(int));
+        if(!grown)
+            return -1;
+        *array = grown;
+        *size *= 2;
+    }
+    (*array)[(*count)++] = inumber;
+    return 0;
+}
 
-    int parinode = find_dir(parent);
-    int inumber = find_dir(dirpath);
-    dir_item* current = (dir_item*) malloc(sizeof(dir_item));
-    if(!current) {
-        return -1;
-    }
-    if(parinode<0 || inumber <= 0) {
-        printf("Unable to delete directory.\n");
-        return -1;
-    }
-    int offset = 0;
-    while(offset < get_filesize(inumber)) {
-        if(read_i(inumber, (char*) current, sizeof(dir_item), offset) < 0) {
+// Deletes the tree below directory inumber without going through paths: directories are
+// walked depth first from an explicit stack of inode numbers, and every inode found is
+// dropped in a single remove_inodes call that frees the blocks of the whole tree at once.
+static int remove_tree(int inumber) {
+    int stack_size = 64, depth = 0;
+    int list_size = 256, count = 0;
+    int* stack = (int*) malloc(stack_size*sizeof(int));
+    int* list = (int*) malloc(list_size*sizeof(int));
+    int chunk = chunk_items();
+    dir_item* items = (dir_item*) malloc(chunk*sizeof(dir_item));
+    if(!stack || !list || !items)
+        goto err;
+    stack[depth++] = inumber;
+    while(depth > 0) {
+        int dir = stack[--depth];
+        int size = get_filesize(dir);
+        if(size < 0)
             goto err;
-        }
-        if(current->is_dir) {
-            char* subdir = (char*) malloc((strlen(dirpath)+current->filename_len+2)*sizeof(char));
-            strcpy(subdir, dirpath);
-            strcat(subdir, "/");
-            strcat(subdir, current->filename);
-            if(remove_dir(subdir) < 0) {
-                free(subdir);
-                goto err;
-            }
-        } else {
-            if(remove_file(current->inumber) < 0) {
+        for(int offset=0; offset<size; offset+=chunk*sizeof(dir_item)) {
+            int bytesread = read_i(dir, (char*) items, chunk*sizeof(dir_item), offset);
+            if(bytesread < 0)
                 goto err;
+            for(int i=0; i<bytesread/(int) sizeof(dir_item); i++) {
+                // removed entries may name inodes that already belong to other files
+                if(!items[i].valid)
+                    continue;
+                if(items[i].is_dir) {
+                    if(push_inumber(&stack, &stack_size, &depth, items[i].inumber) < 0)
+                        goto err;
+                } else {
+                    if(push_inumber(&list, &list_size, &count, items[i].inumber) < 0)
+                        goto err;
+                }
             }
         }
-        offset += sizeof(dir_item);
-    }
-    offset = 0;
-    //find and update the dir_item in the parent directory
-    while(offset < get_filesize(parinode)) {
-        if(read_i(parinode, (char*) current, sizeof(dir_item), offset) < 0) {
+        if(push_inumber(&list, &list_size, &count, dir) < 0)
             goto err;
-        }
-        if(strcmp(current->filename, base)==0) {
-            if(remove_file(inumber) < 0) {
-                goto err;
-            }
-            current->valid = 0;
-            if(write_i(parinode, (char*) current, sizeof(dir_item), offset) < 0) {
-                printf("Parent directory update failed.\n");
-                remove_file(current->inumber);
-                goto err;
-            }
-        }
-        offset += sizeof(dir_item);
     }
-    free(current);
-    free(dirc);
-    free(basec);
-    return 0;
+    int retval = remove_inodes(list, count);
+    free(stack);
+    free(list);
+    free(items);
+    return retval;
     err:
-        free(current);
-        free(dirc);
-        free(basec);
+        free(stack);
+        free(list);
+        free(items);
         return -1;
 }
 
+int remove_dir(char *dirpath) {
+    STAT_OP(OP_REMOVE_DIR);
+    if(!dir_initialized) {
+        printf("Directory system not initialized.\n");
+        return -1;
+    }
+    char path[MAX_PATH_LEN];
+    char *parent, *base;
+    if(split_path(dirpath, path, &parent, &base) < 0)
+        return -1;
+    int parinode = find_dir(parent);
+    dir_item current;
+    int freespot, retval = -1;
+    int offset = (parinode < 0) ? -1 : lookup_entry(parinode, base, &current, &freespot);
+    if(offset < 0 || !current.is_dir || current.inumber == ROOT_INODE) {
+        printf("Unable to delete directory.\n");
+        goto out;
+    }
+    // the tree is unlinked first, so a crash part way through only leaks it
+    current.valid = 0;
+    if(write_i(parinode, (char*) &current, sizeof(dir_item), offset) < 0) {
+        printf("Parent directory update failed.\n");
+        goto out;
+    }
+    retval = remove_tree(current.inumber);
+    out:
+        return retval;
+}
+
 int create_file_by_path(char* filepath) {
+    STAT_OP(OP_CREATE_FILE_BY_PATH);
     int retval = -1;
     if(!dir_initialized) {
         printf("Directory system not initialized.\n");
         return -1;
     }
-    char* dirc = strdup(filepath);
-    char* basec = strdup(filepath);
-    char* parent = dirname(dirc);
-    char* base = basename(basec);
+    char path[MAX_PATH_LEN];
+    char *parent, *base;
+    if(split_path(filepath, path, &parent, &base) < 0)
+        return -1;
     if(strlen(base) >= MAX_LEN) {
         printf("Filename too long.\n");
-        free(dirc);
-        free(basec);
         return -1;
     }
     int par_inode = find_dir(parent);
-    dir_item* current = (dir_item*) malloc(sizeof(dir_item));
-    if(!current) {
-        free(dirc);
-        free(basec);
-        return -1;
-    }
+    dir_item current;
     if(par_inode < 0) {
         printf("Parent directory not found.\n");
         goto err;
@@ -271,220 +334,425 @@ int create_file_by_path(char* filepath) {
     int offset = 0;
     int freespot = -1;
     while(offset < get_filesize(par_inode)) {
-        if(read_i(par_inode, (char*) current, sizeof(dir_item), offset) < 0) {
+        if(read_i(par_inode, (char*) &current, sizeof(dir_item), offset) < 0) {
             goto err;
         }
-        if(strcmp(current->filename, base)==0) {
+        if(current.valid && strcmp(current.filename, base)==0) {
             //duplicate filename
             printf("Duplicate filename.\n");
             goto err;
         }
-        if(!current->valid) {
+        if(!current.valid) {
             freespot = offset;
         }
         offset += sizeof(dir_item);
     }
     //initialize the dir_item for the new file
-    strcpy(current->filename, base);
-    current->filename_len = strlen(base);
-    current->is_dir = 0;
-    current->valid = 1;
-    current->inumber = create_file();
-    if(current->inumber < 0) {
+    strcpy(current.filename, base);
+    current.filename_len = strlen(base);
+    current.is_dir = 0;
+    current.valid = 1;
+    current.inumber = create_file();
+    if(current.inumber < 0) {
         printf("Unable to create directory file.\n");
         goto err;
     }
-    retval = current->inumber;
+    if(quota_adopt(par_inode, current.inumber) < 0) {
+        remove_file(current.inumber);
+        goto err;
+    }
+    retval = current.inumber;
     //update the parent directory
     if(freespot>0) {
-        if(write_i(par_inode, (char*) current, sizeof(dir_item), freespot) < 0) {
+        if(write_i(par_inode, (char*) &current, sizeof(dir_item), freespot) < 0) {
             printf("Parent directory update failed.\n");
-            remove_file(current->inumber);
+            remove_file(current.inumber);
             goto err;
         }
     } else {
-        if(write_i(par_inode, (char*) current, sizeof(dir_item), get_filesize(par_inode)) < 0) {
+        if(write_i(par_inode, (char*) &current, sizeof(dir_item), get_filesize(par_inode)) < 0) {
             printf("Parent directory update failed.\n");
-            remove_file(current->inumber);
+            remove_file(current.inumber);
             goto err;
         }
     }
-    free(dirc);
-    free(basec);
-    free(current);
     return retval;
     err:
-        free(dirc);
-        free(basec);
-        free(current);
         return -1;
 }
 
 int remove_file_by_path(char* filepath) {
+    STAT_OP(OP_REMOVE_FILE_BY_PATH);
     if(!dir_initialized) {
         printf("Directory system not initialized.\n");
         return -1;
     }
-    char* dirc = strdup(filepath);
-    char* basec = strdup(filepath);
-    char* parent = dirname(dirc);
-    char* base = basename(basec);
+    char path[MAX_PATH_LEN];
+    char *parent, *base;
+    if(split_path(filepath, path, &parent, &base) < 0)
+        return -1;
     if(strlen(base) >= MAX_LEN) {
         printf("Filename too long.\n");
-        free(dirc);
-        free(basec);
         return -1;
     }
     int par_inode = find_dir(parent);
-    dir_item* current = (dir_item*) malloc(sizeof(dir_item));
-    if(!current) {
-        free(dirc);
-        free(basec);
-        return -1;
-    }
+    dir_item current;
     if(par_inode < 0) {
         printf("Parent directory not found.\n");
         goto err;
     }
     int offset = 0;
     while(offset < get_filesize(par_inode)) {
-        if(read_i(par_inode, (char*) current, sizeof(dir_item), offset) < 0) {
+        if(read_i(par_inode, (char*) &current, sizeof(dir_item), offset) < 0) {
             goto err;
         }
-        if(strcmp(current->filename, base)==0) {
-            if(current->is_dir) {
+        if(current.valid && strcmp(current.filename, base)==0) {
+            if(current.is_dir) {
                 printf("Delete failed, the path is a directory.\n");
                 goto err;
-            } else if(!current->valid) {
-                printf("File already deleted.\n");
-                goto err;
             }
-            remove_file(current->inumber);
-            current->valid = 0;
-            if(write_i(par_inode, (char*) current, sizeof(dir_item), offset) < 0) {
+            current.valid = 0;
+            if(write_i(par_inode, (char*) &current, sizeof(dir_item), offset) < 0) {
                 printf("Parent directory update failed.\n");
-                remove_file(current->inumber);
                 goto err;
             }
+            // the inode and its blocks go away with its last name
+            if(unlink_inode(current.inumber) < 0)
+                goto err;
+            break;
         }
         offset += sizeof(dir_item);
     }
     //update the parent directory
-    free(dirc);
-    free(basec);
-    free(current);
     return 0;
     err:
-        free(dirc);
-        free(basec);
-        free(current);
         return -1;
 }
 
 int read_file(char *filepath, char *data, int length, int offset) {
+    STAT_OP(OP_READ_FILE);
     int retval = -1;
     if(!dir_initialized) {
         printf("Directory system not initialized.\n");
         return -1;
     }
-    char* dirc = strdup(filepath);
-    char* basec = strdup(filepath);
-    char* parent = dirname(dirc);
-    char* base = basename(basec);
+    char path[MAX_PATH_LEN];
+    char *parent, *base;
+    if(split_path(filepath, path, &parent, &base) < 0)
+        return -1;
     if(strlen(base) >= MAX_LEN) {
         printf("Filename too long.\n");
-        free(dirc);
-        free(basec);
         return -1;
     }
     int par_inode = find_dir(parent);
-    dir_item* current = (dir_item*) malloc(sizeof(dir_item));
-    if(!current) {
-        free(dirc);
-        free(basec);
-        return -1;
-    }
+    dir_item current;
     if(par_inode < 0) {
         printf("Parent directory not found.\n");
         goto err;
     }
     int diroffset = 0;
     while(diroffset < get_filesize(par_inode)) {
-        if(read_i(par_inode, (char*) current, sizeof(dir_item), diroffset) < 0) {
+        if(read_i(par_inode, (char*) &current, sizeof(dir_item), diroffset) < 0) {
             goto err;
         }
-        if(strcmp(current->filename, base)==0) {
-            if(!current->valid) {
+        if(current.valid && strcmp(current.filename, base)==0) {
+            if(!current.valid) {
                 goto err;
             }
-            if((retval = read_i(current->inumber, data, length, offset)) < 0) {
+            if((retval = read_i(current.inumber, data, length, offset)) < 0) {
                 goto err;
             }
             break;
         }
         diroffset += sizeof(dir_item);
     }
-    free(dirc);
-    free(basec);
-    free(current);
     return retval;
     err:
-        free(dirc);
-        free(basec);
-        free(current);
         return -1;
 }
 
 int write_file(char *filepath, char *data, int length, int offset) {
+    STAT_OP(OP_WRITE_FILE);
     int retval = -1;
     if(!dir_initialized) {
         printf("Directory system not initialized.\n");
         return -1;
     }
-    char* dirc = strdup(filepath);
-    char* basec = strdup(filepath);
-    char* parent = dirname(dirc);
-    char* base = basename(basec);
+    char path[MAX_PATH_LEN];
+    char *parent, *base;
+    if(split_path(filepath, path, &parent, &base) < 0)
+        return -1;
     if(strlen(base) >= MAX_LEN) {
         printf("Filename too long.\n");
-        free(dirc);
-        free(basec);
         return -1;
     }
     int par_inode = find_dir(parent);
-    dir_item* current = (dir_item*) malloc(sizeof(dir_item));
-    if(!current) {
-        free(dirc);
-        free(basec);
-        return -1;
-    }
+    dir_item current;
     if(par_inode < 0) {
         printf("Parent directory not found.\n");
         goto err;
     }
     int diroffset = 0;
     while(diroffset < get_filesize(par_inode)) {
-        if(read_i(par_inode, (char*) current, sizeof(dir_item), diroffset) < 0) {
+        if(read_i(par_inode, (char*) &current, sizeof(dir_item), diroffset) < 0) {
             goto err;
         }
-        if(strcmp(current->filename, base)==0) {
-            if(!current->valid) {
+        if(current.valid && strcmp(current.filename, base)==0) {
+            if(!current.valid) {
                 goto err;
             }
-            if((retval = write_i(current->inumber, data, length, offset)) < 0) {
+            if((retval = write_i(current.inumber, data, length, offset)) < 0) {
                 goto err;
             }
             break;
         }
         diroffset += sizeof(dir_item);
     }
-    free(dirc);
-    free(basec);
-    free(current);
     return retval;
     err:
-        free(dirc);
-        free(basec);
-        free(current);
         return -1;
-}
\ No newline at end of file
+}
+
+int open_dir(char *dirpath) {
+    STAT_OP(OP_OPEN_DIR);
+    int inumber = find_dir(dirpath);
+    if(inumber < 0) {
+        printf("Directory not found.\n");
+        return -1;
+    }
+    for(int i=0; i<MAX_OPEN_DIRS; i++) {
+        if(dir_handles[i].in_use)
+            continue;
+        dir_handles[i].chunk = chunk_items();
+        dir_handles[i].buffer = (dir_item*) malloc(dir_handles[i].chunk*sizeof(dir_item));
+        if(!dir_handles[i].buffer)
+            return -1;
+        dir_handles[i].in_use = 1;
+        dir_handles[i].inumber = inumber;
+        dir_handles[i].offset = 0;
+        dir_handles[i].buffered = 0;
+        dir_handles[i].next = 0;
+        return i;
+    }
+    printf("Too many open directories.\n");
+    return -1;
+}
+
+int readdir_batch(int dirfd, dir_entry *entries, int max) {
+    STAT_OP(OP_READDIR_BATCH);
+    if(dirfd < 0 || dirfd >= MAX_OPEN_DIRS || !dir_handles[dirfd].in_use || max < 0)
+        return -1;
+    dir_handle* handle = dir_handles+dirfd;
+    int count = 0;
+    while(count < max) {
+        if(handle->next == handle->buffered) {
+            handle->offset += handle->buffered*sizeof(dir_item);
+            handle->buffered = 0;
+            handle->next = 0;
+            int size = get_filesize(handle->inumber);
+            if(size < 0)
+                return -1;
+            if(handle->offset >= size)
+                break;
+            int bytesread = read_i(handle->inumber, (char*) handle->buffer, handle->chunk*sizeof(dir_item), handle->offset);
+            if(bytesread < 0)
+                return -1;
+            handle->buffered = bytesread/sizeof(dir_item);
+            if(!handle->buffered)
+                break;
+        }
+        dir_item* current = handle->buffer + handle->next++;
+        if(!current->valid)
+            continue;
+        entries[count].inumber = current->inumber;
+        entries[count].is_dir = current->is_dir;
+        entries[count].name_len = current->filename_len;
+        memcpy(entries[count].name, current->filename, MAX_LEN);
+        count++;
+    }
+    return count;
+}
+
+int close_dir(int dirfd) {
+    if(dirfd < 0 || dirfd >= MAX_OPEN_DIRS || !dir_handles[dirfd].in_use)
+        return -1;
+    free(dir_handles[dirfd].buffer);
+    dir_handles[dirfd].buffer = NULL;
+    dir_handles[dirfd].in_use = 0;
+    return 0;
+}
+
+int rename_path(char *oldpath, char *newpath) {
+    STAT_OP(OP_RENAME_PATH);
+    if(!dir_initialized) {
+        printf("Directory system not initialized.\n");
+        return -1;
+    }
+    int retval = -1;
+    char oldcopy[MAX_PATH_LEN], newcopy[MAX_PATH_LEN];
+    char *olddir, *oldbase, *newdir, *newbase;
+    if(split_path(oldpath, oldcopy, &olddir, &oldbase) < 0 || split_path(newpath, newcopy, &newdir, &newbase) < 0)
+        return -1;
+    int old_parent = find_dir(olddir);
+    int new_parent = find_dir(newdir);
+    rename_intent intent;
+    dir_item target;
+    int freespot;
+    if(strlen(newbase) >= MAX_LEN) {
+        printf("Filename too long.\n");
+        goto out;
+    }
+    if(old_parent < 0 || new_parent < 0) {
+        printf("Parent directory not found.\n");
+        goto out;
+    }
+    if(quota_tenant(old_parent) != quota_tenant(new_parent)) {
+        printf("Cannot move across quota directories.\n");
+        goto out;
+    }
+    int src_offset = lookup_entry(old_parent, oldbase, &intent.item, &freespot);
+    if(src_offset < 0) {
+        printf("Rename source not found.\n");
+        goto out;
+    }
+    if(intent.item.is_dir) {
+        // a directory cannot be moved below itself, whatever the spelling of the two paths
+        int above;
+        if(walk_dir(newdir, intent.item.inumber, &above) < 0 || above) {
+            printf("Cannot move a directory into itself.\n");
+            goto out;
+        }
+    }
+    int dst_offset = lookup_entry(new_parent, newbase, &target, &freespot);
+    if(dst_offset == -2)
+        goto out;
+    intent.replaced = -1;
+    if(dst_offset >= 0) {
+        if(target.inumber == intent.item.inumber) {
+            // both names already refer to the same file
+            retval = 0;
+            goto out;
+        }
+        if(target.is_dir != intent.item.is_dir) {
+            printf("Rename target is of a different type.\n");
+            goto out;
+        }
+        if(target.is_dir && dir_is_empty(target.inumber) != 1) {
+            printf("Rename target directory not empty.\n");
+            goto out;
+        }
+        intent.replaced = target.inumber;
+        intent.replaced_links = get_link_count(target.inumber);
+    } else if(freespot >= 0) {
+        dst_offset = freespot;
+    } else {
+        dst_offset = get_filesize(new_parent);
+    }
+    intent.src_dir = old_parent;
+    intent.src_offset = src_offset;
+    intent.dst_dir = new_parent;
+    intent.dst_offset = dst_offset;
+    memset(intent.item.filename, 0, MAX_LEN);
+    strcpy(intent.item.filename, newbase);
+    intent.item.filename_len = strlen(newbase);
+    retval = rename_entry(&intent);
+    out:
+        return retval;
+}
+
+int link_path(char *existing, char *newpath) {
+    STAT_OP(OP_LINK_PATH);
+    if(!dir_initialized) {
+        printf("Directory system not initialized.\n");
+        return -1;
+    }
+    int retval = -1;
+    char oldcopy[MAX_PATH_LEN], newcopy[MAX_PATH_LEN];
+    char *olddir, *oldbase, *newdir, *newbase;
+    if(split_path(existing, oldcopy, &olddir, &oldbase) < 0 || split_path(newpath, newcopy, &newdir, &newbase) < 0)
+        return -1;
+    int old_parent = find_dir(olddir);
+    int new_parent = find_dir(newdir);
+    dir_item current, item;
+    int freespot;
+    if(strlen(newbase) >= MAX_LEN) {
+        printf("Filename too long.\n");
+        goto out;
+    }
+    if(old_parent < 0 || new_parent < 0) {
+        printf("Parent directory not found.\n");
+        goto out;
+    }
+    if(quota_tenant(old_parent) != quota_tenant(new_parent)) {
+        printf("Cannot link across quota directories.\n");
+        goto out;
+    }
+    if(lookup_entry(old_parent, oldbase, &item, &freespot) < 0) {
+        printf("Link source not found.\n");
+        goto out;
+    }
+    if(item.is_dir) {
+        printf("Cannot link a directory.\n");
+        goto out;
+    }
+    int offset = lookup_entry(new_parent, newbase, &current, &freespot);
+    if(offset != -1) {
+        if(offset >= 0)
+            printf("Duplicate filename.\n");
+        goto out;
+    }
+    if(freespot < 0)
+        freespot = get_filesize(new_parent);
+    // the count goes up before the entry exists, so a crash in between leaks the
+    // file rather than leaving a name that would free it early
+    if(link_inode(item.inumber) < 0)
+        goto out;
+    memset(item.filename, 0, MAX_LEN);
+    strcpy(item.filename, newbase);
+    item.filename_len = strlen(newbase);
+    if(write_i(new_parent, (char*) &item, sizeof(dir_item), freespot) < 0) {
+        printf("Parent directory update failed.\n");
+        unlink_inode(item.inumber);
+        goto out;
+    }
+    retval = 0;
+    out:
+        return retval;
+}
+// Quotas are only kept for top level directories, so that each file is charged to exactly
+// one of them.
+static int top_level_dir(char *dirpath) {
+    char path[MAX_PATH_LEN];
+    char *parent_path, *base;
+    if(split_path(dirpath, path, &parent_path, &base) < 0)
+        return -1;
+    int inumber = find_dir(dirpath);
+    int parent = find_dir(parent_path);
+    if(inumber <= ROOT_INODE || parent != ROOT_INODE) {
+        printf("Not a top level directory.\n");
+        return -1;
+    }
+    return inumber;
+}
+
+int set_quota(char *dirpath, uint32_t max_blocks, uint32_t max_inodes) {
+    if(!dir_initialized) {
+        printf("Directory system not initialized.\n");
+        return -1;
+    }
+    int inumber = top_level_dir(dirpath);
+    if(inumber < 0)
+        return -1;
+    return set_quota_inode(inumber, max_blocks, max_inodes);
+}
+
+int get_quota_usage(char *dirpath, quota_usage *usage) {
+    if(!dir_initialized) {
+        printf("Directory system not initialized.\n");
+        return -1;
+    }
+    int inumber = top_level_dir(dirpath);
+    if(inumber < 0)
+        return -1;
+    return get_quota_inode(inumber, usage);
+}
@@ -1,66 +1,633 @@
+#define _GNU_SOURCE
 #include "disk.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sched.h>
+#include <sys/stat.h>
 
-disk* create_disk(int nbytes) {
+#define NO_PAGE UINT32_MAX
+#define SLEEP_STEP 50000 // ns of simulated time gathered before a real sleep
+#define TRIM_BLOCKS 256 // blocks discarded from a RAM disk before the heap is trimmed
+
+// Flash translation layer of the SSD and NVMe models: blocks are written out of place to
+// the open erase block of the next channel, and once free erase blocks run out the full
+// one with the fewest valid pages is relocated and erased (greedy garbage collection).
+typedef struct flash {
+    uint32_t pages; // blocks per erase block
+    uint32_t ebs; // erase blocks, over-provisioned beyond the logical size
+    uint32_t* l2p; // physical page of each block, NO_PAGE if never written
+    uint32_t* p2l; // block stored in each physical page, NO_PAGE if free or stale
+    uint32_t* valid; // valid pages of each erase block
+    uint32_t* fill; // pages programmed in each erase block
+    uint32_t* eb_channel; // channel each erase block was opened on
+    uint32_t* open; // open erase block of each channel, NO_PAGE if none
+    uint32_t* free_ebs;
+    uint32_t free_count;
+    uint32_t next_channel;
+    int collecting; // relocations of a collection do not start another one
+} flash;
+
+typedef struct disk_sim {
+    disk_model model;
+    uint32_t blocks;
+    uint64_t now; // virtual time of the caller
+    uint64_t idle; // virtual time the device finishes everything issued so far
+    uint64_t slept; // virtual time already slept for
+    int64_t head; // HDD: block under the head
+    uint64_t* channel_free; // flash: when each channel is done with its work
+    uint64_t* inflight; // flash: completion of the last queue_depth writes
+    uint32_t next_slot;
+    flash ftl;
+    disk_sim_stats stats;
+} disk_sim;
+
+// 64 bit totals and the device model kept after the disk struct in the same allocation, so
+// sizeof(disk) and the block count create_disk derives from it stay what they always were
+typedef struct disk_ext {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t size; // bytes of the disk, disk.size stops at UINT32_MAX
+    uint32_t resident; // blocks with memory of their own
+    uint32_t untrimmed; // blocks freed since the heap was last given back to the system
+    int fd; // image file of a file-backed disk, -1 for a RAM disk
+    char* arena; // blocks of a loaded image, contiguous so a larger file system block is one run
+    disk_sim* sim; // NULL for plain memory
+} disk_ext;
+#define EXT(diskptr) ((disk_ext*) ((diskptr)+1))
+
+static void (*disk_trace_hook)(disk *diskptr, uint32_t blocknr, int write, const void *block_data) = NULL;
+static long trace_hook_calls = 0; // read_block/write_block calls that may be in the hook
+
+static uint64_t transfer_ns(disk_model* m) {
+    return m->mb_per_sec ? (uint64_t) BLOCKSIZE*1000000000ull/((uint64_t) m->mb_per_sec*1024*1024) : 0;
+}
+
+static void free_sim(disk_sim* sim) {
+    if(!sim)
+        return;
+    free(sim->channel_free);
+    free(sim->inflight);
+    free(sim->ftl.l2p);
+    free(sim->ftl.p2l);
+    free(sim->ftl.valid);
+    free(sim->ftl.fill);
+    free(sim->ftl.eb_channel);
+    free(sim->ftl.open);
+    free(sim->ftl.free_ebs);
+    free(sim);
+}
+
+static void hdd_access(disk_sim* sim, uint32_t blocknr) {
+    disk_model* m = &sim->model;
+    uint64_t cost = transfer_ns(m);
+    if(blocknr != sim->head+1) {
+        // seek time grows with the square root of the distance, then half a rotation
+        double distance = llabs((int64_t) blocknr - sim->head)/(double) sim->blocks;
+        if(blocknr != sim->head)
+            cost += m->seek_min_ns + (uint64_t) ((m->seek_max_ns - m->seek_min_ns)*sqrt(distance));
+        cost += m->rpm ? 30000000000ull/m->rpm : 0;
+        sim->stats.seeks++;
+    }
+    sim->head = blocknr;
+    sim->now += cost;
+    sim->idle = sim->now;
+}
+
+// programs one page of block on channel c at or after time at, returns when it is done
+static uint64_t flash_program(disk_sim* sim, uint32_t c, uint32_t block, uint64_t at);
+
+static uint32_t flash_open(disk_sim* sim, uint32_t c) {
+    flash* f = &sim->ftl;
+    uint32_t eb = f->free_ebs[--f->free_count];
+    f->fill[eb] = 0;
+    f->valid[eb] = 0;
+    f->eb_channel[eb] = c;
+    f->open[c] = eb;
+    return eb;
+}
+
+// relocates the valid pages of the full erase block with the fewest of them and erases it
+static void flash_collect(disk_sim* sim, uint64_t at) {
+    flash* f = &sim->ftl;
+    uint32_t victim = NO_PAGE;
+    for(uint32_t eb=0; eb<f->ebs; eb++) {
+        if(f->fill[eb] == f->pages && f->open[f->eb_channel[eb]] != eb && (victim == NO_PAGE || f->valid[eb] < f->valid[victim]))
+            victim = eb;
+    }
+    if(victim == NO_PAGE)
+        return;
+    uint32_t c = f->eb_channel[victim];
+    f->collecting = 1;
+    for(uint32_t p=victim*f->pages; p<(victim+1)*f->pages && f->valid[victim]; p++) {
+        if(f->p2l[p] == NO_PAGE)
+            continue;
+        sim->channel_free[c] = (sim->channel_free[c] > at ? sim->channel_free[c] : at) + sim->model.read_ns;
+        flash_program(sim, c, f->p2l[p], sim->channel_free[c]);
+    }
+    f->collecting = 0;
+    sim->channel_free[c] = (sim->channel_free[c] > at ? sim->channel_free[c] : at) + sim->model.erase_ns;
+    f->fill[victim] = 0;
+    f->free_ebs[f->free_count++] = victim;
+    sim->stats.erases++;
+}
+
+static uint64_t flash_program(disk_sim* sim, uint32_t c, uint32_t block, uint64_t at) {
+    flash* f = &sim->ftl;
+    uint32_t eb = f->open[c];
+    if(eb == NO_PAGE || f->fill[eb] == f->pages) {
+        f->open[c] = NO_PAGE;
+        // relocations stay on the victim's channel and open at most one erase block, so
+        // keeping one free per channel means a collection always has somewhere to go
+        for(uint32_t i=0; !f->collecting && f->free_count <= sim->model.channels && i < f->ebs; i++)
+            flash_collect(sim, at);
+        // a collection of a victim on this channel may already have opened a new one
+        eb = f->open[c];
+        if(eb == NO_PAGE || f->fill[eb] == f->pages)
+            eb = flash_open(sim, c);
+    }
+    uint32_t old = f->l2p[block];
+    if(old != NO_PAGE) {
+        f->p2l[old] = NO_PAGE;
+        f->valid[old/f->pages]--;
+    }
+    uint32_t page = eb*f->pages + f->fill[eb]++;
+    f->p2l[page] = block;
+    f->l2p[block] = page;
+    f->valid[eb]++;
+    sim->stats.programs++;
+    uint64_t done = (sim->channel_free[c] > at ? sim->channel_free[c] : at) + sim->model.program_ns;
+    sim->channel_free[c] = done;
+    return done;
+}
+
+// discarded blocks no longer hold valid pages, so collections do not relocate them
+static void flash_trim(disk_sim* sim, uint32_t blocknr, uint32_t count) {
+    flash* f = &sim->ftl;
+    for(uint32_t i=blocknr; i-blocknr<count; i++) {
+        uint32_t page = f->l2p[i];
+        if(page == NO_PAGE)
+            continue;
+        f->p2l[page] = NO_PAGE;
+        f->valid[page/f->pages]--;
+        f->l2p[i] = NO_PAGE;
+    }
+}
+
+static void flash_access(disk_sim* sim, uint32_t blocknr, int write) {
+    disk_model* m = &sim->model;
+    flash* f = &sim->ftl;
+    uint64_t done;
+    if(write) {
+        // the write is posted once it is on the device, unless the queue is full
+        uint64_t* slot = sim->inflight + sim->next_slot;
+        sim->next_slot = (sim->next_slot+1) % m->queue_depth;
+        if(*slot > sim->now) {
+            sim->now = *slot;
+            sim->stats.queue_waits++;
+        }
+        sim->now += transfer_ns(m);
+        done = flash_program(sim, f->next_channel, blocknr, sim->now);
+        f->next_channel = (f->next_channel+1) % m->channels;
+        *slot = done;
+    } else {
+        uint32_t page = f->l2p[blocknr];
+        uint32_t c = page == NO_PAGE ? blocknr % m->channels : f->eb_channel[page/f->pages];
+        done = (sim->channel_free[c] > sim->now ? sim->channel_free[c] : sim->now) + m->read_ns;
+        sim->channel_free[c] = done;
+        done += transfer_ns(m);
+        sim->now = done;
+    }
+    if(done > sim->idle)
+        sim->idle = done;
+}
+
+static void simulate(disk_sim* sim, uint32_t blocknr, int write) {
+    if(sim->model.kind == DISK_HDD)
+        hdd_access(sim, blocknr);
+    else
+        flash_access(sim, blocknr, write);
+    if(sim->model.real_sleep && sim->now - sim->slept >= SLEEP_STEP) {
+        uint64_t ns = sim->now - sim->slept;
+        struct timespec t = {ns/1000000000ull, ns%1000000000ull};
+        nanosleep(&t, NULL);
+        sim->slept = sim->now;
+    }
+}
+
+// Blocks are materialized on their first write. Until then block_arr holds NULL and the
+// block reads as the shared zero page, so creating a disk touches none of its blocks.
+static char* zero_page;
+
+static char* backing(disk* diskptr, uint32_t blocknr) {
+    return diskptr->block_arr[blocknr] ? diskptr->block_arr[blocknr] : zero_page;
+}
+
+static char* materialize(disk* diskptr, uint32_t blocknr) {
+    if(!diskptr->block_arr[blocknr]) {
+        diskptr->block_arr[blocknr] = (char*) calloc(1, BLOCKSIZE);
+        if(diskptr->block_arr[blocknr])
+            EXT(diskptr)->resident++;
+    }
+    return diskptr->block_arr[blocknr];
+}
+
+disk* create_disk(uint64_t nbytes) {
     disk* diskptr;
     if(nbytes < sizeof(disk)) {
         //disk too small
         return NULL;
+    } else if((nbytes-sizeof(disk))/BLOCKSIZE > UINT32_MAX) {
+        //more blocks than a block number addresses
+        return NULL;
     } else {
-        diskptr = (disk*) malloc(sizeof(disk));
+        if(!__atomic_load_n(&zero_page, __ATOMIC_ACQUIRE)) {
+            char* page = (char*) calloc(1, BLOCKSIZE);
+            char* expected = NULL;
+            if(!page)
+                return NULL;
+            if(!__atomic_compare_exchange_n(&zero_page, &expected, page, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                free(page);
+        }
+        diskptr = (disk*) malloc(sizeof(disk) + sizeof(disk_ext));
         if(diskptr==NULL) {
             //error in stat block
             return NULL;
         }
-        diskptr->size = nbytes;
+        diskptr->size = nbytes > UINT32_MAX ? UINT32_MAX : nbytes;
         diskptr->reads = 0;
         diskptr->writes = 0;
+        EXT(diskptr)->reads = 0;
+        EXT(diskptr)->writes = 0;
+        EXT(diskptr)->size = nbytes;
+        EXT(diskptr)->resident = 0;
+        EXT(diskptr)->untrimmed = 0;
+        EXT(diskptr)->fd = -1;
+        EXT(diskptr)->arena = NULL;
+        EXT(diskptr)->sim = NULL;
         diskptr->blocks = (nbytes-sizeof(disk))/BLOCKSIZE;
-        diskptr->block_arr = (char **) malloc(diskptr->blocks * sizeof(char*));
+        diskptr->block_arr = (char **) calloc(diskptr->blocks ? diskptr->blocks : 1, sizeof(char*));
         if(diskptr->block_arr==NULL) {
             //error in array of pointers
             free(diskptr);
             return NULL;
         }
-        for(int i=0; i<diskptr->blocks; i++) {
-            diskptr->block_arr[i] = (char *) malloc(BLOCKSIZE*sizeof(char));
-            if(diskptr->block_arr[i]==NULL) {
-                //error allocating disk memory
-                for(int j=0; j<i; j++) {
-                    free(diskptr->block_arr[j]);
-                }
-                free(diskptr);
-                return NULL;
-            }
-        }
     }
     return diskptr;
 }
 
-int read_block(disk *diskptr, int blocknr, void *block_data) {
-    if(blocknr < 0 || blocknr > (int) diskptr->blocks-1) {
+disk* open_disk_file(const char *path, uint64_t nbytes) {
+    if(nbytes && (nbytes < sizeof(disk) + BLOCKSIZE || (nbytes-sizeof(disk))/BLOCKSIZE > UINT32_MAX)) {
+        return NULL;
+    }
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || (!nbytes && (st.st_size < BLOCKSIZE || st.st_size%BLOCKSIZE || st.st_size/BLOCKSIZE > UINT32_MAX))) {
+        close(fd);
+        return NULL;
+    }
+    // an image holds the blocks only, as save_disk writes them; extending it leaves a hole.
+    // An image larger than the disk asked for is refused, cutting it would lose its end.
+    uint32_t blocks = nbytes ? (nbytes-sizeof(disk))/BLOCKSIZE : st.st_size/BLOCKSIZE;
+    off_t bytes = (off_t) blocks*BLOCKSIZE;
+    if(st.st_size > bytes || (st.st_size < bytes && ftruncate(fd, bytes) < 0)) {
+        close(fd);
+        return NULL;
+    }
+    disk* diskptr = (disk*) malloc(sizeof(disk) + sizeof(disk_ext));
+    if(!diskptr) {
+        close(fd);
+        return NULL;
+    }
+    uint64_t size = (uint64_t) blocks*BLOCKSIZE + sizeof(disk);
+    diskptr->size = size > UINT32_MAX ? UINT32_MAX : size;
+    diskptr->blocks = blocks;
+    diskptr->reads = 0;
+    diskptr->writes = 0;
+    diskptr->block_arr = NULL;
+    memset(EXT(diskptr), 0, sizeof(disk_ext));
+    EXT(diskptr)->size = size;
+    EXT(diskptr)->fd = fd;
+    return diskptr;
+}
+
+// reads a block without counting it
+static int fetch(disk* diskptr, uint32_t blocknr, void* block_data) {
+    if(EXT(diskptr)->fd >= 0)
+        return pread(EXT(diskptr)->fd, block_data, BLOCKSIZE, (off_t) blocknr*BLOCKSIZE) == BLOCKSIZE ? 0 : -1;
+    memcpy(block_data, backing(diskptr, blocknr), BLOCKSIZE);
+    return 0;
+}
+
+int peek_block(disk *diskptr, uint32_t blocknr, void *block_data) {
+    if(blocknr >= diskptr->blocks) {
+        return -1;
+    }
+    return fetch(diskptr, blocknr, block_data);
+}
+
+// The call is counted before the hook is loaded, so once disk_set_trace_hook has seen no
+// calls after storing a new hook, none can still be running the old one.
+static void trace_block(disk* diskptr, uint32_t blocknr, int write, const void* block_data) {
+    if(!__atomic_load_n(&disk_trace_hook, __ATOMIC_RELAXED))
+        return;
+    __atomic_fetch_add(&trace_hook_calls, 1, __ATOMIC_SEQ_CST);
+    void (*hook)(disk*, uint32_t, int, const void*) = __atomic_load_n(&disk_trace_hook, __ATOMIC_SEQ_CST);
+    if(hook)
+        hook(diskptr, blocknr, write, block_data);
+    __atomic_fetch_sub(&trace_hook_calls, 1, __ATOMIC_RELEASE);
+}
+
+void disk_set_trace_hook(void (*hook)(disk *diskptr, uint32_t blocknr, int write, const void *block_data)) {
+    __atomic_store_n(&disk_trace_hook, hook, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&trace_hook_calls, __ATOMIC_SEQ_CST))
+        sched_yield();
+}
+
+int read_block(disk *diskptr, uint32_t blocknr, void *block_data) {
+    if(blocknr >= diskptr->blocks) {
+        return -1;
+    }
+    if(fetch(diskptr, blocknr, block_data) < 0) {
         return -1;
     }
-    memcpy(block_data, diskptr->block_arr[blocknr], BLOCKSIZE);
     diskptr->reads++;
+    EXT(diskptr)->reads++;
+    if(EXT(diskptr)->sim)
+        simulate(EXT(diskptr)->sim, blocknr, 0);
+    trace_block(diskptr, blocknr, 0, block_data);
     return 0;
 }
 
-int write_block(disk *diskptr, int blocknr, void *block_data) {
-    if(blocknr < 0 || blocknr > (int) diskptr->blocks-1) {
+int write_block(disk *diskptr, uint32_t blocknr, void *block_data) {
+    if(blocknr >= diskptr->blocks) {
         return -1;
     }
-    memcpy(diskptr->block_arr[blocknr], block_data, BLOCKSIZE);
+    if(EXT(diskptr)->fd >= 0) {
+        if(pwrite(EXT(diskptr)->fd, block_data, BLOCKSIZE, (off_t) blocknr*BLOCKSIZE) != BLOCKSIZE)
+            return -1;
+    } else {
+        char* block = materialize(diskptr, blocknr);
+        if(!block) {
+            return -1;
+        }
+        memcpy(block, block_data, BLOCKSIZE);
+    }
     diskptr->writes++;
+    EXT(diskptr)->writes++;
+    if(EXT(diskptr)->sim)
+        simulate(EXT(diskptr)->sim, blocknr, 1);
+    trace_block(diskptr, blocknr, 1, block_data);
     return 0;
 }
 
+int disk_model_kind(const char *name) {
+    const char* names[] = {"ram", "hdd", "ssd", "nvme"};
+    for(int i=0; i<(int) (sizeof(names)/sizeof(names[0])); i++) {
+        if(!strcmp(name, names[i]))
+            return i;
+    }
+    return -1;
+}
+
+int disk_model_preset(int kind, disk_model *model) {
+    memset(model, 0, sizeof(disk_model));
+    model->kind = kind;
+    switch(kind) {
+    case DISK_RAM:
+        return 0;
+    case DISK_HDD:
+        model->mb_per_sec = 150;
+        model->seek_min_ns = 500000;
+        model->seek_max_ns = 15000000;
+        model->rpm = 7200;
+        return 0;
+    case DISK_SSD:
+        model->mb_per_sec = 500;
+        model->read_ns = 60000;
+        model->program_ns = 250000;
+        model->erase_ns = 2000000;
+        model->erase_blocks = 64;
+        model->channels = 4;
+        model->queue_depth = 32;
+        return 0;
+    case DISK_NVME:
+        model->mb_per_sec = 3000;
+        model->read_ns = 20000;
+        model->program_ns = 100000;
+        model->erase_ns = 2000000;
+        model->erase_blocks = 64;
+        model->channels = 16;
+        model->queue_depth = 256;
+        return 0;
+    }
+    return -1;
+}
+
+int disk_set_model(disk *diskptr, const disk_model *model) {
+    if(!diskptr) {
+        return -1;
+    }
+    free_sim(EXT(diskptr)->sim);
+    EXT(diskptr)->sim = NULL;
+    if(!model || model->kind == DISK_RAM) {
+        return 0;
+    }
+    int flash_kind = model->kind == DISK_SSD || model->kind == DISK_NVME;
+    if((model->kind != DISK_HDD && !flash_kind) || (flash_kind && (!model->erase_blocks || !model->channels || !model->queue_depth))) {
+        return -1;
+    }
+    disk_sim* sim = (disk_sim*) calloc(1, sizeof(disk_sim));
+    if(!sim) {
+        return -1;
+    }
+    sim->model = *model;
+    sim->blocks = diskptr->blocks;
+    sim->head = -1;
+    if(flash_kind) {
+        flash* f = &sim->ftl;
+        f->pages = model->erase_blocks;
+        uint32_t logical = (diskptr->blocks + f->pages-1)/f->pages;
+        uint32_t spare = logical/14 > 2*model->channels+2 ? logical/14 : 2*model->channels+2;
+        f->ebs = logical + spare;
+        sim->channel_free = (uint64_t*) calloc(model->channels, sizeof(uint64_t));
+        sim->inflight = (uint64_t*) calloc(model->queue_depth, sizeof(uint64_t));
+        f->l2p = (uint32_t*) malloc(diskptr->blocks*sizeof(uint32_t));
+        f->p2l = (uint32_t*) malloc((uint64_t) f->ebs*f->pages*sizeof(uint32_t));
+        f->valid = (uint32_t*) calloc(f->ebs, sizeof(uint32_t));
+        f->fill = (uint32_t*) calloc(f->ebs, sizeof(uint32_t));
+        f->eb_channel = (uint32_t*) calloc(f->ebs, sizeof(uint32_t));
+        f->open = (uint32_t*) malloc(model->channels*sizeof(uint32_t));
+        f->free_ebs = (uint32_t*) malloc(f->ebs*sizeof(uint32_t));
+        if(!sim->channel_free || !sim->inflight || !f->l2p || !f->p2l || !f->valid || !f->fill || !f->eb_channel || !f->open || !f->free_ebs) {
+            free_sim(sim);
+            return -1;
+        }
+        memset(f->l2p, 0xff, diskptr->blocks*sizeof(uint32_t));
+        memset(f->p2l, 0xff, (uint64_t) f->ebs*f->pages*sizeof(uint32_t));
+        memset(f->open, 0xff, model->channels*sizeof(uint32_t));
+        for(uint32_t i=0; i<f->ebs; i++)
+            f->free_ebs[i] = f->ebs-1-i;
+        f->free_count = f->ebs;
+    }
+    EXT(diskptr)->sim = sim;
+    return 0;
+}
+
+int disk_sim_totals(disk *diskptr, disk_sim_stats *stats) {
+    if(!diskptr || !stats) {
+        return -1;
+    }
+    memset(stats, 0, sizeof(disk_sim_stats));
+    disk_sim* sim = EXT(diskptr)->sim;
+    if(sim) {
+        *stats = sim->stats;
+        stats->elapsed_ns = sim->idle > sim->now ? sim->idle : sim->now;
+    }
+    return 0;
+}
+
+int disk_io_totals(disk *diskptr, uint64_t *reads, uint64_t *writes) {
+    if(!diskptr) {
+        return -1;
+    }
+    *reads = EXT(diskptr)->reads;
+    *writes = EXT(diskptr)->writes;
+    return 0;
+}
+
+int discard_blocks(disk *diskptr, uint32_t blocknr, uint32_t count) {
+    if(blocknr > diskptr->blocks || count > diskptr->blocks - blocknr) {
+        return -1;
+    }
+    if(EXT(diskptr)->fd >= 0) {
+        if(count && fallocate(EXT(diskptr)->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) blocknr*BLOCKSIZE, (off_t) count*BLOCKSIZE) < 0)
+            return -1;
+    } else if(EXT(diskptr)->arena) {
+        memset(EXT(diskptr)->arena + (size_t) blocknr*BLOCKSIZE, 0, (size_t) count*BLOCKSIZE);
+    } else {
+        for(uint32_t i=blocknr; i-blocknr<count; i++) {
+            if(diskptr->block_arr[i]) {
+                free(diskptr->block_arr[i]);
+                diskptr->block_arr[i] = NULL;
+                EXT(diskptr)->resident--;
+                EXT(diskptr)->untrimmed++;
+            }
+        }
+        // freed blocks stay in the heap until it is trimmed, so RSS would follow the peak
+        if(EXT(diskptr)->untrimmed >= TRIM_BLOCKS) {
+            malloc_trim(0);
+            EXT(diskptr)->untrimmed = 0;
+        }
+    }
+    if(EXT(diskptr)->sim && EXT(diskptr)->sim->model.kind != DISK_HDD)
+        flash_trim(EXT(diskptr)->sim, blocknr, count);
+    return 0;
+}
+
+uint64_t disk_size(disk *diskptr) {
+    return EXT(diskptr)->size;
+}
+
+uint32_t disk_resident_blocks(disk *diskptr) {
+    return EXT(diskptr)->resident;
+}
+
+int inject_fault(disk *diskptr, uint32_t blocknr, int offset, uint8_t mask) {
+    if(blocknr >= diskptr->blocks || offset < 0 || offset >= BLOCKSIZE) {
+        return -1;
+    }
+    if(EXT(diskptr)->fd >= 0) {
+        uint8_t byte;
+        off_t pos = (off_t) blocknr*BLOCKSIZE + offset;
+        if(pread(EXT(diskptr)->fd, &byte, 1, pos) != 1)
+            return -1;
+        byte ^= mask;
+        return pwrite(EXT(diskptr)->fd, &byte, 1, pos) == 1 ? 0 : -1;
+    }
+    char* block = materialize(diskptr, blocknr);
+    if(!block) {
+        return -1;
+    }
+    block[offset] ^= mask;
+    return 0;
+}
+
+int save_disk(disk *diskptr, const char *path) {
+    FILE* fp = fopen(path, "wb");
+    if(!fp) {
+        return -1;
+    }
+    char* buffer = (char*) malloc(BLOCKSIZE);
+    if(!buffer) {
+        fclose(fp);
+        return -1;
+    }
+    for(uint32_t i=0; i<diskptr->blocks; i++) {
+        if(fetch(diskptr, i, buffer) < 0 || fwrite(buffer, BLOCKSIZE, 1, fp) != 1) {
+            free(buffer);
+            fclose(fp);
+            return -1;
+        }
+    }
+    free(buffer);
+    return fclose(fp) ? -1 : 0;
+}
+
+disk* load_disk(const char *path) {
+    FILE* fp = fopen(path, "rb");
+    if(!fp) {
+        return NULL;
+    }
+    if(fseek(fp, 0, SEEK_END) < 0) {
+        fclose(fp);
+        return NULL;
+    }
+    long length = ftell(fp);
+    if(length <= 0 || length%BLOCKSIZE || fseek(fp, 0, SEEK_SET) < 0) {
+        fclose(fp);
+        return NULL;
+    }
+    disk* diskptr = create_disk((uint64_t) length + sizeof(disk));
+    if(!diskptr) {
+        fclose(fp);
+        return NULL;
+    }
+    // every block of a loaded disk is resident in one arena, sfsck works on block_arr directly
+    char* arena = (char*) malloc(length);
+    if(!arena || fread(arena, length, 1, fp) != 1) {
+        free(arena);
+        free_disk(diskptr);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    for(uint32_t i=0; i<diskptr->blocks; i++)
+        diskptr->block_arr[i] = arena + (size_t) i*BLOCKSIZE;
+    EXT(diskptr)->arena = arena;
+    EXT(diskptr)->resident = diskptr->blocks;
+    return diskptr;
+}
+
 int free_disk(disk *diskptr) {
-    for(int i=0; i<(int) diskptr->blocks; i++) {
-        free(diskptr->block_arr[i]);
+    free_sim(EXT(diskptr)->sim);
+    if(EXT(diskptr)->fd >= 0) {
+        close(EXT(diskptr)->fd);
+    } else {
+        for(uint32_t i=0; i<diskptr->blocks && !EXT(diskptr)->arena; i++) {
+            free(diskptr->block_arr[i]);
+        }
+        free(EXT(diskptr)->arena);
+        free(diskptr->block_arr);
     }
-    free(diskptr->block_arr);
     free(diskptr);
     return 0;
 }
\ No newline at end of file
@@ -3,17 +3,96 @@
 const static int BLOCKSIZE = 4*1024;
 
 typedef struct disk {
-	uint32_t size; // size of the disk
+	uint32_t size; // size of the disk, UINT32_MAX for 4 GB and more; see disk_size
 	uint32_t blocks; // number of usable blocks (except stat block)
-	uint32_t reads; // number of block reads performed
-	uint32_t writes; // number of block writes performed
-	char **block_arr; // array (of size blocks) of pointers to 4KB blocks
+	uint32_t reads; // number of block reads performed, wraps; see disk_io_totals
+	uint32_t writes; // number of block writes performed, wraps; see disk_io_totals
+	char **block_arr; // array (of size blocks) of pointers to 4KB blocks, NULL until first written
 } disk;
 
-disk* create_disk(int nbytes);
+// Device models. By default a disk is plain memory and block I/O takes no simulated time.
+// With a model set, every read_block/write_block advances a virtual clock by what the
+// device would have taken, and optionally also sleeps that long.
+#define DISK_RAM 0
+#define DISK_HDD 1 // seek by block distance, rotation, media rate; no write cache
+#define DISK_SSD 2 // channels, page program and erase-block rewrites, posted writes
+#define DISK_NVME 3 // as DISK_SSD with more channels and a deeper queue
 
-int read_block(disk *diskptr, int blocknr, void *block_data);
+typedef struct disk_model {
+	int kind;	// DISK_*
+	int real_sleep;	// also sleep the simulated time, in steps of at least 50 us
+	uint32_t mb_per_sec;	// transfer rate of the media or the link
+	uint32_t seek_min_ns;	// HDD: seek to the next track
+	uint32_t seek_max_ns;	// HDD: seek across the whole disk
+	uint32_t rpm;	// HDD: spindle speed
+	uint32_t read_ns;	// flash: page read
+	uint32_t program_ns;	// flash: page program
+	uint32_t erase_ns;	// flash: erase block erase
+	uint32_t erase_blocks;	// flash: blocks per erase block
+	uint32_t channels;	// flash: independent channels, blocks are striped across them
+	uint32_t queue_depth;	// flash: writes that may be in flight before a writer waits
+} disk_model;
 
-int write_block(disk *diskptr, int blocknr, void *block_data);
+typedef struct disk_sim_stats {
+	uint64_t elapsed_ns;	// virtual time until the device is idle
+	uint64_t seeks;	// HDD: non-sequential accesses
+	uint64_t programs;	// flash: pages programmed, relocations included
+	uint64_t erases;	// flash: erase blocks erased
+	uint64_t queue_waits;	// flash: writes that waited for a free queue slot
+} disk_sim_stats;
+
+// A disk of (nbytes - sizeof(disk))/BLOCKSIZE blocks, at most UINT32_MAX of them (16 TB)
+disk* create_disk(uint64_t nbytes);
+
+// A disk backed by an image file in the layout of save_disk, created or extended to hold
+// the blocks of an nbytes disk (nbytes 0 keeps the size of an existing image). An existing
+// image larger than that is not cut, NULL is returned instead. It has no block_arr, blocks
+// are read and written with pread/pwrite.
+disk* open_disk_file(const char *path, uint64_t nbytes);
+
+int read_block(disk *diskptr, uint32_t blocknr, void *block_data);
+
+// reads a block like read_block but without counting, tracing or simulating it
+int peek_block(disk *diskptr, uint32_t blocknr, void *block_data);
+
+int write_block(disk *diskptr, uint32_t blocknr, void *block_data);
 
 int free_disk(disk *diskptr);
+
+// Hint that blocks [blocknr, blocknr+count) hold nothing of value: their memory is released,
+// or a hole is punched in the image file, and they read as zeros until written again. A
+// flash device model drops their pages.
+int discard_blocks(disk *diskptr, uint32_t blocknr, uint32_t count);
+
+// size of the disk in bytes, as given to create_disk
+uint64_t disk_size(disk *diskptr);
+
+// blocks that have been written and not discarded since, the rest share one zero page
+uint32_t disk_resident_blocks(disk *diskptr);
+
+// writes the blocks of the disk to an image file, load_disk creates a disk from one
+int save_disk(disk *diskptr, const char *path);
+
+disk* load_disk(const char *path);
+
+// 64 bit counts of the block reads and writes performed on the disk
+int disk_io_totals(disk *diskptr, uint64_t *reads, uint64_t *writes);
+
+// sets the function called after every successful read_block/write_block, NULL for none,
+// see trace.h; returns once no call can still be in the previous hook
+void disk_set_trace_hook(void (*hook)(disk *diskptr, uint32_t blocknr, int write, const void *block_data));
+
+// DISK_* for "ram", "hdd", "ssd" or "nvme", -1 for anything else
+int disk_model_kind(const char *name);
+
+// fills model with the defaults for kind
+int disk_model_preset(int kind, disk_model *model);
+
+// sets the device model of the disk, NULL for plain memory; resets the virtual clock
+int disk_set_model(disk *diskptr, const disk_model *model);
+
+// what the model has done since it was set
+int disk_sim_totals(disk *diskptr, disk_sim_stats *stats);
+
+// flips the bits of mask in byte offset of a block, without counting it as a write
+int inject_fault(disk *diskptr, uint32_t blocknr, int offset, uint8_t mask);
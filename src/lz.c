@@ -0,0 +1,138 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MINMATCH 4
+#define HASHLOG 12
+#define MAXOFFSET 65535
+// the last match has to start this far from the end, the tail is always literals
+#define MFLIMIT 12
+#define LASTLITERALS 5
+
+static uint32_t read32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int hash4(uint32_t v) {
+    return (v*2654435761U) >> (32-HASHLOG);
+}
+
+static int put_length(char** op, char* oend, int len) {
+    while(len >= 255) {
+        if(*op >= oend)
+            return -1;
+        *(*op)++ = (char) 255;
+        len -= 255;
+    }
+    if(*op >= oend)
+        return -1;
+    *(*op)++ = (char) len;
+    return 0;
+}
+
+static int put_sequence(char** op, char* oend, const char* literals, int litlen, int offset, int matchlen) {
+    if(*op + 1 + litlen > oend)
+        return -1;
+    char* token = (*op)++;
+    *token = (char) ((litlen < 15 ? litlen : 15) << 4);
+    if(litlen >= 15 && put_length(op, oend, litlen-15) < 0)
+        return -1;
+    if(*op + litlen > oend)
+        return -1;
+    memcpy(*op, literals, litlen);
+    *op += litlen;
+    if(!matchlen)
+        return 0;
+    if(*op + 2 > oend)
+        return -1;
+    *(*op)++ = (char) (offset & 0xff);
+    *(*op)++ = (char) (offset >> 8);
+    matchlen -= MINMATCH;
+    *token |= (char) (matchlen < 15 ? matchlen : 15);
+    if(matchlen >= 15 && put_length(op, oend, matchlen-15) < 0)
+        return -1;
+    return 0;
+}
+
+int lz_compress(const char *src, int srclen, char *dst, int dstcap) {
+    int table[1<<HASHLOG];
+    memset(table, -1, sizeof(table));
+    const char* ip = src;
+    const char* anchor = src;
+    const char* iend = src + srclen;
+    char* op = dst;
+    char* oend = dst + dstcap;
+    if(srclen > MFLIMIT) {
+        const char* mflimit = iend - MFLIMIT;
+        while(ip < mflimit) {
+            uint32_t seq = read32(ip);
+            int h = hash4(seq);
+            int ref = table[h];
+            table[h] = ip - src;
+            if(ref < 0 || (ip-src) - ref > MAXOFFSET || read32(src+ref) != seq) {
+                ip++;
+                continue;
+            }
+            const char* match = src + ref;
+            int matchlen = MINMATCH;
+            while(ip + matchlen < iend - LASTLITERALS && ip[matchlen] == match[matchlen])
+                matchlen++;
+            if(put_sequence(&op, oend, anchor, ip-anchor, ip-match, matchlen) < 0)
+                return 0;
+            ip += matchlen;
+            anchor = ip;
+        }
+    }
+    if(put_sequence(&op, oend, anchor, iend-anchor, 0, 0) < 0)
+        return 0;
+    return op - dst;
+}
+
+static int get_length(const char** ip, const char* iend, int* len) {
+    unsigned char b;
+    do {
+        if(*ip >= iend)
+            return -1;
+        b = (unsigned char) *(*ip)++;
+        *len += b;
+    } while(b == 255);
+    return 0;
+}
+
+int lz_decompress(const char *src, int srclen, char *dst, int dstcap) {
+    const char* ip = src;
+    const char* iend = src + srclen;
+    char* op = dst;
+    char* oend = dst + dstcap;
+    while(ip < iend) {
+        unsigned char token = (unsigned char) *ip++;
+        int litlen = token >> 4;
+        if(litlen == 15 && get_length(&ip, iend, &litlen) < 0)
+            return -1;
+        if(litlen > iend-ip || litlen > oend-op)
+            return -1;
+        memcpy(op, ip, litlen);
+        ip += litlen;
+        op += litlen;
+        if(ip == iend)
+            break;
+        if(iend-ip < 2)
+            return -1;
+        int offset = (unsigned char) ip[0] | ((unsigned char) ip[1] << 8);
+        ip += 2;
+        int matchlen = token & 15;
+        if(matchlen == 15 && get_length(&ip, iend, &matchlen) < 0)
+            return -1;
+        matchlen += MINMATCH;
+        if(offset == 0 || offset > op-dst || matchlen > oend-op)
+            return -1;
+        // byte by byte, the match may overlap the bytes being produced
+        const char* match = op - offset;
+        for(int i=0; i<matchlen; i++)
+            op[i] = match[i];
+        op += matchlen;
+    }
+    return op - dst;
+}
@@ -0,0 +1,8 @@
+// Small LZ77 block codec in the style of LZ4: byte-aligned sequences of
+// literals followed by a match of at least 4 bytes at a 16 bit offset.
+
+// Returns the compressed size, or 0 if the output would not fit in dstcap bytes.
+int lz_compress(const char *src, int srclen, char *dst, int dstcap);
+
+// Returns the decompressed size, or -1 if the input is malformed or does not fit.
+int lz_decompress(const char *src, int srclen, char *dst, int dstcap);
@@ -0,0 +1,236 @@
+#include "disk.h"
+#include "sfs.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Reads a trace written by trace_start and prints, as JSON, what the access pattern looks
+// like: traffic per block class, locality, the LRU reuse distance of every access and the
+// hit rate an LRU cache of each given size would have had. With -r the trace is also
+// replayed against a fresh disk, with -t at the pace it was recorded, and -D picks the
+// device model of that disk.
+
+#define MAX_CACHES 16
+#define DIST_BUCKETS 33 // bucket i counts reuse distances in [2^(i-1), 2^i), bucket 0 distance 0
+#define NEAR_BLOCKS 16
+
+typedef struct replay_opts {
+    int caches[MAX_CACHES];
+    int cache_count;
+    int replay;
+    int timed;
+    disk_model model; // device the trace is replayed against
+} replay_opts;
+
+static replay_opts opts;
+
+static uint64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000ull + t.tv_nsec;
+}
+
+static trace_record* load_trace(const char* path, trace_header* header, long* count) {
+    FILE* fp = fopen(path, "rb");
+    if(!fp) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        return NULL;
+    }
+    trace_record* recs = NULL;
+    if(fread(header, sizeof(trace_header), 1, fp) != 1 || header->magic != TRACE_MAGIC || header->record_size != sizeof(trace_record)) {
+        fprintf(stderr, "%s is not a trace.\n", path);
+        goto err;
+    }
+    if(fseek(fp, 0, SEEK_END) < 0)
+        goto err;
+    long length = ftell(fp) - (long) sizeof(trace_header);
+    *count = length/sizeof(trace_record);
+    recs = (trace_record*) malloc((*count ? *count : 1)*sizeof(trace_record));
+    if(!recs || fseek(fp, sizeof(trace_header), SEEK_SET) < 0 || fread(recs, sizeof(trace_record), *count, fp) != (size_t) *count)
+        goto err;
+    fclose(fp);
+    return recs;
+    err:
+        free(recs);
+        fclose(fp);
+        return NULL;
+}
+
+// Fenwick tree over record positions marking the last access of every block, so the
+// distinct blocks touched between two accesses of a block is a prefix sum difference.
+static void fen_add(int* tree, long n, long i, int delta) {
+    for(i++; i <= n; i += i & -i)
+        tree[i-1] += delta;
+}
+
+static long fen_sum(int* tree, long i) {
+    long sum = 0;
+    for(; i > 0; i -= i & -i)
+        sum += tree[i-1];
+    return sum;
+}
+
+static int analyze(trace_header* header, trace_record* recs, long count) {
+    uint64_t class_reads[BLK_CLASSES+1] = {0}, class_writes[BLK_CLASSES+1] = {0};
+    uint64_t sequential = 0, repeated = 0, near = 0, distance = 0, cold = 0, distinct = 0;
+    uint64_t dist_hist[DIST_BUCKETS] = {0};
+    uint64_t hits[MAX_CACHES] = {0};
+    int* tree = (int*) calloc(count ? count : 1, sizeof(int));
+    long* last = (long*) calloc(header->blocks ? header->blocks : 1, sizeof(long)); // position+1, 0 if not seen
+    if(!tree || !last) {
+        free(tree);
+        free(last);
+        return -1;
+    }
+    for(long i=0; i<count; i++) {
+        trace_record* r = recs+i;
+        int cls = r->cls < BLK_CLASSES ? r->cls : BLK_CLASSES;
+        (r->write ? class_writes : class_reads)[cls]++;
+        if(i) {
+            long delta = (long) r->blocknr - (long) recs[i-1].blocknr;
+            sequential += delta == 1;
+            repeated += delta == 0;
+            near += delta >= -NEAR_BLOCKS && delta <= NEAR_BLOCKS;
+            distance += delta < 0 ? -delta : delta;
+        }
+        if(r->blocknr >= header->blocks)
+            continue;
+        long prev = last[r->blocknr];
+        if(!prev) {
+            cold++;
+            distinct++;
+        } else {
+            long reuse = fen_sum(tree, i) - fen_sum(tree, prev);
+            int bucket = 0;
+            while(bucket < DIST_BUCKETS-1 && (1l << bucket) <= reuse)
+                bucket++;
+            dist_hist[bucket]++;
+            for(int c=0; c<opts.cache_count; c++)
+                hits[c] += reuse < opts.caches[c];
+            fen_add(tree, count, prev-1, -1);
+        }
+        fen_add(tree, count, i, 1);
+        last[r->blocknr] = i+1;
+    }
+    uint64_t reads = 0;
+    for(int c=0; c<=BLK_CLASSES; c++)
+        reads += class_reads[c];
+    printf("  \"records\": %ld, \"reads\": %lu, \"writes\": %lu, \"seconds\": %.6f, \"blocks\": %u, \"distinct_blocks\": %lu,\n",
+        count, reads, count - reads, count ? recs[count-1].ns/1e9 : 0, header->blocks, distinct);
+    printf("  \"classes\": {");
+    int first = 1;
+    for(int c=0; c<=BLK_CLASSES; c++) {
+        if(!class_reads[c] && !class_writes[c])
+            continue;
+        printf("%s\"%s\": {\"reads\": %lu, \"writes\": %lu}", first ? "" : ", ",
+            c < BLK_CLASSES ? sfs_class_name(c) : "unknown", class_reads[c], class_writes[c]);
+        first = 0;
+    }
+    double steps = count > 1 ? count-1 : 1;
+    printf("},\n  \"locality\": {\"sequential\": %.4f, \"repeated\": %.4f, \"within_%d\": %.4f, \"mean_distance\": %.1f},\n",
+        sequential/steps, repeated/steps, NEAR_BLOCKS, near/steps, distance/steps);
+    printf("  \"reuse_distance\": {\"cold\": %lu", cold);
+    for(int b=0; b<DIST_BUCKETS; b++) {
+        if(dist_hist[b])
+            printf(", \"<%lu\": %lu", 1ul << b, dist_hist[b]);
+    }
+    printf("},\n  \"lru_hit_rate\": {");
+    for(int c=0; c<opts.cache_count; c++)
+        printf("%s\"%d\": %.4f", c ? ", " : "", opts.caches[c], count ? hits[c]/(double) count : 0);
+    printf("}");
+    free(tree);
+    free(last);
+    return 0;
+}
+
+static int replay(trace_header* header, trace_record* recs, long count) {
+    disk* diskptr = create_disk((uint64_t) header->blocks*BLOCKSIZE + sizeof(disk));
+    char* buffer = (char*) malloc(BLOCKSIZE);
+    if(!diskptr || !buffer) {
+        fprintf(stderr, "Could not create the disk.\n");
+        free(buffer);
+        if(diskptr)
+            free_disk(diskptr);
+        return -1;
+    }
+    if(disk_set_model(diskptr, &opts.model) < 0) {
+        fprintf(stderr, "Could not set the device model.\n");
+        free(buffer);
+        free_disk(diskptr);
+        return -1;
+    }
+    memset(buffer, 0, BLOCKSIZE);
+    long failed = 0;
+    uint64_t begin = now_ns();
+    for(long i=0; i<count; i++) {
+        if(opts.timed) {
+            uint64_t elapsed = now_ns() - begin;
+            if(recs[i].ns > elapsed)
+                usleep((recs[i].ns - elapsed)/1000);
+        }
+        int ret = recs[i].write ? write_block(diskptr, recs[i].blocknr, buffer) : read_block(diskptr, recs[i].blocknr, buffer);
+        failed += ret < 0;
+    }
+    double seconds = (now_ns() - begin)/1e9;
+    printf(",\n  \"replay\": {\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"failed\": %ld",
+        seconds, seconds > 0 ? count/seconds : 0, failed);
+    if(opts.model.kind != DISK_RAM) {
+        disk_sim_stats sim;
+        disk_sim_totals(diskptr, &sim);
+        printf(", \"device_seconds\": %.6f, \"seeks\": %lu, \"programs\": %lu, \"erases\": %lu, \"write_amplification\": %.3f, \"queue_waits\": %lu",
+            sim.elapsed_ns/1e9, sim.seeks, sim.programs, sim.erases,
+            diskptr->writes ? sim.programs/(double) diskptr->writes : 0, sim.queue_waits);
+    }
+    printf("}");
+    free(buffer);
+    free_disk(diskptr);
+    return 0;
+}
+
+static void usage(char* prog) {
+    fprintf(stderr, "usage: %s [-c blocks[,blocks...]] [-r] [-t] [-D ram|hdd|ssd|nvme] trace\n", prog);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    int defaults[] = {16, 64, 256, 1024, 4096};
+    opts.cache_count = sizeof(defaults)/sizeof(int);
+    memcpy(opts.caches, defaults, sizeof(defaults));
+    int c;
+    while((c = getopt(argc, argv, "c:rtD:")) != -1) {
+        switch(c) {
+        case 'c':
+            opts.cache_count = 0;
+            for(char* tok = strtok(optarg, ","); tok && opts.cache_count < MAX_CACHES; tok = strtok(NULL, ",")) {
+                if((opts.caches[opts.cache_count++] = atoi(tok)) < 1)
+                    usage(argv[0]);
+            }
+            break;
+        case 'r': opts.replay = 1; break;
+        case 't': opts.replay = opts.timed = 1; break;
+        case 'D':
+            if(disk_model_preset(disk_model_kind(optarg), &opts.model) < 0)
+                usage(argv[0]);
+            opts.replay = 1;
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind != argc-1 || !opts.cache_count)
+        usage(argv[0]);
+    trace_header header;
+    long count;
+    trace_record* recs = load_trace(argv[optind], &header, &count);
+    if(!recs)
+        return 1;
+    printf("{\n");
+    int ret = analyze(&header, recs, count);
+    if(!ret && opts.replay)
+        ret = replay(&header, recs, count);
+    printf("\n}\n");
+    free(recs);
+    return ret ? 1 : 0;
+}
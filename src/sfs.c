@@ -1,99 +1,677 @@
+#define _GNU_SOURCE
 #include "disk.h"
 #include "sfs.h"
+#include "lz.h"
+#include "crc32c.h"
+#include "stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
 
 #define SetBit(A,k)     ( A[(k/32)] |= (1 << (k%32)) )
 #define ClearBit(A,k)   ( A[(k/32)] &= ~(1 << (k%32)) )
 #define TestBit(A,k)    ( A[(k/32)] & (1 << (k%32)) )
 
-#define MAXBLOCKS 1029
+#define DATA_CLASS(node) (((node)->flags & INODE_DIRECTORY) ? BLK_DIRECTORY : BLK_DATA)
 static disk* mountptr;
+static int mounted_snap = -1; // snapshot table slot mounted read-only, -1 for the live filesystem
+static int dedup_enabled = 0;
+static int verify_data = 0;
+static int async_unlink = 0;
+
+// Bytes per file system block of the mounted disk. A file system block is a run of
+// FS_BLOCK/BLOCKSIZE disk blocks, the super block lives in the first disk block.
+static uint32_t fs_block = MIN_BLOCK_SIZE;
+#define FS_BLOCK ((int) fs_block)
+static void set_block_size(uint32_t size);
+
+// Every call into the file system holds one recursive lock, so the background reclaimer
+// never runs in the middle of an operation. SFS_LOCKED holds it until the function returns.
+// Discards queued by the frees of an operation go out when its outermost scope ends, right
+// after the inode blocks it left dirty are written back.
+static pthread_mutex_t sfs_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static int sfs_depth = 0; // SFS_LOCKED scopes open in the thread holding the lock
+void release_discards();
+int flush_inodes(super_block* sb);
+static void sfs_unlock_scope(int* unused) {
+    if(--sfs_depth == 0) {
+        if(flush_inodes(NULL) < 0)
+            printf("ERR: Could not write back inode blocks.\n");
+        release_discards();
+    }
+    pthread_mutex_unlock(&sfs_mutex);
+}
+#define SFS_LOCKED int sfs_lock_held __attribute__((cleanup(sfs_unlock_scope))) = (pthread_mutex_lock(&sfs_mutex), sfs_depth++)
+
+// Block buffers needed for the length of a call come from a small pool kept per thread
+// rather than from the heap. Each is MAX_BLOCK_SIZE bytes, so a pool stays usable across
+// block size changes, and starts on a cache line. scratch_put(NULL) does nothing.
+#define SCRATCH_BUFFERS 16 // buffers a thread keeps around
+#define CACHE_LINE 64
+
+static __thread void* scratch_pool[SCRATCH_BUFFERS];
+static __thread int scratch_count = 0;
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_exit(void* unused) {
+    while(scratch_count > 0)
+        free(scratch_pool[--scratch_count]);
+}
+
+static void scratch_init() {
+    pthread_key_create(&scratch_key, scratch_exit);
+}
+
+static void* scratch_get() {
+    if(scratch_count > 0)
+        return scratch_pool[--scratch_count];
+    // the pool of a thread is freed when it exits
+    pthread_once(&scratch_once, scratch_init);
+    pthread_setspecific(scratch_key, scratch_pool);
+    return aligned_alloc(CACHE_LINE, MAX_BLOCK_SIZE);
+}
+
+static void* scratch_zeroed() {
+    void* buffer = scratch_get();
+    if(buffer)
+        memset(buffer, 0, FS_BLOCK);
+    return buffer;
+}
+
+static void scratch_put(void* buffer) {
+    if(!buffer)
+        return;
+    if(scratch_count < SCRATCH_BUFFERS)
+        scratch_pool[scratch_count++] = buffer;
+    else
+        free(buffer);
+}
+
+int snap_preserve(super_block* sb, int iblock);
+typedef struct block_map block_map;
+static void set_file_size(super_block* sb, inode* node, uint64_t size);
+int dedup_block(block_map* map, uint32_t blocknum, void* buffer, uint64_t* fp);
+void dedup_insert(super_block* sb, uint64_t fp, int dnumber);
+void dedup_forget(int dnumber);
+void dedup_reset();
+void map_cache_forget(uint32_t dnumber);
+static void map_cache_reset();
+static void icache_reset();
+int read_indirect(super_block* sb, uint32_t dnumber, void* buffer);
+int write_indirect(super_block* sb, uint32_t dnumber, void* buffer);
+int64_t write_compressed(super_block* sb, inode* node, int inumber, char* data, uint64_t length, uint64_t offset);
+int64_t read_compressed(super_block* sb, inode* node, int inumber, char* data, uint64_t length, uint64_t offset);
+int truncate_compressed(super_block* sb, inode* node, int inumber, uint64_t size);
+void invalidate_cluster_cache();
+void reset_csum_cache();
+int snap_map_get(super_block* sb, snapshot* snap, int iblock);
+int read_inode_block(super_block* sb, int iblock, void* buffer);
+int write_inode_block(super_block* sb, int iblock, void* buffer);
+int replay_rename(super_block* sb);
+int queue_orphan(super_block* sb, inode* buffer, int inumber);
+void wake_reclaimer();
+static void forget_discard(uint32_t blocknr);
+static void issue_discards();
+static int discard_count;
+void quota_reset();
+int quota_release(super_block* sb, int inumber, inode* node);
+int quota_tenant(int inumber);
+int quota_write_check(super_block* sb, int inumber, inode* node, uint64_t length, uint64_t offset);
+void quota_update(super_block* sb, int inumber, int before_flags, uint64_t before_size, inode* node);
 
 int format(disk *diskptr) {
+    return format_ex(diskptr, NULL);
+}
+
+int format_ex(disk *diskptr, format_opts *opts) {
+    STAT_OP(OP_FORMAT);
+    SFS_LOCKED;
     if(!diskptr)
         return -1;
     super_block sb;
-    uint32_t M = diskptr->blocks-1;
+    memset(&sb, 0, sizeof(super_block));
+    uint32_t fmt = opts ? opts->format : SFS_FORMAT_32;
+    if(fmt > SFS_FORMAT_64) {
+        printf("Invalid format.\n");
+        return -1;
+    }
+    sb.format = fmt;
+    sb.inode_size = MIN_INODE_SIZE(&sb);
+    uint32_t bs = (opts && opts->block_size) ? opts->block_size : MIN_BLOCK_SIZE;
+    if(bs < MIN_BLOCK_SIZE || bs > MAX_BLOCK_SIZE || (bs & (bs-1))) {
+        printf("Invalid block size.\n");
+        return -1;
+    }
+    sb.block_size = bs;
+    if(opts && opts->inode_size) {
+        uint32_t size = opts->inode_size;
+        if(size < MIN_INODE_SIZE(&sb) || size > MAX_INODE_SIZE || (size & (size-1))) {
+            printf("Invalid inode size.\n");
+            return -1;
+        }
+        sb.inode_size = size;
+    }
+    if(diskptr->blocks < 2*(bs/BLOCKSIZE)) {
+        return -1;
+    }
+    uint32_t M = diskptr->blocks/(bs/BLOCKSIZE)-1;
+    // block and inode numbers are handed around as int
+    if(M > INT32_MAX) {
+        printf("Disk too large for a %u byte block size.\n", bs);
+        return -1;
+    }
     uint32_t I = 0.1*M;
-    uint32_t IB = ceil(I/(double)256);
-    uint32_t R = M-I-IB;
-    uint32_t DBB = ceil(R/(double)32768);
-    uint32_t DB = R-DBB;
+    if((uint64_t) I*INODES_PER_BLOCK(&sb) > INT32_MAX)
+        I = INT32_MAX/INODES_PER_BLOCK(&sb);
+    uint32_t IB = ceil((uint64_t) I*INODES_PER_BLOCK(&sb)/(double)(8*bs));
+    // one 32 bit checksum per block of the file system, including the super block
+    uint32_t CSB = (opts && opts->checksums) ? ceil((M+1)/(double)(bs/4)) : 0;
+    uint32_t R = M-I-IB-CSB;
+    uint32_t DBB = ceil(R/(double)(8*bs));
+    // one 32 bit reference count per data block
+    uint32_t RCB = ceil((R-DBB)/(double)(bs/4+1));
+    uint32_t DB = R-DBB-RCB;
     sb.magic_number = MAGIC;
     sb.blocks = M;
     sb.inode_blocks = I;
-    sb.inodes = I*128;
+    sb.inodes = I*INODES_PER_BLOCK(&sb);
     sb.inode_bitmap_block_idx = 1;
-    sb.inode_block_idx = 1 + IB + DBB;
+    sb.inode_block_idx = 1 + IB + DBB + RCB + CSB;
     sb.data_block_bitmap_idx = 1 + IB;
-    sb.data_block_idx = 1 + IB + DBB + I;
+    sb.data_block_idx = 1 + IB + DBB + RCB + CSB + I;
     sb.data_blocks = DB;
-    void* buffer = malloc(BLOCKSIZE);
-    memcpy(buffer, &sb, sizeof(super_block));
-    if(write_block(diskptr, 0, buffer) < 0) {
-        free(buffer);
+    sb.refcount_block_idx = 1 + IB + DBB;
+    sb.csum_block_idx = 1 + IB + DBB + RCB;
+    sb.csum_blocks = CSB;
+    sb.snap_next_id = 1;
+    // the metadata region is not zeroed here, its groups are zeroed as they are first written
+    uint32_t metadata_blocks = sb.data_block_idx - sb.inode_bitmap_block_idx;
+    sb.uninit_group_blocks = ceil(metadata_blocks/(double) UNINIT_GROUPS);
+    for(uint32_t i=0; i*sb.uninit_group_blocks<metadata_blocks; i++)
+        SetBit(sb.uninit, i);
+    void* buffer = scratch_zeroed();
+    if(!buffer)
         return -1;
-    }
-    memset(buffer, 0, BLOCKSIZE);
-    for(int i=sb.inode_bitmap_block_idx; i<sb.data_block_idx; i++) {
-        if(write_block(diskptr, i, buffer) < 0) {
-            free(buffer);
-            return -1;
-        }
-    }
-    free(buffer);
-    return 0;
+    memcpy(buffer, &sb, sizeof(super_block));
+    if(diskptr == mountptr) {
+        quota_reset();
+        icache_reset();
+        map_cache_reset();
+        set_block_size(bs);
+    }
+    STAT_IO(BLK_SUPER, 1);
+    int retval = write_block(diskptr, 0, buffer);
+    scratch_put(buffer);
+    return retval;
 }
 
 int mount(disk *diskptr) {
+    STAT_OP(OP_MOUNT);
+    SFS_LOCKED;
     if(!diskptr)
         return -1;
-    super_block* sb = (super_block*) malloc(BLOCKSIZE);
+    super_block* sb = (super_block*) scratch_get();
     int retval;
-    if(!sb || read_block(diskptr, 0, sb) < 0 || sb->magic_number != MAGIC) {
+    if(!sb || (STAT_IO(BLK_SUPER, 0), read_block(diskptr, 0, sb)) < 0 || sb->magic_number != MAGIC
+            || FS_BLOCK_SIZE(sb) < MIN_BLOCK_SIZE || FS_BLOCK_SIZE(sb) > MAX_BLOCK_SIZE || (FS_BLOCK_SIZE(sb) & (FS_BLOCK_SIZE(sb)-1))
+            || sb->format > SFS_FORMAT_64) {
         retval = -1;
     } else {
+        // blocks freed on the disk mounted so far are let go of before it is switched out
+        if(discard_count && mountptr)
+            issue_discards();
         mountptr = diskptr;
-        retval = 0;
+        mounted_snap = -1;
+        set_block_size(FS_BLOCK_SIZE(sb));
+        quota_reset();
+        dedup_reset();
+        invalidate_cluster_cache();
+        reset_csum_cache();
+        icache_reset();
+        map_cache_reset();
+        retval = replay_rename(sb);
+        if(retval < 0)
+            mountptr = NULL;
+        else if(sb->orphan_count)
+            wake_reclaimer();
+    }
+    scratch_put(sb);
+    return retval;
+}
+
+// The super block of the mounted disk is kept in memory once read, writes go through.
+static char* super_cache = NULL;
+
+int read_super(super_block* sb) {
+    if(!mountptr)
+        return -1;
+    if(!super_cache) {
+        char* copy = (char*) malloc(BLOCKSIZE);
+        if(!copy)
+            return -1;
+        STAT_IO(BLK_SUPER, 0);
+        if(read_block(mountptr, 0, copy) < 0) {
+            free(copy);
+            return -1;
+        }
+        super_cache = copy;
+    }
+    memcpy(sb, super_cache, BLOCKSIZE);
+    return 0;
+}
+
+int write_super(super_block* sb) {
+    // the inode blocks go first, so the super block never gets ahead of them on disk
+    if(flush_inodes(sb) < 0)
+        return -1;
+    STAT_IO(BLK_SUPER, 1);
+    if(write_block(mountptr, 0, sb) < 0)
+        return -1;
+    if(!super_cache)
+        super_cache = (char*) malloc(BLOCKSIZE);
+    if(super_cache && super_cache != (char*) sb)
+        memcpy(super_cache, sb, BLOCKSIZE);
+    return 0;
+}
+
+// Reads or writes file system block blocknr of the mounted disk.
+static int disk_blocks(int blocknr, void* buffer, int write) {
+    int k = FS_BLOCK/BLOCKSIZE;
+    for(int i=0; i<k; i++) {
+        char* part = (char*) buffer + i*BLOCKSIZE;
+        if((write ? write_block(mountptr, blocknr*k + i, part) : read_block(mountptr, blocknr*k + i, part)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+#ifndef SFS_NO_STATS
+// What a block of the metadata region holds, from where it lies in the layout; only the
+// stats look at it.
+static int metadata_class(super_block* sb, int blocknr) {
+    if(blocknr < (int) sb->refcount_block_idx)
+        return BLK_BITMAP;
+    if(blocknr < (int) sb->csum_block_idx)
+        return BLK_REFCOUNT;
+    if(blocknr < (int) (sb->csum_block_idx + sb->csum_blocks))
+        return BLK_CSUM;
+    return BLK_INODE;
+}
+#endif
+
+// Group of the metadata block that has not been zeroed yet, or -1 if blocknr holds real contents.
+int uninit_group(super_block* sb, int blocknr) {
+    if(!sb->uninit_group_blocks || blocknr < (int) sb->inode_bitmap_block_idx || blocknr >= (int) sb->data_block_idx)
+        return -1;
+    int group = (blocknr - sb->inode_bitmap_block_idx)/sb->uninit_group_blocks;
+    return TestBit(sb->uninit, group) ? group : -1;
+}
+
+// Zeroes the group of blocknr before its first write. The flag is cleared in the caller's copy
+// of the super block too, so that writing that copy back later cannot mark the group again.
+int init_group(super_block* sb, int blocknr) {
+    int group = uninit_group(sb, blocknr);
+    if(group < 0)
+        return 0;
+    void* buffer = scratch_zeroed();
+    if(!buffer) {
+        return -1;
+    }
+    int first = sb->inode_bitmap_block_idx + group*sb->uninit_group_blocks;
+    for(int i=first; i<first+(int) sb->uninit_group_blocks && i<(int) sb->data_block_idx; i++) {
+        STAT_IO(metadata_class(sb, i), 1);
+        if(disk_blocks(i, buffer, 1) < 0) {
+            scratch_put(buffer);
+            return -1;
+        }
+    }
+    scratch_put(buffer);
+    ClearBit(sb->uninit, group);
+    return write_super(sb);
+}
+
+// Checksums are kept in memory once a checksum block has been loaded, so verifying a
+// block costs no extra read; updates are written through to the checksum region.
+static uint32_t** csum_cache = NULL; // loaded checksum blocks, indexed from csum_block_idx
+static uint32_t csum_cache_blocks = 0;
+static csum_stats csum_counters;
+
+void reset_csum_cache() {
+    for(uint32_t i=0; i<csum_cache_blocks; i++)
+        free(csum_cache[i]);
+    free(csum_cache);
+    csum_cache = NULL;
+    csum_cache_blocks = 0;
+}
+
+static uint32_t block_csum(void* buffer) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // 0 marks a block without a checksum
+    uint32_t csum = crc32c(0, buffer, FS_BLOCK);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    csum_counters.csum_ns += (end.tv_sec-start.tv_sec)*1000000000ULL + end.tv_nsec - start.tv_nsec;
+    return csum ? csum : 1;
+}
+
+static uint32_t* csum_entry(super_block* sb, int blocknr) {
+    if(!csum_cache) {
+        csum_cache = (uint32_t**) calloc(sb->csum_blocks, sizeof(uint32_t*));
+        if(!csum_cache)
+            return NULL;
+        csum_cache_blocks = sb->csum_blocks;
+    }
+    int idx = blocknr/(FS_BLOCK/4);
+    if(!csum_cache[idx]) {
+        csum_cache[idx] = (uint32_t*) malloc(FS_BLOCK);
+        if(csum_cache[idx] && uninit_group(sb, sb->csum_block_idx + idx) >= 0) {
+            memset(csum_cache[idx], 0, FS_BLOCK);
+        } else if(!csum_cache[idx] || (STAT_IO(BLK_CSUM, 0), disk_blocks(sb->csum_block_idx + idx, csum_cache[idx], 0)) < 0) {
+            free(csum_cache[idx]);
+            csum_cache[idx] = NULL;
+            return NULL;
+        }
+    }
+    return csum_cache[idx] + blocknr%(FS_BLOCK/4);
+}
+
+int read_fs_block(super_block* sb, int blocknr, void* buffer, int cls) {
+    if(uninit_group(sb, blocknr) >= 0) {
+        memset(buffer, 0, FS_BLOCK);
+        return 0;
+    }
+    STAT_IO(cls, 0);
+    if(disk_blocks(blocknr, buffer, 0) < 0)
+        return -1;
+    if(!sb->csum_blocks || (cls == BLK_DATA && !verify_data))
+        return 0;
+    uint32_t* entry = csum_entry(sb, blocknr);
+    if(!entry)
+        return -1;
+    if(!*entry)
+        return 0;
+    csum_counters.verified++;
+    if(block_csum(buffer) != *entry) {
+        csum_counters.corrupted++;
+        STAT_ERROR(ERR_CHECKSUM);
+        return -1;
+    }
+    return 0;
+}
+
+int write_fs_block(super_block* sb, int blocknr, void* buffer, int cls) {
+    STAT_IO(cls, 1);
+    if(init_group(sb, blocknr) < 0 || disk_blocks(blocknr, buffer, 1) < 0)
+        return -1;
+    if(!sb->csum_blocks)
+        return 0;
+    uint32_t* entry = csum_entry(sb, blocknr);
+    if(!entry)
+        return -1;
+    uint32_t csum = block_csum(buffer);
+    csum_counters.computed++;
+    if(*entry == csum)
+        return 0;
+    *entry = csum;
+    if(init_group(sb, sb->csum_block_idx + blocknr/(FS_BLOCK/4)) < 0)
+        return -1;
+    STAT_IO(BLK_CSUM, 1);
+    return disk_blocks(sb->csum_block_idx + blocknr/(FS_BLOCK/4), csum_cache[blocknr/(FS_BLOCK/4)], 1);
+}
+
+// Inode blocks of the mounted disk are kept in memory. A changed block is only marked
+// dirty; the dirty ones are written back in block order when the outermost SFS_LOCKED
+// scope ends or before the super block is written, so each goes out once per operation.
+#define ICACHE_BLOCKS 64
+
+typedef struct icache_slot {
+	int loaded;	// 0 for an empty slot
+	int dirty;	// changed since it was read or written back
+	int pins;	// iget references not given back with iput yet
+	uint32_t iblock;
+	uint64_t used;	// last use, the least recently used unpinned slot is reused
+	char* data;
+} icache_slot;
+
+static icache_slot icache[ICACHE_BLOCKS];
+static uint64_t icache_clock = 0;
+static int icache_flushing = 0;
+static int load_inode_block(super_block* sb, int iblock, void* buffer);
+
+// Drops the cached super block and inode blocks, dirty ones included.
+static void icache_reset() {
+    free(super_cache);
+    super_cache = NULL;
+    for(int i=0; i<ICACHE_BLOCKS; i++) {
+        free(icache[i].data);
+        memset(icache+i, 0, sizeof(icache_slot));
+    }
+}
+
+static int icache_write_back(super_block* sb, icache_slot* slot) {
+    if(write_fs_block(sb, sb->inode_block_idx + slot->iblock, slot->data, BLK_INODE) < 0)
+        return -1;
+    slot->dirty = 0;
+    return 0;
+}
+
+// Slot holding inode block iblock. Unless fill is 0 the block is read in on a miss.
+static icache_slot* icache_slot_of(super_block* sb, uint32_t iblock, int fill) {
+    icache_slot* victim = NULL;
+    for(int i=0; i<ICACHE_BLOCKS; i++) {
+        icache_slot* slot = icache+i;
+        if(slot->loaded && slot->iblock == iblock) {
+            slot->used = ++icache_clock;
+            return slot;
+        }
+        if(!slot->pins && (!victim || (victim->loaded && (!slot->loaded || slot->used < victim->used))))
+            victim = slot;
+    }
+    if(!victim) {
+        printf("ERR: Inode cache full.\n");
+        return NULL;
+    }
+    if(victim->loaded && victim->dirty && icache_write_back(sb, victim) < 0)
+        return NULL;
+    victim->loaded = 0;
+    if(!victim->data && !(victim->data = (char*) malloc(FS_BLOCK)))
+        return NULL;
+    if(fill && load_inode_block(sb, iblock, victim->data) < 0)
+        return NULL;
+    victim->loaded = 1;
+    victim->dirty = 0;
+    victim->iblock = iblock;
+    victim->used = ++icache_clock;
+    return victim;
+}
+
+static int cmp_icache_slot(const void* a, const void* b) {
+    uint32_t x = (*(icache_slot* const*) a)->iblock, y = (*(icache_slot* const*) b)->iblock;
+    return (x > y) - (x < y);
+}
+
+// Writes the dirty inode blocks back, in block order. Groups zeroed on the way are marked
+// initialized in sb, the cached super block if NULL.
+int flush_inodes(super_block* sb) {
+    if(!sb)
+        sb = (super_block*) super_cache;
+    if(icache_flushing || !mountptr || !sb)
+        return 0;
+    icache_slot* dirty[ICACHE_BLOCKS];
+    int count = 0;
+    for(int i=0; i<ICACHE_BLOCKS; i++) {
+        if(icache[i].loaded && icache[i].dirty)
+            dirty[count++] = icache+i;
+    }
+    if(!count)
+        return 0;
+    qsort(dirty, count, sizeof(icache_slot*), cmp_icache_slot);
+    // a write may zero a lazily initialized group and update the super block on the way
+    icache_flushing = 1;
+    int retval = 0;
+    for(int i=0; i<count; i++) {
+        if(icache_write_back(sb, dirty[i]) < 0) {
+            retval = -1;
+            break;
+        }
     }
-    free(sb);
+    icache_flushing = 0;
     return retval;
 }
 
+int read_inode_block(super_block* sb, int iblock, void* buffer) {
+    icache_slot* slot = icache_slot_of(sb, iblock, 1);
+    if(!slot)
+        return -1;
+    memcpy(buffer, slot->data, FS_BLOCK);
+    return 0;
+}
+
+// Replaces inode block iblock. It reaches the disk with the next flush_inodes.
+int write_inode_block(super_block* sb, int iblock, void* buffer) {
+    icache_slot* slot = icache_slot_of(sb, iblock, 0);
+    if(!slot)
+        return -1;
+    memcpy(slot->data, buffer, FS_BLOCK);
+    slot->dirty = 1;
+    return 0;
+}
+
+// Inode inumber in place in the cache, pinned there until iput. It is only read through;
+// changes go through read_inode_block and write_inode_block on a copy of the block.
+static inode* iget(super_block* sb, int inumber) {
+    icache_slot* slot = icache_slot_of(sb, inumber/INODES_PER_BLOCK(sb), 1);
+    if(!slot)
+        return NULL;
+    slot->pins++;
+    return INODE_AT(sb, slot->data, inumber);
+}
+
+static void iput(inode* node) {
+    for(int i=0; i<ICACHE_BLOCKS; i++) {
+        if(icache[i].loaded && (char*) node >= icache[i].data && (char*) node < icache[i].data + FS_BLOCK) {
+            icache[i].pins--;
+            return;
+        }
+    }
+}
+
+// Indirect blocks are kept too, in a direct mapped table indexed by data block number.
+// Every change to one is made through a block_map and written through here, and blocks
+// are dropped as they are freed, so a copy never outlives the contents it mirrors.
+#define MAP_CACHE_BLOCKS 64
+
+typedef struct map_cache_slot {
+	uint32_t dnumber;	// NO_BLOCK for an empty slot
+	char* data;	// NULL until first used
+} map_cache_slot;
+
+static map_cache_slot map_cache[MAP_CACHE_BLOCKS];
+
+static void map_cache_reset() {
+    for(int i=0; i<MAP_CACHE_BLOCKS; i++) {
+        free(map_cache[i].data);
+        map_cache[i].data = NULL;
+        map_cache[i].dnumber = NO_BLOCK;
+    }
+}
+
+void map_cache_forget(uint32_t dnumber) {
+    map_cache_slot* slot = map_cache + dnumber%MAP_CACHE_BLOCKS;
+    if(slot->dnumber == dnumber)
+        slot->dnumber = NO_BLOCK;
+}
+
+static void map_cache_store(uint32_t dnumber, void* buffer) {
+    map_cache_slot* slot = map_cache + dnumber%MAP_CACHE_BLOCKS;
+    slot->dnumber = NO_BLOCK;
+    if(!slot->data && !(slot->data = (char*) malloc(FS_BLOCK)))
+        return;
+    memcpy(slot->data, buffer, FS_BLOCK);
+    slot->dnumber = dnumber;
+}
+
+int read_indirect(super_block* sb, uint32_t dnumber, void* buffer) {
+    map_cache_slot* slot = map_cache + dnumber%MAP_CACHE_BLOCKS;
+    if(slot->data && slot->dnumber == dnumber) {
+        memcpy(buffer, slot->data, FS_BLOCK);
+        return 0;
+    }
+    if(read_fs_block(sb, sb->data_block_idx + dnumber, buffer, BLK_INDIRECT) < 0)
+        return -1;
+    map_cache_store(dnumber, buffer);
+    return 0;
+}
+
+int write_indirect(super_block* sb, uint32_t dnumber, void* buffer) {
+    map_cache_forget(dnumber);
+    if(write_fs_block(sb, sb->data_block_idx + dnumber, buffer, BLK_INDIRECT) < 0)
+        return -1;
+    map_cache_store(dnumber, buffer);
+    return 0;
+}
+
+int set_verify_data(int enable) {
+    SFS_LOCKED;
+    verify_data = enable ? 1 : 0;
+    return 0;
+}
+
+int get_csum_stats(csum_stats* stats) {
+    SFS_LOCKED;
+    if(!stats)
+        return -1;
+    *stats = csum_counters;
+    return 0;
+}
+
+int sfs_get_stats(sfs_stats* stats) {
+    SFS_LOCKED;
+    if(!stats)
+        return -1;
+    stat_snapshot(stats);
+    stats->disk_reads = stats->disk_writes = 0;
+    if(mountptr)
+        disk_io_totals(mountptr, &stats->disk_reads, &stats->disk_writes);
+    return 0;
+}
+
 int find_free_inode(super_block* sb) {
-    int retval = 0;
+    int retval = -1;
     if(!mountptr) {
         printf("ERR: Disk not mounted.\n");
         return -1;
     }
-    uint32_t* buffer = (uint32_t*) malloc(BLOCKSIZE);
+    uint32_t* buffer = (uint32_t*) scratch_get();
     if(!buffer) {
         return -1;
     }
     for(int i= sb->inode_bitmap_block_idx; i<sb->data_block_bitmap_idx; i++) {
-        if(read_block(mountptr, i, buffer) < 0) {
+        if(read_fs_block(sb, i, buffer, BLK_BITMAP) < 0) {
             retval = -1;
             break;
         }
         int found = 0;
-        for(int j=0; j<BLOCKSIZE/4; j++) {
+        for(int j=0; j<FS_BLOCK/4; j++) {
             if(buffer[j] < (UINT32_MAX)) {
                 uint32_t* wordstart = buffer+j;
                 for(int k=0; k<32; k++) {
                     if(!TestBit(wordstart, k)) {
-                        if((i-sb->inode_bitmap_block_idx)*8*BLOCKSIZE+j*32+k >= sb->inode_blocks) {
+                        if((i-sb->inode_bitmap_block_idx)*8*FS_BLOCK+j*32+k >= sb->inodes) {
+                            STAT_ERROR(ERR_NO_INODES);
                             retval = -1;
                             break;
                         }
                         SetBit(wordstart,k);
-                        if(write_block(mountptr, i, buffer) < 0) {
+                        if(write_fs_block(sb, i, buffer, BLK_BITMAP) < 0) {
                             retval = -1;
                             break;
                         }
-                        retval = (i-sb->inode_bitmap_block_idx)*8*BLOCKSIZE+j*32+k;
+                        retval = (i-sb->inode_bitmap_block_idx)*8*FS_BLOCK+j*32+k;
                         break;
                     }
                 }
@@ -103,8 +681,10 @@ int find_free_inode(super_block* sb) {
         }
         if(found)
             break;
+        if(i == sb->data_block_bitmap_idx - 1)
+            STAT_ERROR(ERR_NO_INODES);
     }
-    free(buffer);
+    scratch_put(buffer);
     return retval;
 }
 
@@ -114,32 +694,34 @@ int find_free_datablock(super_block* sb) {
         printf("ERR: Disk not mounted.\n");
         return -1;
     }
-    uint32_t* buffer = (uint32_t*) malloc(BLOCKSIZE);
+    uint32_t* buffer = (uint32_t*) scratch_get();
     if(!buffer) {
         return -1;
     }
-    for(int i= sb->data_block_bitmap_idx; i<sb->data_block_idx; i++) {
-        if(read_block(mountptr, i, buffer) < 0) {
+    for(int i= sb->data_block_bitmap_idx; i<sb->refcount_block_idx; i++) {
+        if(read_fs_block(sb, i, buffer, BLK_BITMAP) < 0) {
             retval = -1;
             break;
         }
         int found = 0;
-        for(int j=0; j<BLOCKSIZE/4; j++) {
+        for(int j=0; j<FS_BLOCK/4; j++) {
             if(buffer[j] < (UINT32_MAX)) {
                 uint32_t* wordstart = buffer+j;
                 for(int k=0; k<32; k++) {
                     if(!TestBit(wordstart, k)) {
-                        if((i-sb->data_block_bitmap_idx)*8*BLOCKSIZE+j*32+k >= sb->data_blocks) {
-                            printf("Data block limit reached.\n");
+                        if((i-sb->data_block_bitmap_idx)*8*FS_BLOCK+j*32+k >= sb->data_blocks) {
+                            STAT_ERROR(ERR_NO_SPACE);
                             retval = -1;
                             break;
                         }
                         SetBit(wordstart,k);
-                        if(write_block(mountptr, i, buffer) < 0) {
+                        if(write_fs_block(sb, i, buffer, BLK_BITMAP) < 0) {
                             retval = -1;
                             break;
                         }
-                        retval = (i-sb->data_block_bitmap_idx)*8*BLOCKSIZE+j*32+k;
+                        retval = (i-sb->data_block_bitmap_idx)*8*FS_BLOCK+j*32+k;
+                        if(discard_count)
+                            forget_discard(sb->data_block_idx + retval);
                         break;
                     }
                 }
@@ -149,8 +731,10 @@ int find_free_datablock(super_block* sb) {
         }
         if(found)
             break;
+        if(i == sb->refcount_block_idx - 1)
+            STAT_ERROR(ERR_NO_SPACE);
     }
-    free(buffer);
+    scratch_put(buffer);
     return retval;
 }
 
@@ -163,69 +747,151 @@ int free_inode_bitmap(int inumber, super_block* sb) {
     if(inumber < 0 || inumber > sb->inodes) {
         return -1;
     }
-    int* buffer = (int*) malloc(BLOCKSIZE);
+    int* buffer = (int*) scratch_get();
     if(!buffer) {
         return -1;
     }
-    if(read_block(mountptr, (int) sb->inode_bitmap_block_idx + inumber/(BLOCKSIZE*8), buffer) < 0) {
-        free(buffer);
+    if(read_fs_block(sb, (int) sb->inode_bitmap_block_idx + inumber/(FS_BLOCK*8), buffer, BLK_BITMAP) < 0) {
+        scratch_put(buffer);
         return -1;
     }
-    int block_inumber = inumber%(BLOCKSIZE*8);
+    int block_inumber = inumber%(FS_BLOCK*8);
     ClearBit(buffer, block_inumber);
-    if(write_block(mountptr, (int) sb->inode_bitmap_block_idx + inumber/(BLOCKSIZE*8), buffer) < 0) {
-        free(buffer);
+    if(write_fs_block(sb, (int) sb->inode_bitmap_block_idx + inumber/(FS_BLOCK*8), buffer, BLK_BITMAP) < 0) {
+        scratch_put(buffer);
         return -1;
     }
-    free(buffer);
+    scratch_put(buffer);
     return 0;
 }
 
-int create_file() {
+int create_file_flags(int flags) {
+    STAT_OP(OP_CREATE_FILE);
+    SFS_LOCKED;
     inode* new_inode;
     if(!mountptr) {
         printf("ERR: Disk not mounted.\n");
         return -1;
     }
-    super_block* sb = (super_block*) malloc(BLOCKSIZE);
-    if(!sb || read_block(mountptr, 0, sb) < 0) {
+    if(mounted_snap >= 0) {
+        printf("ERR: Snapshot is mounted read-only.\n");
+        return -1;
+    }
+    super_block* sb = (super_block*) scratch_get();
+    if(!sb || read_super(sb) < 0) {
+        scratch_put(sb);
         return -1;
     }
     int inode_index = find_free_inode(sb);
     if(inode_index < 0) {
-        free(sb);
+        scratch_put(sb);
         return -1;
     }
-    inode* buffer = (inode*) malloc(BLOCKSIZE);
+    inode* buffer = (inode*) scratch_get();
     if(!buffer) {
         free_inode_bitmap(inode_index, sb);
-        free(sb);
+        scratch_put(sb);
         return -1;
     }
-    if(read_block(mountptr, sb->inode_block_idx + inode_index/128, buffer) < 0) {
+    if(snap_preserve(sb, inode_index/INODES_PER_BLOCK(sb)) < 0 || read_inode_block(sb, inode_index/INODES_PER_BLOCK(sb), buffer) < 0) {
         free_inode_bitmap(inode_index, sb);
         goto err;
     }
-    new_inode = buffer+(inode_index%128);
+    new_inode = INODE_AT(sb, buffer, inode_index);
     if(new_inode->valid) {
         free_inode_bitmap(inode_index, sb);
         goto err;
     }
-    new_inode->size=0;
     new_inode->valid=1;
-    if(write_block(mountptr, sb->inode_block_idx + inode_index/128, buffer) < 0) {
+    new_inode->flags=flags;
+    new_inode->link_count=1;
+    set_file_size(sb, new_inode, 0);
+    // inodes larger than the format needs start out holding their data inline
+    if(INODE_SIZE(sb) > MIN_INODE_SIZE(sb))
+        new_inode->flags |= INODE_INLINE;
+    if(write_inode_block(sb, inode_index/INODES_PER_BLOCK(sb), buffer) < 0) {
         free_inode_bitmap(inode_index, sb);
         goto err;
     }
-    free(sb);
-    free(buffer);
+    scratch_put(sb);
+    scratch_put(buffer);
     return inode_index;
     err:
-        free(sb);
-        free(buffer);
+        scratch_put(sb);
+        scratch_put(buffer);
         return -1;
 }
 
+int create_file() {
+    return create_file_flags(0);
+}
+
+int create_dir_file() {
+    return create_file_flags(INODE_DIRECTORY);
+}
+
+// Freed data blocks are queued, by disk block number, and discarded in sorted runs at the
+// end of the operation, or by the reclaimer with async discard on. A queued block that is
+// allocated again leaves the queue before anything is written to it.
+#define DISCARD_QUEUE 1024
+static uint32_t discard_queue[DISCARD_QUEUE];
+static int discard_count = 0;
+static int async_discard = 0;
+
+static int cmp_uint32(const void* a, const void* b);
+
+static void issue_discards() {
+    qsort(discard_queue, discard_count, sizeof(uint32_t), cmp_uint32);
+    for(int i=0; i<discard_count; ) {
+        int run = 1;
+        while(i+run < discard_count && discard_queue[i+run] == discard_queue[i]+run)
+            run++;
+        discard_blocks(mountptr, discard_queue[i]*(FS_BLOCK/BLOCKSIZE), run*(FS_BLOCK/BLOCKSIZE));
+        i += run;
+    }
+    discard_count = 0;
+}
+
+static void queue_discards(super_block* sb, uint32_t* dnumbers, int count) {
+    for(int i=0; i<count; i++) {
+        if(discard_count == DISCARD_QUEUE)
+            issue_discards();
+        discard_queue[discard_count++] = sb->data_block_idx + dnumbers[i];
+    }
+}
+
+static void forget_discard(uint32_t blocknr) {
+    for(int i=0; i<discard_count; i++) {
+        if(discard_queue[i] == blocknr) {
+            discard_queue[i] = discard_queue[--discard_count];
+            return;
+        }
+    }
+}
+
+void release_discards() {
+    if(!discard_count || !mountptr)
+        return;
+    if(async_discard)
+        wake_reclaimer();
+    else
+        issue_discards();
+}
+
+int flush_discards() {
+    SFS_LOCKED;
+    int count = discard_count;
+    if(mountptr)
+        issue_discards();
+    return count;
+}
+
+int set_async_discard(int enable) {
+    SFS_LOCKED;
+    async_discard = enable ? 1 : 0;
+    return 0;
+}
+
 int free_data_bitmap(int dnumber, super_block* sb){
     if(!mountptr) {
         printf("ERR: Disk not mounted.\n");
@@ -234,534 +900,2738 @@ int free_data_bitmap(int dnumber, super_block* sb){
     if(dnumber < 0 || dnumber > sb->data_blocks) {
         return -1;
     }
-    uint32_t* buffer = (uint32_t*) malloc(BLOCKSIZE);
+    uint32_t* buffer = (uint32_t*) scratch_get();
     if(!buffer) {
         return -1;
     }
-    if(read_block(mountptr, sb->data_block_bitmap_idx + dnumber/(BLOCKSIZE*8), buffer) < 0) {
-        free(buffer);
+    if(read_fs_block(sb, sb->data_block_bitmap_idx + dnumber/(FS_BLOCK*8), buffer, BLK_BITMAP) < 0) {
+        scratch_put(buffer);
         return -1;
     }
-    int block_dnumber = dnumber%(BLOCKSIZE*8);
+    int block_dnumber = dnumber%(FS_BLOCK*8);
     ClearBit(buffer, block_dnumber);
-    if(write_block(mountptr, sb->data_block_bitmap_idx + dnumber/(BLOCKSIZE*8), buffer) < 0) {
-        free(buffer);
+    if(write_fs_block(sb, sb->data_block_bitmap_idx + dnumber/(FS_BLOCK*8), buffer, BLK_BITMAP) < 0) {
+        scratch_put(buffer);
         return -1;
     }
-    free(buffer);
+    dedup_forget(dnumber);
+    map_cache_forget(dnumber);
+    uint32_t freed = dnumber;
+    queue_discards(sb, &freed, 1);
+    scratch_put(buffer);
     return 0;
 }
 
-int free_indirect_data_bitmap(int index, super_block* sb, int indirect_blocks) {
-    if(!mountptr) {
-        printf("ERR: Disk not mounted.\n");
-        return -1;
-    }
-    if(index < 0 || index > sb->data_blocks) {
-        return -1;
-    }
-    uint32_t* buffer = (uint32_t*) malloc(BLOCKSIZE);
+// Clears the bits of a sorted list of numbers in the bitmap starting at bitmap_idx. Bits
+// sharing a word are merged into one mask and each bitmap block is read and written once.
+int clear_bitmap_bits(super_block* sb, int bitmap_idx, uint32_t* nums, int count) {
+    uint32_t* buffer = (uint32_t*) scratch_get();
     if(!buffer) {
         return -1;
     }
-    if(read_block(mountptr, sb->data_block_idx + index, buffer) < 0) {
-        free(buffer);
-        return -1;
-    }
-    for(int i=0; i<indirect_blocks; i++) {
-        if(free_data_bitmap(buffer[i], sb) < 0) {
-            free(buffer);
+    for(int i=0; i<count; ) {
+        uint32_t bblock = nums[i]/(FS_BLOCK*8);
+        if(read_fs_block(sb, bitmap_idx + bblock, buffer, BLK_BITMAP) < 0) {
+            scratch_put(buffer);
+            return -1;
+        }
+        while(i<count && nums[i]/(FS_BLOCK*8) == bblock) {
+            uint32_t word = nums[i]%(FS_BLOCK*8)/32;
+            uint32_t mask = 0;
+            for(; i<count && nums[i]/32 == bblock*(FS_BLOCK/4) + word; i++)
+                mask |= 1u << (nums[i]%32);
+            buffer[word] &= ~mask;
+        }
+        if(write_fs_block(sb, bitmap_idx + bblock, buffer, BLK_BITMAP) < 0) {
+            scratch_put(buffer);
             return -1;
         }
     }
-    if(free_data_bitmap(index, sb) < 0) {
-        free(buffer);
-        return -1;
-    }
-    free(buffer);
+    scratch_put(buffer);
     return 0;
 }
 
-int remove_file(int inumber) {
-    super_block* sb = (super_block*) malloc(BLOCKSIZE);
-    if(!sb || read_block(mountptr, 0, sb) < 0) {
+static int cmp_uint32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+// Bulk form of free_data_bitmap: sorts dnumbers and marks all of them free, writing each
+// data bitmap block touched once.
+int free_data_blocks(super_block* sb, uint32_t* dnumbers, int count) {
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
         return -1;
     }
-    if(inumber < 0 || inumber > sb->inodes) {
-        free(sb);
-        return -1;
+    qsort(dnumbers, count, sizeof(uint32_t), cmp_uint32);
+    for(int i=0; i<count; i++) {
+        if(dnumbers[i] >= sb->data_blocks)
+            return -1;
     }
-    inode* buffer = (inode*) malloc(BLOCKSIZE);
-    if(!buffer) {
-        free(sb);
+    if(clear_bitmap_bits(sb, sb->data_block_bitmap_idx, dnumbers, count) < 0)
         return -1;
+    for(int i=0; i<count; i++) {
+        dedup_forget(dnumbers[i]);
+        map_cache_forget(dnumbers[i]);
     }
-    if(read_block(mountptr, sb->inode_block_idx+(inumber/128), buffer) < 0)
-        goto err;
-    inode* del_inode = buffer+(inumber%128);
-    int n_blocks = ceil(del_inode->size/(double) BLOCKSIZE);
-    for(int i=0; i<n_blocks; i++) {
-        if(i<5) {
-            if(free_data_bitmap(del_inode->direct[i], sb) < 0)
-                goto err;
-        } else {
-            if(free_indirect_data_bitmap(del_inode->indirect, sb, n_blocks-5) < 0)
-                goto err;
-            break;
-        }
-    }
-    del_inode->valid=0;
-    if(write_block(mountptr, sb->inode_block_idx + inumber/128, buffer) < 0) {
-        goto err;
-    }
-    if(free_inode_bitmap(inumber, sb) < 0) {
-        goto err;
-    }
-    free(sb);
-    free(buffer);
+    queue_discards(sb, dnumbers, count);
     return 0;
-    err:
-        free(sb);
-        free(buffer);
-        return -1;
 }
 
-int stat(int inumber) {
+// Reference counts hold the number of references to a data block beyond the first,
+// so a freshly formatted (zeroed) refcount region means every block has one owner.
+int change_refcount(int dnumber, super_block* sb, int delta) {
     if(!mountptr) {
         printf("ERR: Disk not mounted.\n");
         return -1;
     }
-    super_block* sb = (super_block*) malloc(BLOCKSIZE);
-    if(!sb || read_block(mountptr, 0, sb) < 0) {
-        return -1;
-    }
-    if(inumber < 0 || inumber > sb->inodes) {
-        free(sb);
+    if(dnumber < 0 || dnumber >= sb->data_blocks) {
         return -1;
     }
-    inode* buffer = (inode*) malloc(BLOCKSIZE);
+    uint32_t* buffer = (uint32_t*) scratch_get();
     if(!buffer) {
-        free(sb);
         return -1;
     }
-    if(read_block(mountptr, sb->inode_block_idx + inumber/128, buffer) < 0) {
-        free(sb);
-        free(buffer);
+    int blocknr = sb->refcount_block_idx + dnumber/(FS_BLOCK/4);
+    if(read_fs_block(sb, blocknr, buffer, BLK_REFCOUNT) < 0) {
+        scratch_put(buffer);
         return -1;
     }
-    inode* node = buffer+(inumber%128);
-    if(!node->valid) {
-        free(sb);
-        free(buffer);
+    uint32_t* count = buffer + dnumber%(FS_BLOCK/4);
+    if(delta == 0 || (delta < 0 && *count < (uint32_t) -delta)) {
+        int refs = (delta == 0) ? (int) *count : -1;
+        scratch_put(buffer);
+        return refs;
+    }
+    *count += delta;
+    if(write_fs_block(sb, blocknr, buffer, BLK_REFCOUNT) < 0) {
+        scratch_put(buffer);
         return -1;
     }
-    int total_blocks =(int) ceil(node->size/(double)BLOCKSIZE);
-    printf("Stats: \n");
-    printf("\tInode Number: %d\n", inumber);
-    printf("\tLogical size: %d\n", (int) node->size);
-    printf("\tTotal data blocks: %d\n", total_blocks);
-    printf("\tNumber of direct pointers used: %d\n", (total_blocks-5)>0 ? 5 : total_blocks);
-    printf("\tNumber of indirect pointers used: %d\n", (total_blocks-5)>0 ? total_blocks-5 : 0);
-    free(sb);
-    free(buffer);
+    int refs = *count;
+    scratch_put(buffer);
+    return refs;
 }
 
-int get_block(super_block* sb, inode* node, int blocknum, void* buffer) {
-    if(blocknum < 5) {
-        if(read_block(mountptr, sb->data_block_idx + node->direct[blocknum], buffer) < 0) {
-            return -1;
-        }
+int is_shared(int dnumber, super_block* sb) {
+    if(!sb->cow_active)
         return 0;
-    } else {
-        uint32_t* indirect_block = (uint32_t*) malloc(BLOCKSIZE);
-        if(!indirect_block) {
-            return -1;
-        }
-        if(read_block(mountptr, sb->data_block_idx + node->indirect, indirect_block) < 0) {
-            free(indirect_block);
-            return -1;
-        }
-        if(read_block(mountptr, sb->data_block_idx + indirect_block[blocknum-5], buffer) < 0) {
-            free(indirect_block);
+    int refs = change_refcount(dnumber, sb, 0);
+    if(refs < 0)
+        return -1;
+    return refs > 0;
+}
+
+int ref_datablock(int dnumber, super_block* sb) {
+    if(dnumber == NO_BLOCK)
+        return 0;
+    if(!sb->cow_active) {
+        sb->cow_active = 1;
+        if(write_super(sb) < 0) {
             return -1;
         }
-        free(indirect_block);
+    }
+    return change_refcount(dnumber, sb, 1) < 0 ? -1 : 0;
+}
+
+// Drops one reference to a data block and frees it once nobody else refers to it.
+// Returns 1 if the block was freed, 0 if it is still shared, -1 on error.
+int unref_datablock(int dnumber, super_block* sb) {
+    if(dnumber == NO_BLOCK)
         return 0;
+    int shared = is_shared(dnumber, sb);
+    if(shared < 0)
+        return -1;
+    if(shared) {
+        return change_refcount(dnumber, sb, -1) < 0 ? -1 : 0;
     }
+    if(free_data_bitmap(dnumber, sb) < 0)
+        return -1;
+    return 1;
 }
 
-int put_block(super_block* sb, inode* node, int blocknum, void* buffer) {
-    if(blocknum < 5) {
-        if(write_block(mountptr, sb->data_block_idx + node->direct[blocknum], buffer) < 0) {
-            return -1;
-        }
+// Sizes and block pointers are 32 bit wide in SFS_FORMAT_32 and 64 bit wide in SFS_FORMAT_64.
+// Slots 0-4 of an inode are its direct pointers, then come the indirect pointer and, in the
+// 64 bit format, the double indirect pointer. format keeps data block numbers below 2^31,
+// so in memory they are handled as 32 bit numbers in both formats.
+#define SLOT_INDIRECT 5
+#define SLOT_DOUBLE 6
+
+static uint32_t file_blocks(uint64_t size) {
+    return (size + FS_BLOCK-1)/FS_BLOCK;
+}
+
+// blocks of [first, first+count) below blocks
+static uint32_t span(uint32_t blocks, uint32_t first, uint32_t count) {
+    if(blocks <= first)
         return 0;
-    } else {
-        uint32_t* indirect_block = (uint32_t*) malloc(BLOCKSIZE);
-        if(!indirect_block) {
-            return -1;
-        }
-        if(read_block(mountptr, sb->data_block_idx + node->indirect, indirect_block) < 0) {
-            free(indirect_block);
-            return -1;
-        }
-        if(write_block(mountptr, sb->data_block_idx + indirect_block[blocknum-5], buffer) < 0) {
-            //printf("t %d %d %d", blocknum, indirect_block[0], indirect_block[1]);
-            free(indirect_block);
-            return -1;
-        }
-        free(indirect_block);
+    return blocks-first < count ? blocks-first : count;
+}
+
+static void set_file_size(super_block* sb, inode* node, uint64_t size) {
+    if(WIDE_FORMAT(sb))
+        ((inode64*) node)->size = size;
+    else
+        node->size = size;
+}
+
+static uint32_t inode_ptr(super_block* sb, inode* node, int slot) {
+    inode64* wide = (inode64*) node;
+    if(slot < 5)
+        return WIDE_FORMAT(sb) ? wide->direct[slot] : node->direct[slot];
+    if(slot == SLOT_INDIRECT)
+        return WIDE_FORMAT(sb) ? wide->indirect : node->indirect;
+    return wide->double_indirect;
+}
+
+static void set_inode_ptr(super_block* sb, inode* node, int slot, uint32_t dnumber) {
+    inode64* wide = (inode64*) node;
+    if(slot < 5 && WIDE_FORMAT(sb))
+        wide->direct[slot] = dnumber;
+    else if(slot < 5)
+        node->direct[slot] = dnumber;
+    else if(slot == SLOT_INDIRECT && WIDE_FORMAT(sb))
+        wide->indirect = dnumber;
+    else if(slot == SLOT_INDIRECT)
+        node->indirect = dnumber;
+    else
+        wide->double_indirect = dnumber;
+}
+
+static uint32_t map_entry(super_block* sb, void* block, uint32_t i) {
+    return WIDE_FORMAT(sb) ? ((uint64_t*) block)[i] : ((uint32_t*) block)[i];
+}
+
+static void set_map_entry(super_block* sb, void* block, uint32_t i, uint32_t dnumber) {
+    if(WIDE_FORMAT(sb))
+        ((uint64_t*) block)[i] = dnumber;
+    else
+        ((uint32_t*) block)[i] = dnumber;
+}
+
+// Data block references dropped while removing many files are collected and released in
+// one sweep. The blocks are sorted, so each refcount block and each bitmap block is read
+// and written once for the whole batch instead of once per block.
+typedef struct block_batch {
+    uint32_t* blocks;
+    int count;
+    int capacity;
+} block_batch;
+
+// indirect blocks are only expanded into their children once the last reference goes
+typedef struct indirect_ref {
+    uint32_t dnumber;
+    uint32_t children; // data blocks below the block
+    uint32_t depth; // 1 for an indirect block, 2 for a double indirect block
+} indirect_ref;
+
+typedef struct indirect_batch {
+    indirect_ref* refs;
+    int count;
+    int capacity;
+} indirect_batch;
+
+// deeper blocks first, so the indirect blocks they give up are resolved after them
+static int cmp_indirect_ref(const void* a, const void* b) {
+    const indirect_ref* x = (const indirect_ref*) a;
+    const indirect_ref* y = (const indirect_ref*) b;
+    if(x->depth != y->depth)
+        return x->depth > y->depth ? -1 : 1;
+    return cmp_uint32(&x->dnumber, &y->dnumber);
+}
+
+int batch_add(block_batch* batch, uint32_t dnumber) {
+    if(dnumber == NO_BLOCK)
         return 0;
+    if(batch->count == batch->capacity) {
+        int capacity = batch->capacity ? 2*batch->capacity : 256;
+        uint32_t* blocks = (uint32_t*) realloc(batch->blocks, capacity*sizeof(uint32_t));
+        if(!blocks)
+            return -1;
+        batch->blocks = blocks;
+        batch->capacity = capacity;
     }
+    batch->blocks[batch->count++] = dnumber;
+    return 0;
 }
 
-int write_i(int inumber, char *data, int length, int offset) {
-    if(!mountptr) {
-        printf("ERR: Disk not mounted.\n");
-        return -1;
+static int indirect_add(indirect_batch* batch, uint32_t dnumber, uint32_t children, uint32_t depth) {
+    if(batch->count == batch->capacity) {
+        int capacity = batch->capacity ? 2*batch->capacity : 64;
+        indirect_ref* refs = (indirect_ref*) realloc(batch->refs, capacity*sizeof(indirect_ref));
+        if(!refs)
+            return -1;
+        batch->refs = refs;
+        batch->capacity = capacity;
     }
-    if(length == 0)
+    batch->refs[batch->count].dnumber = dnumber;
+    batch->refs[batch->count].children = children;
+    batch->refs[batch->count].depth = depth;
+    batch->count++;
+    return 0;
+}
+
+// Adds the references node holds to the batches.
+static int gather_inode_blocks(super_block* sb, inode* node, block_batch* batch, indirect_batch* indirects) {
+    if(node->flags & INODE_INLINE)
         return 0;
-    else if(length < 0)
-        return -1;
-    super_block* sb = (super_block*) malloc(BLOCKSIZE);
-    if(!sb) {
-        return -1;
+    uint32_t per = MAP_ENTRIES(sb);
+    uint32_t n_blocks = file_blocks(FILE_SIZE(sb, node));
+    for(uint32_t i=0; i<n_blocks && i<5; i++) {
+        if(batch_add(batch, inode_ptr(sb, node, i)) < 0)
+            return -1;
     }
-    if(read_block(mountptr, 0, sb) < 0) {
-        free(sb);
+    if(n_blocks > 5 && indirect_add(indirects, inode_ptr(sb, node, SLOT_INDIRECT), span(n_blocks, 5, per), 1) < 0)
         return -1;
-    }
-    if(inumber < 0 || inumber > sb->inodes) {
-        free(sb);
+    if(n_blocks > 5+per && indirect_add(indirects, inode_ptr(sb, node, SLOT_DOUBLE), n_blocks-5-per, 2) < 0)
         return -1;
-    }
-    inode* buffer = (inode*) malloc(BLOCKSIZE);
+    return 0;
+}
+
+// Turns the indirect block references into block references. An indirect block whose
+// references all go away in this batch also gives up the references to its children; those
+// of a double indirect block are indirect blocks themselves, resolved in the next round.
+static int resolve_indirects(super_block* sb, indirect_batch* indirects, block_batch* batch) {
+    char* buffer = (char*) scratch_get();
     if(!buffer) {
-        free(sb);
         return -1;
     }
-    if(read_block(mountptr, sb->inode_block_idx + inumber/128, buffer) < 0)
-        goto err;
-
-    inode* node = buffer+(inumber%128);
-    if(!node->valid || offset > node->size)
-        goto err;
-
-    int byteswritten = 0;
-    int blocknum = offset/BLOCKSIZE;
-    int total_blocks =(int) ceil(node->size/(double)BLOCKSIZE);
-    uint32_t* data_buffer = (uint32_t*) malloc(BLOCKSIZE);
-    if(!data_buffer)
-        goto err;
-    while(byteswritten < length) {
-        if(offset+byteswritten == total_blocks*BLOCKSIZE) {
-            if(total_blocks==MAXBLOCKS) {
-                break;
-            } else {
-                blocknum = total_blocks;
-                if(total_blocks==5) {
-                    int new_block;
-                    if((new_block = find_free_datablock(sb)) < 0) {
-                        //if disk is full, break
-                        break;
-                    }
-                    node->indirect = new_block;
-                    if((new_block = find_free_datablock(sb)) < 0) {
-                        //if disk is full, break
-                        break;
-                    }
-                    //update indirect block
-                    memcpy(data_buffer, &new_block, sizeof(int));
-                    if(write_block(mountptr, sb->data_block_idx + node->indirect, data_buffer) < 0) {
-                        free(data_buffer);
-                        goto err;
-                    }
-                } else if(total_blocks > 5){
-                    if(read_block(mountptr, sb->data_block_idx + node->indirect, data_buffer) < 0) {
-                        free(data_buffer);
-                        goto err;
-                    }
-                    int new_block;
-                    if((new_block = find_free_datablock(sb)) < 0) {
-                        //if disk is full, break
-                        break;
-                    }
-                    //update indirect block
-                    memcpy(data_buffer+(blocknum-5), &new_block, sizeof(int));
-                    if(write_block(mountptr, sb->data_block_idx + node->indirect, data_buffer) < 0) {
-                        free(data_buffer);
+    uint32_t per = MAP_ENTRIES(sb);
+    int done = 0;
+    for(uint32_t depth=2; depth>0; depth--) {
+        qsort(indirects->refs+done, indirects->count-done, sizeof(indirect_ref), cmp_indirect_ref);
+        int end = done;
+        while(end < indirects->count && indirects->refs[end].depth == depth)
+            end++;
+        for(int i=done; i<end; ) {
+            // a copy, adding the children below may move the array
+            indirect_ref ref = indirects->refs[i];
+            int dropped = 0;
+            while(i < end && indirects->refs[i].dnumber == ref.dnumber) {
+                dropped++;
+                i++;
+            }
+            int refs = 1 + (sb->cow_active ? change_refcount(ref.dnumber, sb, 0) : 0);
+            if(refs < 1)
+                goto err;
+            if(dropped >= refs) {
+                if(read_indirect(sb, ref.dnumber, buffer) < 0)
+                    goto err;
+                for(uint32_t j=0; depth == 1 && j<ref.children; j++) {
+                    if(batch_add(batch, map_entry(sb, buffer, j)) < 0)
                         goto err;
-                    }
-                } else {
-                    int new_block;
-                    if((new_block = find_free_datablock(sb)) < 0) {
-                        printf("check");
-                        //if disk is full, break
-                        break;
-                    }
-                    //update direct pointer
-                    node->direct[blocknum] = new_block;
                 }
-                total_blocks++;
-                if(length-byteswritten > BLOCKSIZE) {
-                    memcpy(data_buffer, data+byteswritten, BLOCKSIZE);
-                    byteswritten+=BLOCKSIZE;
-                    node->size = total_blocks*BLOCKSIZE;
-                } else {
-                    memcpy(data_buffer, data+byteswritten, length-byteswritten);
-                    byteswritten=length;
-                    node->size=offset+length;
+                for(uint32_t j=0; depth == 2 && j*per<ref.children; j++) {
+                    if(indirect_add(indirects, map_entry(sb, buffer, j), span(ref.children, j*per, per), 1) < 0)
+                        goto err;
                 }
-                if(put_block(sb, node, blocknum, data_buffer) < 0) {
-                    free(data_buffer);
+            }
+            for(int j=0; j<dropped; j++) {
+                if(batch_add(batch, ref.dnumber) < 0)
                     goto err;
-                }
             }
-        } else {
-            blocknum = (offset+byteswritten)/BLOCKSIZE;
-            if(get_block(sb, node, blocknum, data_buffer) < 0) {
-                free(data_buffer);
+        }
+        done = end;
+    }
+    scratch_put(buffer);
+    return 0;
+    err:
+        scratch_put(buffer);
+        return -1;
+}
+
+// Drops one reference to every block in the batch, freeing the blocks left unreferenced.
+int batch_release(super_block* sb, block_batch* batch) {
+    qsort(batch->blocks, batch->count, sizeof(uint32_t), cmp_uint32);
+    uint32_t* buffer = (uint32_t*) scratch_get();
+    if(!buffer) {
+        return -1;
+    }
+    for(int i=0; i<batch->count; i++) {
+        if(batch->blocks[i] >= sb->data_blocks)
+            goto err;
+    }
+    // shared blocks lose a reference, the others are moved to the front to be freed
+    int nfree = batch->count;
+    if(sb->cow_active) {
+        nfree = 0;
+        for(int i=0; i<batch->count; ) {
+            int rblock = batch->blocks[i]/(FS_BLOCK/4);
+            int dirty = 0;
+            if(read_fs_block(sb, sb->refcount_block_idx + rblock, buffer, BLK_REFCOUNT) < 0)
                 goto err;
+            for(; i<batch->count && batch->blocks[i]/(FS_BLOCK/4) == rblock; i++) {
+                uint32_t* count = buffer + batch->blocks[i]%(FS_BLOCK/4);
+                if(*count) {
+                    (*count)--;
+                    dirty = 1;
+                } else {
+                    batch->blocks[nfree++] = batch->blocks[i];
+                }
             }
-            if(length-byteswritten >= BLOCKSIZE-(offset+byteswritten)%BLOCKSIZE) {
-                memcpy(data_buffer, data+byteswritten, BLOCKSIZE-(offset+byteswritten)%BLOCKSIZE);
-                byteswritten += BLOCKSIZE-(offset+byteswritten)%BLOCKSIZE;
-                node->size = total_blocks*BLOCKSIZE;
-            } else {
-                memcpy(data_buffer, data+byteswritten, length-byteswritten);
-                byteswritten = length;
-                node->size = offset+length;
-            }
-            if(put_block(sb, node, blocknum, data_buffer) < 0) {
-                free(data_buffer);
+            if(dirty && write_fs_block(sb, sb->refcount_block_idx + rblock, buffer, BLK_REFCOUNT) < 0)
                 goto err;
-            }
         }
     }
-    // write inode back to disk
-    if(write_block(mountptr, sb->inode_block_idx + inumber/128, buffer) < 0) {
-        free(data_buffer);
+    if(free_data_blocks(sb, batch->blocks, nfree) < 0)
         goto err;
-    }
-    free(sb);
-    free(buffer);
-    free(data_buffer);
-    return byteswritten;
+    batch->count = 0;
+    scratch_put(buffer);
+    return 0;
     err:
-        free(sb);
-        free(buffer);
+        scratch_put(buffer);
         return -1;
 }
 
-int read_i(int inumber, char *data, int length, int offset) {
+// Releases everything collected in the two batches and frees their lists.
+int release_batch(super_block* sb, block_batch* batch, indirect_batch* indirects) {
+    int ret = 0;
+    if(resolve_indirects(sb, indirects, batch) < 0 || batch_release(sb, batch) < 0)
+        ret = -1;
+    free(batch->blocks);
+    free(indirects->refs);
+    return ret;
+}
+
+// A reference to an indirect block carries the references to all the blocks it points to,
+// so the children are only released once the indirect block itself is freed.
+int free_indirect_data_bitmap(int index, super_block* sb, int indirect_blocks) {
     if(!mountptr) {
         printf("ERR: Disk not mounted.\n");
         return -1;
     }
-    if(length == 0)
-        return 0;
-    else if(length < 0)
-        return -1;
-    super_block* sb = (super_block*) malloc(BLOCKSIZE);
-    if(!sb) {
+    if(index < 0 || index >= sb->data_blocks) {
         return -1;
     }
-    if(read_block(mountptr, 0, sb) < 0) {
-        free(sb);
+    block_batch batch = {NULL, 0, 0};
+    indirect_batch indirects = {NULL, 0, 0};
+    if(indirect_add(&indirects, index, indirect_blocks, 1) < 0) {
+        free(indirects.refs);
         return -1;
     }
-    if(inumber < 0 || inumber > sb->inodes) {
-        free(sb);
-        return -1;
+    return release_batch(sb, &batch, &indirects);
+}
+
+int ref_inode_blocks(super_block* sb, inode* node) {
+    if(node->flags & INODE_INLINE)
+        return 0;
+    uint32_t n_blocks = file_blocks(FILE_SIZE(sb, node));
+    for(uint32_t i=0; i<n_blocks && i<5; i++) {
+        if(ref_datablock(inode_ptr(sb, node, i), sb) < 0)
+            return -1;
     }
-    inode* buffer = (inode*) malloc(BLOCKSIZE);
-    if(!buffer) {
-        free(sb);
+    if(n_blocks > 5 && ref_datablock(inode_ptr(sb, node, SLOT_INDIRECT), sb) < 0)
+        return -1;
+    if(n_blocks > 5+MAP_ENTRIES(sb) && ref_datablock(inode_ptr(sb, node, SLOT_DOUBLE), sb) < 0)
+        return -1;
+    return 0;
+}
+
+int release_inode_blocks(super_block* sb, inode* node) {
+    block_batch batch = {NULL, 0, 0};
+    indirect_batch indirects = {NULL, 0, 0};
+    if(gather_inode_blocks(sb, node, &batch, &indirects) < 0) {
+        free(batch.blocks);
+        free(indirects.refs);
         return -1;
     }
-    if(read_block(mountptr, sb->inode_block_idx + inumber/128, buffer) < 0)
-        goto err;
+    return release_batch(sb, &batch, &indirects);
+}
 
-    inode* node = buffer+(inumber%128);
-    if(!node->valid || offset >= node->size)
-        goto err;
+// A walk over the block map of one file. The indirect blocks on the path to the block last
+// looked up stay loaded, so a sequential walk reads each of them once, and the ones changed
+// are written back by map_flush.
+#define ROLE_INDIRECT 0 // the indirect block
+#define ROLE_DOUBLE 1 // the double indirect block
+#define ROLE_LEAF 2 // an indirect block below the double indirect block
+#define MAP_ROLES 3
+
+struct block_map {
+    super_block* sb;
+    inode* node;
+    uint32_t blocks; // blocks mapped
+    uint32_t held[MAP_ROLES]; // data block loaded in each role, NO_BLOCK if none
+    int dirty[MAP_ROLES];
+    char* data[MAP_ROLES];
+};
+
+static void map_open(block_map* map, super_block* sb, inode* node) {
+    memset(map, 0, sizeof(block_map));
+    map->sb = sb;
+    map->node = node;
+    map->blocks = (node->flags & INODE_INLINE) ? 0 : file_blocks(FILE_SIZE(sb, node));
+    for(int r=0; r<MAP_ROLES; r++)
+        map->held[r] = NO_BLOCK;
+}
+
+static int map_flush(block_map* map) {
+    for(int r=MAP_ROLES-1; r>=0; r--) {
+        if(!map->dirty[r])
+            continue;
+        if(write_indirect(map->sb, map->held[r], map->data[r]) < 0)
+            return -1;
+        map->dirty[r] = 0;
+    }
+    return 0;
+}
+
+static void map_close(block_map* map) {
+    for(int r=0; r<MAP_ROLES; r++)
+        scratch_put(map->data[r]);
+}
+
+// Loads dnumber in role, or starts a new empty block there if fresh.
+static char* map_hold(block_map* map, int role, uint32_t dnumber, int fresh) {
+    super_block* sb = map->sb;
+    if(map->held[role] == dnumber && !fresh)
+        return map->data[role];
+    if(map->dirty[role] && write_indirect(sb, map->held[role], map->data[role]) < 0)
+        return NULL;
+    map->dirty[role] = 0;
+    map->held[role] = NO_BLOCK;
+    if(!map->data[role] && !(map->data[role] = (char*) scratch_get()))
+        return NULL;
+    if(fresh) {
+        memset(map->data[role], 0, FS_BLOCK);
+        map->dirty[role] = 1;
+    } else if(read_indirect(sb, dnumber, map->data[role]) < 0) {
+        return NULL;
+    }
+    map->held[role] = dnumber;
+    return map->data[role];
+}
+
+// Data block number of block blocknum of the file, NO_BLOCK for the unused slots of a
+// compressed cluster, -1 on error.
+static int64_t map_get(block_map* map, uint32_t blocknum) {
+    super_block* sb = map->sb;
+    uint32_t per = MAP_ENTRIES(sb);
+    if(blocknum < 5)
+        return inode_ptr(sb, map->node, blocknum);
+    blocknum -= 5;
+    if(blocknum < per) {
+        char* block = map_hold(map, ROLE_INDIRECT, inode_ptr(sb, map->node, SLOT_INDIRECT), 0);
+        return block ? (int64_t) map_entry(sb, block, blocknum) : -1;
+    }
+    blocknum -= per;
+    char* outer = map_hold(map, ROLE_DOUBLE, inode_ptr(sb, map->node, SLOT_DOUBLE), 0);
+    char* block = outer ? map_hold(map, ROLE_LEAF, map_entry(sb, outer, blocknum/per), 0) : NULL;
+    return block ? (int64_t) map_entry(sb, block, blocknum%per) : -1;
+}
+
+// Makes the indirect block at *dnumber private before it is changed. A shared one is copied,
+// the copy taking a reference to each of its first children entries, as an indirect block
+// carries the references of its children. With no children a new empty block is allocated.
+static char* map_own(block_map* map, int role, uint32_t* dnumber, uint32_t children) {
+    super_block* sb = map->sb;
+    if(!children) {
+        int new_block = find_free_datablock(sb);
+        if(new_block < 0)
+            return NULL;
+        char* block = map_hold(map, role, new_block, 1);
+        if(!block) {
+            free_data_bitmap(new_block, sb);
+            return NULL;
+        }
+        *dnumber = new_block;
+        return block;
+    }
+    char* block = map_hold(map, role, *dnumber, 0);
+    if(!block)
+        return NULL;
+    int shared = is_shared(*dnumber, sb);
+    if(shared <= 0)
+        return shared < 0 ? NULL : block;
+    int new_block = find_free_datablock(sb);
+    if(new_block < 0)
+        return NULL;
+    for(uint32_t i=0; i<children; i++) {
+        if(ref_datablock(map_entry(sb, block, i), sb) < 0)
+            return NULL;
+    }
+    if(unref_datablock(*dnumber, sb) < 0)
+        return NULL;
+    map->held[role] = new_block;
+    map->dirty[role] = 1;
+    *dnumber = new_block;
+    return block;
+}
 
-    int bytesread = 0, number_read_blocks;
-    if(offset+length > node->size) {
-        number_read_blocks = (node->size-1)/BLOCKSIZE - offset/BLOCKSIZE + 1;
+// Points block blocknum of the file at dnumber; blocknum may be the block just past the end.
+// The indirect blocks on the way are made private or allocated. The reference to the block
+// the slot pointed at before is left to the caller.
+static int map_set(block_map* map, uint32_t blocknum, uint32_t dnumber) {
+    super_block* sb = map->sb;
+    inode* node = map->node;
+    uint32_t per = MAP_ENTRIES(sb);
+    if(blocknum > map->blocks || blocknum >= MAX_FILE_BLOCKS(sb))
+        return -1;
+    if(blocknum < 5) {
+        set_inode_ptr(sb, node, blocknum, dnumber);
+    } else if(blocknum-5 < per) {
+        uint32_t pointer = inode_ptr(sb, node, SLOT_INDIRECT);
+        char* block = map_own(map, ROLE_INDIRECT, &pointer, span(map->blocks, 5, per));
+        if(!block)
+            return -1;
+        set_inode_ptr(sb, node, SLOT_INDIRECT, pointer);
+        if(map_entry(sb, block, blocknum-5) != dnumber) {
+            set_map_entry(sb, block, blocknum-5, dnumber);
+            map->dirty[ROLE_INDIRECT] = 1;
+        }
     } else {
-        number_read_blocks = (offset+length-1)/BLOCKSIZE - offset/BLOCKSIZE + 1;
+        uint32_t i = blocknum-5-per;
+        uint32_t below = span(map->blocks, 5+per, per*per);
+        uint32_t pointer = inode_ptr(sb, node, SLOT_DOUBLE);
+        char* outer = map_own(map, ROLE_DOUBLE, &pointer, (below+per-1)/per);
+        if(!outer)
+            return -1;
+        set_inode_ptr(sb, node, SLOT_DOUBLE, pointer);
+        uint32_t leaf = map_entry(sb, outer, i/per);
+        char* block = map_own(map, ROLE_LEAF, &leaf, span(below, i/per*per, per));
+        if(!block)
+            return -1;
+        if(map_entry(sb, outer, i/per) != leaf) {
+            set_map_entry(sb, outer, i/per, leaf);
+            map->dirty[ROLE_DOUBLE] = 1;
+        }
+        if(map_entry(sb, block, i%per) != dnumber) {
+            set_map_entry(sb, block, i%per, dnumber);
+            map->dirty[ROLE_LEAF] = 1;
+        }
     }
-    char* data_buffer = (char*) malloc(BLOCKSIZE);
-    if(!data_buffer)
-        goto err;
-    for(int i=0; i<number_read_blocks; i++) {
-        if(i==0) {
-            if(get_block(sb, node, offset/BLOCKSIZE, data_buffer) < 0) {
-                free(data_buffer);
-                goto err;
-            }
-            if(number_read_blocks == 1 && (offset+length > node->size)) {
-                memcpy(data, data_buffer + offset%BLOCKSIZE, node->size - offset);
-                bytesread += node->size - offset;
-            }
-            else if(number_read_blocks == 1 && (offset+length <= node->size)) {
-                memcpy(data, data_buffer + offset%BLOCKSIZE, length);
-                bytesread += length;
-            }
-            else {
-                memcpy(data, data_buffer + offset%BLOCKSIZE, BLOCKSIZE - offset%BLOCKSIZE);
-                bytesread += BLOCKSIZE - offset%BLOCKSIZE;
-            }
-        } else if(i==number_read_blocks-1) {
-            if(get_block(sb, node, offset/BLOCKSIZE + i, data_buffer) < 0) {
-                free(data_buffer);
-                goto err;
+    if(blocknum == map->blocks)
+        map->blocks++;
+    return 0;
+}
+
+// Drops the blocks of the file from new_blocks on into the batches. An indirect block left
+// without entries goes as a whole, taking its children along with its last reference; one
+// that keeps some is made private and gives up the rest one by one.
+static int map_trim(block_map* map, uint32_t new_blocks, block_batch* batch, indirect_batch* indirects) {
+    super_block* sb = map->sb;
+    inode* node = map->node;
+    uint32_t per = MAP_ENTRIES(sb);
+    if(new_blocks >= map->blocks)
+        return 0;
+    // resolve_indirects reads the blocks that go
+    if(map_flush(map) < 0)
+        return -1;
+    for(uint32_t i=new_blocks; i<map->blocks && i<5; i++) {
+        if(batch_add(batch, inode_ptr(sb, node, i)) < 0)
+            return -1;
+    }
+    uint32_t n = span(map->blocks, 5, per);
+    uint32_t keep = span(new_blocks, 5, per);
+    if(n && !keep) {
+        if(indirect_add(indirects, inode_ptr(sb, node, SLOT_INDIRECT), n, 1) < 0)
+            return -1;
+    } else if(keep < n) {
+        uint32_t pointer = inode_ptr(sb, node, SLOT_INDIRECT);
+        char* block = map_own(map, ROLE_INDIRECT, &pointer, n);
+        if(!block)
+            return -1;
+        set_inode_ptr(sb, node, SLOT_INDIRECT, pointer);
+        for(uint32_t i=keep; i<n; i++) {
+            if(batch_add(batch, map_entry(sb, block, i)) < 0)
+                return -1;
+        }
+    }
+    n = span(map->blocks, 5+per, per*per);
+    keep = span(new_blocks, 5+per, per*per);
+    if(n && !keep) {
+        if(indirect_add(indirects, inode_ptr(sb, node, SLOT_DOUBLE), n, 2) < 0)
+            return -1;
+    } else if(keep < n) {
+        uint32_t pointer = inode_ptr(sb, node, SLOT_DOUBLE);
+        char* outer = map_own(map, ROLE_DOUBLE, &pointer, (n+per-1)/per);
+        if(!outer)
+            return -1;
+        set_inode_ptr(sb, node, SLOT_DOUBLE, pointer);
+        for(uint32_t j=keep/per; j*per<n; j++) {
+            uint32_t leaf = map_entry(sb, outer, j);
+            uint32_t leaf_n = span(n, j*per, per);
+            uint32_t leaf_keep = span(keep, j*per, per);
+            if(!leaf_keep) {
+                if(indirect_add(indirects, leaf, leaf_n, 1) < 0)
+                    return -1;
+                continue;
             }
-            if(offset+length > node->size) {
-                memcpy(data+bytesread, data_buffer, (node->size-1)%BLOCKSIZE + 1);
-                bytesread += (node->size-1)%BLOCKSIZE + 1;
-            } else {
-                memcpy(data+bytesread, data_buffer, (offset+length-1)%BLOCKSIZE + 1);
-                bytesread += (offset+length-1)%BLOCKSIZE + 1;
+            char* block = map_own(map, ROLE_LEAF, &leaf, leaf_n);
+            if(!block)
+                return -1;
+            if(map_entry(sb, outer, j) != leaf) {
+                set_map_entry(sb, outer, j, leaf);
+                map->dirty[ROLE_DOUBLE] = 1;
             }
-        } else {
-            if(get_block(sb, node, offset/BLOCKSIZE + i, data_buffer) < 0) {
-                free(data_buffer);
-                goto err;
+            for(uint32_t i=leaf_keep; i<leaf_n; i++) {
+                if(batch_add(batch, map_entry(sb, block, i)) < 0)
+                    return -1;
             }
-            memcpy(data+bytesread, data_buffer, BLOCKSIZE);
-            bytesread += BLOCKSIZE;
         }
     }
-    free(sb);
-    free(buffer);
-    free(data_buffer);
-    return bytesread;
-    err:
-        free(sb);
-        free(buffer);
+    map->blocks = new_blocks;
+    // the blocks that went may be reused before this map is done with
+    if(map_flush(map) < 0)
         return -1;
+    for(int r=0; r<MAP_ROLES; r++)
+        map->held[r] = NO_BLOCK;
+    return 0;
 }
 
-int fit_to_size(int inumber, int size) {
-    if(!mountptr) {
+int remove_file(int inumber) {
+    STAT_OP(OP_REMOVE_FILE);
+    SFS_LOCKED;
+    if(mounted_snap >= 0) {
+        printf("ERR: Snapshot is mounted read-only.\n");
         return -1;
     }
-    if(size < 0) {
+    super_block* sb = (super_block*) scratch_get();
+    if(!sb || read_super(sb) < 0) {
+        scratch_put(sb);
         return -1;
     }
-    super_block* sb = (super_block*) malloc(BLOCKSIZE);
-    if(!sb) {
+    if(inumber < 0 || inumber > sb->inodes) {
+        scratch_put(sb);
         return -1;
     }
-    if(read_block(mountptr, 0, sb) < 0) {
-        free(sb);
+    inode* buffer = (inode*) scratch_get();
+    if(!buffer) {
+        scratch_put(sb);
         return -1;
     }
-    if(inumber < 0 || inumber > sb->inodes) {
-        free(sb);
+    if(snap_preserve(sb, inumber/INODES_PER_BLOCK(sb)) < 0)
+        goto err;
+    if(read_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+        goto err;
+    inode* del_inode = INODE_AT(sb, buffer, inumber);
+    if(async_unlink && del_inode->valid) {
+        // the blocks are left to the reclaimer unless its queue is full
+        int queued = queue_orphan(sb, buffer, inumber);
+        if(queued < 0)
+            goto err;
+        if(queued) {
+            scratch_put(sb);
+            scratch_put(buffer);
+            return 0;
+        }
+    }
+    if(del_inode->flags & INODE_COMPRESSED)
+        invalidate_cluster_cache();
+    if(release_inode_blocks(sb, del_inode) < 0)
+        goto err;
+    if(quota_release(sb, inumber, del_inode) < 0)
+        goto err;
+    del_inode->valid=0;
+    if(write_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0) {
+        goto err;
+    }
+    if(free_inode_bitmap(inumber, sb) < 0) {
+        goto err;
+    }
+    scratch_put(sb);
+    scratch_put(buffer);
+    return 0;
+    err:
+        scratch_put(sb);
+        scratch_put(buffer);
+        return -1;
+}
+
+// Drops one link of each inode in inumbers (an inode listed twice loses two) and removes the
+// inodes left without links. Every inode block and inode bitmap block is written once, and
+// the data blocks of all the removed files are released in one sweep.
+int remove_inodes(int* inumbers, int count) {
+    STAT_OP(OP_REMOVE_INODES);
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
         return -1;
     }
-    inode* buffer = (inode*) malloc(BLOCKSIZE);
-    if(!buffer) {
-        free(sb);
+    if(mounted_snap >= 0) {
+        printf("ERR: Snapshot is mounted read-only.\n");
         return -1;
     }
-    if(read_block(mountptr, sb->inode_block_idx + inumber/128, buffer) < 0)
-        goto err;
-    inode* node = buffer+(inumber%128);
-    if(!node->valid) {
+    block_batch batch = {NULL, 0, 0};
+    indirect_batch indirects = {NULL, 0, 0};
+    super_block* sb = (super_block*) scratch_get();
+    inode* buffer = (inode*) scratch_get();
+    if(!sb || !buffer || read_super(sb) < 0)
         goto err;
+    qsort(inumbers, count, sizeof(int), cmp_uint32);
+    for(int i=0; i<count; i++) {
+        if(inumbers[i] < 0 || inumbers[i] >= sb->inodes)
+            goto err;
     }
-    int del_blocks = 0;
-    int total_blocks = ceil(node->size/(double)BLOCKSIZE);
-    if(size < node->size) {
-        del_blocks = total_blocks - (int)ceil(size/(double)BLOCKSIZE);
-        if(del_blocks>0)  {
-            uint32_t* indirect_block;
-            if(total_blocks > 5) {
-                indirect_block = (uint32_t*) malloc(BLOCKSIZE);
-                if(!indirect_block) {
-                    goto err;
-                }
-                if(read_block(mountptr, sb->data_block_idx + node->indirect, indirect_block) < 0) {
-                    free(indirect_block);
-                    goto err;
-                }
-            }
-            for(int i=total_blocks-1; i>=total_blocks-del_blocks; i--) {
-                if(i==5) {
-                    if(free_data_bitmap(indirect_block[0], sb) < 0) {
-                        free(indirect_block);
-                        goto err;
-                    }
-                    if(free_data_bitmap(node->indirect, sb) < 0) {
-                        free(indirect_block);
-                        goto err;
-                    }
-                } else if(i>5) {
-                    if(free_data_bitmap(indirect_block[i-5], sb) < 0) {
-                        free(indirect_block);
-                        goto err;
-                    }
-                } else {
-                    if(free_data_bitmap(node->direct[i], sb) < 0) {
-                        free(indirect_block);
-                        goto err;
-                    }
-                }
+    // inode numbers of the removed inodes are moved to the front
+    int removed = 0;
+    for(int i=0; i<count; ) {
+        int iblock = inumbers[i]/INODES_PER_BLOCK(sb);
+        if(snap_preserve(sb, iblock) < 0 || read_inode_block(sb, iblock, buffer) < 0)
+            goto err;
+        for(; i<count && inumbers[i]/INODES_PER_BLOCK(sb) == iblock; i++) {
+            inode* node = INODE_AT(sb, buffer, inumbers[i]);
+            if(!node->valid)
+                continue;
+            if(LINKS(node) > 1) {
+                node->link_count = LINKS(node)-1;
+                continue;
             }
-            if(total_blocks>5)
-                free(indirect_block);
+            if(node->flags & INODE_COMPRESSED)
+                invalidate_cluster_cache();
+            if(gather_inode_blocks(sb, node, &batch, &indirects) < 0 || quota_release(sb, inumbers[i], node) < 0)
+                goto err;
+            node->valid = 0;
+            inumbers[removed++] = inumbers[i];
         }
-        node->size = size;
-        // write inode back to disk
-        if(write_block(mountptr, sb->inode_block_idx + inumber/128, buffer) < 0) {
+        if(write_inode_block(sb, iblock, buffer) < 0)
             goto err;
-        }
     }
-    free(sb);
-    free(buffer);
+    if(resolve_indirects(sb, &indirects, &batch) < 0 || batch_release(sb, &batch) < 0)
+        goto err;
+    if(clear_bitmap_bits(sb, sb->inode_bitmap_block_idx, (uint32_t*) inumbers, removed) < 0)
+        goto err;
+    free(batch.blocks);
+    free(indirects.refs);
+    scratch_put(sb);
+    scratch_put(buffer);
     return 0;
     err:
-        free(sb);
-        free(buffer);
+        free(batch.blocks);
+        free(indirects.refs);
+        scratch_put(sb);
+        scratch_put(buffer);
         return -1;
 }
 
-int get_filesize(int inumber) {
+// Creates a new inode sharing all of the data blocks of inumber. Only the block map is
+// copied; the blocks are copied on write once either file is modified.
+int clone_file(int src_inumber) {
+    STAT_OP(OP_CLONE_FILE);
+    SFS_LOCKED;
     if(!mountptr) {
         printf("ERR: Disk not mounted.\n");
         return -1;
     }
-    super_block* sb = (super_block*) malloc(BLOCKSIZE);
-    if(!sb || read_block(mountptr, 0, sb) < 0) {
+    if(mounted_snap >= 0) {
+        printf("ERR: Snapshot is mounted read-only.\n");
         return -1;
     }
-    if(inumber < 0 || inumber > sb->inodes) {
-        free(sb);
+    super_block* sb = (super_block*) scratch_get();
+    if(!sb || read_super(sb) < 0) {
+        scratch_put(sb);
         return -1;
     }
-    inode* buffer = (inode*) malloc(BLOCKSIZE);
-    if(!buffer) {
-        free(sb);
+    if(src_inumber < 0 || src_inumber >= sb->inodes) {
+        scratch_put(sb);
         return -1;
     }
-    if(read_block(mountptr, sb->inode_block_idx + inumber/128, buffer) < 0) {
-        free(sb);
-        free(buffer);
+    inode* buffer = (inode*) scratch_get();
+    if(!buffer) {
+        scratch_put(sb);
         return -1;
     }
-    inode* node = buffer+(inumber%128);
-    if(!node->valid) {
-        free(sb);
-        free(buffer);
+    if(read_inode_block(sb, src_inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+        goto err;
+    inode* src = (inode*) malloc(INODE_SIZE(sb));
+    if(!src)
+        goto err;
+    memcpy(src, INODE_AT(sb, buffer, src_inumber), INODE_SIZE(sb));
+    if(!LIVE(src)) {
+        free(src);
+        goto err;
+    }
+    int inode_index = find_free_inode(sb);
+    if(inode_index < 0) {
+        free(src);
+        goto err;
+    }
+    if(snap_preserve(sb, inode_index/INODES_PER_BLOCK(sb)) < 0 || read_inode_block(sb, inode_index/INODES_PER_BLOCK(sb), buffer) < 0) {
+        free_inode_bitmap(inode_index, sb);
+        free(src);
+        goto err;
+    }
+    if(ref_inode_blocks(sb, src) < 0) {
+        free_inode_bitmap(inode_index, sb);
+        free(src);
+        goto err;
+    }
+    memcpy(INODE_AT(sb, buffer, inode_index), src, INODE_SIZE(sb));
+    INODE_AT(sb, buffer, inode_index)->link_count = 1;
+    // the clone shares the layout of the data, not the state of the source inode
+    INODE_AT(sb, buffer, inode_index)->flags &= ~INODE_ORPHAN;
+    if(write_inode_block(sb, inode_index/INODES_PER_BLOCK(sb), buffer) < 0) {
+        release_inode_blocks(sb, src);
+        free_inode_bitmap(inode_index, sb);
+        free(src);
+        goto err;
+    }
+    free(src);
+    scratch_put(sb);
+    scratch_put(buffer);
+    return inode_index;
+    err:
+        scratch_put(sb);
+        scratch_put(buffer);
+        return -1;
+}
+
+int stat(int inumber) {
+    STAT_OP(OP_STAT);
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    super_block* sb = (super_block*) scratch_get();
+    if(!sb || read_super(sb) < 0) {
+        scratch_put(sb);
+        return -1;
+    }
+    if(inumber < 0 || inumber > sb->inodes) {
+        scratch_put(sb);
+        return -1;
+    }
+    inode* node = iget(sb, inumber);
+    if(!node) {
+        scratch_put(sb);
+        return -1;
+    }
+    if(!LIVE(node)) {
+        iput(node);
+        scratch_put(sb);
+        return -1;
+    }
+    uint32_t total_blocks = (node->flags & INODE_INLINE) ? 0 : file_blocks(FILE_SIZE(sb, node));
+    uint32_t per = MAP_ENTRIES(sb);
+    printf("Stats: \n");
+    printf("\tInode Number: %d\n", inumber);
+    printf("\tLogical size: %lu\n", (unsigned long) FILE_SIZE(sb, node));
+    printf("\tLinks: %d\n", (int) LINKS(node));
+    printf("\tTotal data blocks: %u\n", total_blocks);
+    printf("\tNumber of direct pointers used: %u\n", span(total_blocks, 0, 5));
+    printf("\tNumber of indirect pointers used: %u\n", span(total_blocks, 5, per));
+    if(WIDE_FORMAT(sb))
+        printf("\tNumber of double indirect pointers used: %u\n", span(total_blocks, 5+per, per*per));
+    if(node->flags & INODE_INLINE)
+        printf("\tData stored inline in the inode\n");
+    iput(node);
+    scratch_put(sb);
+}
+
+int change_links(int inumber, int delta) {
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    if(mounted_snap >= 0) {
+        printf("ERR: Snapshot is mounted read-only.\n");
+        return -1;
+    }
+    super_block* sb = (super_block*) scratch_get();
+    inode* buffer = (inode*) scratch_get();
+    if(!sb || !buffer || read_super(sb) < 0 || inumber < 0 || inumber >= sb->inodes)
+        goto err;
+    if(snap_preserve(sb, inumber/INODES_PER_BLOCK(sb)) < 0)
+        goto err;
+    if(read_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+        goto err;
+    inode* node = INODE_AT(sb, buffer, inumber);
+    if(!LIVE(node))
+        goto err;
+    int links = LINKS(node) + delta;
+    if(links > UINT16_MAX) {
+        printf("Link limit reached.\n");
+        goto err;
+    }
+    if(links == 0) {
+        scratch_put(sb);
+        scratch_put(buffer);
+        return remove_file(inumber) < 0 ? -1 : 0;
+    }
+    node->link_count = links;
+    if(write_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+        goto err;
+    scratch_put(sb);
+    scratch_put(buffer);
+    return links;
+    err:
+        scratch_put(sb);
+        scratch_put(buffer);
+        return -1;
+}
+
+int link_inode(int inumber) {
+    STAT_OP(OP_LINK_INODE);
+    return change_links(inumber, 1);
+}
+
+int unlink_inode(int inumber) {
+    STAT_OP(OP_UNLINK_INODE);
+    return change_links(inumber, -1);
+}
+
+int get_link_count(int inumber) {
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    super_block* sb = (super_block*) scratch_get();
+    inode* buffer = (inode*) scratch_get();
+    int links = -1;
+    if(sb && buffer && read_super(sb) == 0 && inumber >= 0 && inumber < sb->inodes
+        && read_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) == 0 && LIVE(INODE_AT(sb, buffer, inumber)))
+        links = LINKS(INODE_AT(sb, buffer, inumber));
+    scratch_put(sb);
+    scratch_put(buffer);
+    return links;
+}
+
+// Reads block blocknum of the file.
+int get_block(block_map* map, uint32_t blocknum, void* buffer) {
+    int64_t dnumber = map_get(map, blocknum);
+    if(dnumber < 0)
+        return -1;
+    return read_fs_block(map->sb, map->sb->data_block_idx + dnumber, buffer, DATA_CLASS(map->node));
+}
+
+// Shared blocks are never written in place: the new contents go to a freshly allocated
+// block and the inode (or its private indirect block) is pointed at it instead.
+int put_block(block_map* map, uint32_t blocknum, void* buffer) {
+    super_block* sb = map->sb;
+    uint64_t fp = 0;
+    if(dedup_enabled) {
+        int deduped = dedup_block(map, blocknum, buffer, &fp);
+        if(deduped != 0)
+            return deduped < 0 ? -1 : 0;
+    }
+    // the path is made private first, the block may be shared through a shared indirect block
+    int64_t dnumber = map_get(map, blocknum);
+    if(dnumber < 0 || map_set(map, blocknum, dnumber) < 0)
+        return -1;
+    int shared = is_shared(dnumber, sb);
+    if(shared < 0)
+        return -1;
+    if(shared) {
+        int new_block = find_free_datablock(sb);
+        if(new_block < 0 || map_set(map, blocknum, new_block) < 0 || unref_datablock(dnumber, sb) < 0)
+            return -1;
+        dnumber = new_block;
+    }
+    if(write_fs_block(sb, sb->data_block_idx + dnumber, buffer, DATA_CLASS(map->node)) < 0) {
+        return -1;
+    }
+    if(dedup_enabled)
+        dedup_insert(sb, fp, dnumber);
+    return 0;
+}
+
+// Moves the data of an inline inode to a data block and turns it into a regular inode.
+int spill_inline(super_block* sb, void* buffer, int inumber) {
+    inode* node = INODE_AT(sb, buffer, inumber);
+    uint64_t size = FILE_SIZE(sb, node);
+    char* data_buffer = (char*) scratch_zeroed();
+    if(!data_buffer)
+        return -1;
+    memcpy(data_buffer, INLINE_DATA(sb, node), size);
+    memset(INLINE_DATA(sb, node), 0, INLINE_CAPACITY(sb));
+    if(size > 0) {
+        int new_block = find_free_datablock(sb);
+        if(new_block < 0 || write_fs_block(sb, sb->data_block_idx + new_block, data_buffer, DATA_CLASS(node)) < 0) {
+            if(new_block >= 0)
+                free_data_bitmap(new_block, sb);
+            memcpy(INLINE_DATA(sb, node), data_buffer, size);
+            scratch_put(data_buffer);
+            return -1;
+        }
+        set_inode_ptr(sb, node, 0, new_block);
+    }
+    node->flags &= ~INODE_INLINE;
+    scratch_put(data_buffer);
+    return write_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer);
+}
+
+int write_i(int inumber, char *data, int length, int offset) {
+    if(length < 0 || offset < 0)
+        return -1;
+    return write_i64(inumber, data, length, offset);
+}
+
+int64_t write_i64(int inumber, char *data, uint64_t length, uint64_t offset) {
+    STAT_OP(OP_WRITE_I);
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    if(mounted_snap >= 0) {
+        printf("ERR: Snapshot is mounted read-only.\n");
+        return -1;
+    }
+    if(length == 0)
+        return 0;
+    block_map map = {NULL};
+    super_block* sb = (super_block*) scratch_get();
+    if(!sb) {
+        return -1;
+    }
+    if(read_super(sb) < 0) {
+        scratch_put(sb);
+        return -1;
+    }
+    if(inumber < 0 || inumber > sb->inodes) {
+        scratch_put(sb);
+        return -1;
+    }
+    inode* buffer = (inode*) scratch_get();
+    if(!buffer) {
+        scratch_put(sb);
+        return -1;
+    }
+    if(snap_preserve(sb, inumber/INODES_PER_BLOCK(sb)) < 0)
+        goto err;
+    if(read_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+        goto err;
+
+    inode* node = INODE_AT(sb, buffer, inumber);
+    if(!LIVE(node) || offset > FILE_SIZE(sb, node))
+        goto err;
+    int before_flags = node->flags;
+    uint64_t before_size = FILE_SIZE(sb, node);
+    if(quota_write_check(sb, inumber, node, length, offset) < 0)
+        goto err;
+    if(node->flags & INODE_INLINE) {
+        if(offset+length <= (uint64_t) INLINE_CAPACITY(sb)) {
+            memcpy(INLINE_DATA(sb, node)+offset, data, length);
+            if(offset+length > FILE_SIZE(sb, node))
+                set_file_size(sb, node, offset+length);
+            if(write_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+                goto err;
+            quota_update(sb, inumber, before_flags, before_size, node);
+            scratch_put(sb);
+            scratch_put(buffer);
+            return length;
+        }
+        // the file outgrew its inode, move the data out and write it the usual way
+        if(spill_inline(sb, buffer, inumber) < 0)
+            goto err;
+        quota_update(sb, inumber, before_flags, before_size, node);
+        scratch_put(sb);
+        scratch_put(buffer);
+        return write_i64(inumber, data, length, offset);
+    }
+    if(node->flags & INODE_COMPRESSED) {
+        int64_t byteswritten = write_compressed(sb, node, inumber, data, length, offset);
+        if(byteswritten < 0 || write_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+            goto err;
+        quota_update(sb, inumber, before_flags, before_size, node);
+        scratch_put(sb);
+        scratch_put(buffer);
+        return byteswritten;
+    }
+
+    uint64_t byteswritten = 0;
+    uint32_t blocknum;
+    map_open(&map, sb, node);
+    uint32_t total_blocks = map.blocks;
+    char* data_buffer = (char*) scratch_get();
+    if(!data_buffer)
+        goto err;
+    while(byteswritten < length) {
+        if(offset+byteswritten == (uint64_t) total_blocks*FS_BLOCK) {
+            if(total_blocks==MAX_FILE_BLOCKS(sb)) {
+                break;
+            } else {
+                blocknum = total_blocks;
+                int new_block;
+                if((new_block = find_free_datablock(sb)) < 0) {
+                    //if disk is full, break
+                    break;
+                }
+                //point the block map at it, allocating indirect blocks on the way
+                if(map_set(&map, blocknum, new_block) < 0) {
+                    free_data_bitmap(new_block, sb);
+                    break;
+                }
+                total_blocks++;
+                if(length-byteswritten > FS_BLOCK) {
+                    memcpy(data_buffer, data+byteswritten, FS_BLOCK);
+                    byteswritten+=FS_BLOCK;
+                    set_file_size(sb, node, (uint64_t) total_blocks*FS_BLOCK);
+                } else {
+                    memcpy(data_buffer, data+byteswritten, length-byteswritten);
+                    byteswritten=length;
+                    set_file_size(sb, node, offset+length);
+                }
+                if(put_block(&map, blocknum, data_buffer) < 0) {
+                    scratch_put(data_buffer);
+                    goto err;
+                }
+            }
+        } else {
+            blocknum = (offset+byteswritten)/FS_BLOCK;
+            if(get_block(&map, blocknum, data_buffer) < 0) {
+                scratch_put(data_buffer);
+                goto err;
+            }
+            uint32_t within = (offset+byteswritten)%FS_BLOCK;
+            if(length-byteswritten >= FS_BLOCK-within) {
+                memcpy(data_buffer+within, data+byteswritten, FS_BLOCK-within);
+                byteswritten += FS_BLOCK-within;
+            } else {
+                memcpy(data_buffer+within, data+byteswritten, length-byteswritten);
+                byteswritten = length;
+            }
+            // overwriting existing data never shrinks the file
+            if(offset+byteswritten > FILE_SIZE(sb, node))
+                set_file_size(sb, node, offset+byteswritten);
+            if(put_block(&map, blocknum, data_buffer) < 0) {
+                scratch_put(data_buffer);
+                goto err;
+            }
+        }
+    }
+    scratch_put(data_buffer);
+    // write the block map and the inode back to disk
+    if(map_flush(&map) < 0 || write_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+        goto err;
+    quota_update(sb, inumber, before_flags, before_size, node);
+    map_close(&map);
+    scratch_put(sb);
+    scratch_put(buffer);
+    return byteswritten;
+    err:
+        map_close(&map);
+        scratch_put(sb);
+        scratch_put(buffer);
+        return -1;
+}
+
+int read_i(int inumber, char *data, int length, int offset) {
+    if(length < 0 || offset < 0)
+        return -1;
+    return read_i64(inumber, data, length, offset);
+}
+
+int64_t read_i64(int inumber, char *data, uint64_t length, uint64_t offset) {
+    STAT_OP(OP_READ_I);
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    if(length == 0)
+        return 0;
+    block_map map = {NULL};
+    super_block* sb = (super_block*) scratch_get();
+    if(!sb) {
+        return -1;
+    }
+    if(read_super(sb) < 0) {
+        scratch_put(sb);
+        return -1;
+    }
+    if(inumber < 0 || inumber > sb->inodes) {
+        scratch_put(sb);
+        return -1;
+    }
+    inode* node = iget(sb, inumber);
+    if(!node) {
+        scratch_put(sb);
+        return -1;
+    }
+    uint64_t size = FILE_SIZE(sb, node);
+    if(!LIVE(node) || offset >= size)
+        goto err;
+    if(length > size-offset)
+        length = size-offset;
+    if(node->flags & INODE_INLINE) {
+        memcpy(data, INLINE_DATA(sb, node)+offset, length);
+        iput(node);
+        scratch_put(sb);
+        return length;
+    }
+    if(node->flags & INODE_COMPRESSED) {
+        int64_t bytesread = read_compressed(sb, node, inumber, data, length, offset);
+        iput(node);
+        scratch_put(sb);
+        return bytesread;
+    }
+
+    uint64_t bytesread = 0;
+    map_open(&map, sb, node);
+    char* data_buffer = (char*) scratch_get();
+    if(!data_buffer)
+        goto err;
+    while(bytesread < length) {
+        uint32_t within = (offset+bytesread)%FS_BLOCK;
+        uint64_t chunk = (length-bytesread < (uint64_t) (FS_BLOCK-within)) ? length-bytesread : (uint64_t) (FS_BLOCK-within);
+        if(get_block(&map, (offset+bytesread)/FS_BLOCK, data_buffer) < 0) {
+            scratch_put(data_buffer);
+            goto err;
+        }
+        memcpy(data+bytesread, data_buffer+within, chunk);
+        bytesread += chunk;
+    }
+    map_close(&map);
+    iput(node);
+    scratch_put(sb);
+    scratch_put(data_buffer);
+    return bytesread;
+    err:
+        map_close(&map);
+        iput(node);
+        scratch_put(sb);
+        return -1;
+}
+
+int fit_to_size(int inumber, int size) {
+    if(size < 0) {
+        return -1;
+    }
+    return fit_to_size64(inumber, size);
+}
+
+int fit_to_size64(int inumber, uint64_t size) {
+    STAT_OP(OP_FIT_TO_SIZE);
+    SFS_LOCKED;
+    if(!mountptr) {
         return -1;
     }
-    int filesize = node->size;
-    free(sb);
-    free(buffer);
+    if(mounted_snap >= 0) {
+        printf("ERR: Snapshot is mounted read-only.\n");
+        return -1;
+    }
+    super_block* sb = (super_block*) scratch_get();
+    if(!sb) {
+        return -1;
+    }
+    if(read_super(sb) < 0) {
+        scratch_put(sb);
+        return -1;
+    }
+    if(inumber < 0 || inumber > sb->inodes) {
+        scratch_put(sb);
+        return -1;
+    }
+    block_batch batch = {NULL, 0, 0};
+    indirect_batch indirects = {NULL, 0, 0};
+    block_map map = {NULL};
+    inode* buffer = (inode*) scratch_get();
+    if(!buffer) {
+        scratch_put(sb);
+        return -1;
+    }
+    if(snap_preserve(sb, inumber/INODES_PER_BLOCK(sb)) < 0)
+        goto err;
+    if(read_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+        goto err;
+    inode* node = INODE_AT(sb, buffer, inumber);
+    if(!LIVE(node)) {
+        goto err;
+    }
+    int before_flags = node->flags;
+    uint64_t before_size = FILE_SIZE(sb, node);
+    if(node->flags & INODE_INLINE) {
+        if(size < before_size) {
+            set_file_size(sb, node, size);
+            if(write_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+                goto err;
+            quota_update(sb, inumber, before_flags, before_size, node);
+        }
+        scratch_put(sb);
+        scratch_put(buffer);
+        return 0;
+    }
+    if(node->flags & INODE_COMPRESSED) {
+        if(size >= before_size) {
+            scratch_put(sb);
+            scratch_put(buffer);
+            return 0;
+        }
+        if(truncate_compressed(sb, node, inumber, size) < 0 || write_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+            goto err;
+        quota_update(sb, inumber, before_flags, before_size, node);
+        scratch_put(sb);
+        scratch_put(buffer);
+        return 0;
+    }
+    if(size < before_size) {
+        map_open(&map, sb, node);
+        if(map_trim(&map, file_blocks(size), &batch, &indirects) < 0)
+            goto err;
+        if(resolve_indirects(sb, &indirects, &batch) < 0 || batch_release(sb, &batch) < 0)
+            goto err;
+        set_file_size(sb, node, size);
+        // write inode back to disk
+        if(write_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0) {
+            goto err;
+        }
+        quota_update(sb, inumber, before_flags, before_size, node);
+    }
+    free(batch.blocks);
+    free(indirects.refs);
+    map_close(&map);
+    scratch_put(sb);
+    scratch_put(buffer);
+    return 0;
+    err:
+        free(batch.blocks);
+        free(indirects.refs);
+        map_close(&map);
+        scratch_put(sb);
+        scratch_put(buffer);
+        return -1;
+}
+
+int get_filesize(int inumber) {
+    int64_t size = get_filesize64(inumber);
+    return size > INT32_MAX ? -1 : size;
+}
+
+int64_t get_filesize64(int inumber) {
+    STAT_OP(OP_GET_FILESIZE);
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    super_block* sb = (super_block*) scratch_get();
+    if(!sb || read_super(sb) < 0) {
+        scratch_put(sb);
+        return -1;
+    }
+    if(inumber < 0 || inumber > sb->inodes) {
+        scratch_put(sb);
+        return -1;
+    }
+    inode* node = iget(sb, inumber);
+    if(!node) {
+        scratch_put(sb);
+        return -1;
+    }
+    int64_t filesize = LIVE(node) ? (int64_t) FILE_SIZE(sb, node) : -1;
+    iput(node);
+    scratch_put(sb);
     return filesize;
-}
\ No newline at end of file
+}
+
+// Reads inode block iblock from the disk, or its copy in the mounted snapshot.
+static int load_inode_block(super_block* sb, int iblock, void* buffer) {
+    int blocknr = sb->inode_block_idx + iblock;
+    if(mounted_snap >= 0) {
+        int copy = snap_map_get(sb, sb->snaps+mounted_snap, iblock);
+        if(copy < 0)
+            return -1;
+        if(copy > 0)
+            blocknr = sb->data_block_idx + copy-1;
+    }
+    return read_fs_block(sb, blocknr, buffer, BLK_INODE);
+}
+
+// Each snapshot maps inode block numbers to the data block holding the copy preserved
+// when the live block was first modified after the snapshot was taken. The map is two
+// levels deep: the index block points to map blocks of FS_BLOCK/4 entries each, and
+// entries are stored off by one so that 0 means "unchanged, read the live block".
+int snap_map_get(super_block* sb, snapshot* snap, int iblock) {
+    uint32_t* buffer = (uint32_t*) scratch_get();
+    if(!buffer) {
+        return -1;
+    }
+    if(read_fs_block(sb, sb->data_block_idx + snap->map_idx, buffer, BLK_SNAPSHOT) < 0) {
+        scratch_put(buffer);
+        return -1;
+    }
+    uint32_t map_block = buffer[iblock/(FS_BLOCK/4)];
+    if(!map_block) {
+        scratch_put(buffer);
+        return 0;
+    }
+    if(read_fs_block(sb, sb->data_block_idx + map_block-1, buffer, BLK_SNAPSHOT) < 0) {
+        scratch_put(buffer);
+        return -1;
+    }
+    int copy = buffer[iblock%(FS_BLOCK/4)];
+    scratch_put(buffer);
+    return copy;
+}
+
+int snap_map_set(super_block* sb, snapshot* snap, int iblock, int copy) {
+    uint32_t* buffer = (uint32_t*) scratch_get();
+    if(!buffer) {
+        return -1;
+    }
+    if(read_fs_block(sb, sb->data_block_idx + snap->map_idx, buffer, BLK_SNAPSHOT) < 0)
+        goto err;
+    uint32_t map_block = buffer[iblock/(FS_BLOCK/4)];
+    if(!map_block) {
+        int new_block = find_free_datablock(sb);
+        if(new_block < 0)
+            goto err;
+        map_block = new_block+1;
+        buffer[iblock/(FS_BLOCK/4)] = map_block;
+        if(write_fs_block(sb, sb->data_block_idx + snap->map_idx, buffer, BLK_SNAPSHOT) < 0)
+            goto err;
+        memset(buffer, 0, FS_BLOCK);
+    } else if(read_fs_block(sb, sb->data_block_idx + map_block-1, buffer, BLK_SNAPSHOT) < 0) {
+        goto err;
+    }
+    buffer[iblock%(FS_BLOCK/4)] = copy;
+    if(write_fs_block(sb, sb->data_block_idx + map_block-1, buffer, BLK_SNAPSHOT) < 0)
+        goto err;
+    scratch_put(buffer);
+    return 0;
+    err:
+        scratch_put(buffer);
+        return -1;
+}
+
+snapshot* latest_snapshot(super_block* sb) {
+    snapshot* latest = NULL;
+    for(int i=0; i<MAXSNAPSHOTS; i++) {
+        if(sb->snaps[i].valid && (!latest || sb->snaps[i].id > latest->id))
+            latest = sb->snaps+i;
+    }
+    return latest;
+}
+
+// Called before an inode block is modified. If some snapshot still reads the live copy of
+// the block, the current contents are copied out and every block the inodes refer to gets
+// an extra reference, so later writes to those blocks are redirected to new locations.
+int snap_preserve(super_block* sb, int iblock) {
+    snapshot* latest = latest_snapshot(sb);
+    if(!latest)
+        return 0;
+    // snapshots are filled in together, so if the newest one has a copy all of them do
+    int copy = snap_map_get(sb, latest, iblock);
+    if(copy != 0)
+        return copy < 0 ? -1 : 0;
+    inode* buffer = (inode*) scratch_get();
+    if(!buffer) {
+        return -1;
+    }
+    if(read_inode_block(sb, iblock, buffer) < 0)
+        goto err;
+    copy = find_free_datablock(sb);
+    if(copy < 0)
+        goto err;
+    if(write_fs_block(sb, sb->data_block_idx + copy, buffer, BLK_SNAPSHOT) < 0)
+        goto err;
+    for(int i=0; i<INODES_PER_BLOCK(sb); i++) {
+        inode* node = INODE_AT(sb, buffer, i);
+        if(node->valid && ref_inode_blocks(sb, node) < 0)
+            goto err;
+    }
+    int owners = 0;
+    for(int i=0; i<MAXSNAPSHOTS; i++) {
+        if(!sb->snaps[i].valid)
+            continue;
+        int existing = snap_map_get(sb, sb->snaps+i, iblock);
+        if(existing < 0)
+            goto err;
+        if(existing)
+            continue;
+        if(owners++ && ref_datablock(copy, sb) < 0)
+            goto err;
+        if(snap_map_set(sb, sb->snaps+i, iblock, copy+1) < 0)
+            goto err;
+    }
+    scratch_put(buffer);
+    return 0;
+    err:
+        scratch_put(buffer);
+        return -1;
+}
+
+int create_snapshot() {
+    STAT_OP(OP_CREATE_SNAPSHOT);
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    if(mounted_snap >= 0) {
+        printf("ERR: Snapshot is mounted read-only.\n");
+        return -1;
+    }
+    super_block* sb = (super_block*) scratch_get();
+    void* buffer = scratch_zeroed();
+    if(!sb || !buffer || read_super(sb) < 0)
+        goto err;
+    snapshot* snap = NULL;
+    for(int i=0; i<MAXSNAPSHOTS; i++) {
+        if(!sb->snaps[i].valid) {
+            snap = sb->snaps+i;
+            break;
+        }
+    }
+    if(!snap) {
+        printf("Snapshot limit reached.\n");
+        goto err;
+    }
+    // the whole live inode table is shared with the snapshot until blocks get modified,
+    // so taking one only costs the (empty) map index block
+    int map_idx = find_free_datablock(sb);
+    if(map_idx < 0)
+        goto err;
+    if(write_fs_block(sb, sb->data_block_idx + map_idx, buffer, BLK_SNAPSHOT) < 0) {
+        free_data_bitmap(map_idx, sb);
+        goto err;
+    }
+    snap->valid = 1;
+    snap->id = sb->snap_next_id++;
+    snap->map_idx = map_idx;
+    sb->cow_active = 1;
+    if(write_super(sb) < 0) {
+        free_data_bitmap(map_idx, sb);
+        goto err;
+    }
+    int id = snap->id;
+    scratch_put(sb);
+    scratch_put(buffer);
+    return id;
+    err:
+        scratch_put(sb);
+        scratch_put(buffer);
+        return -1;
+}
+
+int list_snapshots(int *ids, int max) {
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    super_block* sb = (super_block*) scratch_get();
+    if(!sb || read_super(sb) < 0) {
+        scratch_put(sb);
+        return -1;
+    }
+    // ids are handed out in increasing order, list them oldest first
+    int count = 0;
+    uint32_t last = 0;
+    while(1) {
+        snapshot* next = NULL;
+        for(int i=0; i<MAXSNAPSHOTS; i++) {
+            if(sb->snaps[i].valid && sb->snaps[i].id > last && (!next || sb->snaps[i].id < next->id))
+                next = sb->snaps+i;
+        }
+        if(!next)
+            break;
+        if(count < max)
+            ids[count] = next->id;
+        count++;
+        last = next->id;
+    }
+    scratch_put(sb);
+    return count;
+}
+
+int delete_snapshot(int id) {
+    STAT_OP(OP_DELETE_SNAPSHOT);
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    if(mounted_snap >= 0) {
+        printf("ERR: Snapshot is mounted read-only.\n");
+        return -1;
+    }
+    super_block* sb = (super_block*) scratch_get();
+    uint32_t* index = (uint32_t*) scratch_get();
+    uint32_t* map = (uint32_t*) scratch_get();
+    inode* copy = (inode*) scratch_get();
+    if(!sb || !index || !map || !copy || read_super(sb) < 0)
+        goto err;
+    snapshot* snap = NULL;
+    for(int i=0; i<MAXSNAPSHOTS; i++) {
+        if(sb->snaps[i].valid && sb->snaps[i].id == id)
+            snap = sb->snaps+i;
+    }
+    if(!snap)
+        goto err;
+    if(read_fs_block(sb, sb->data_block_idx + snap->map_idx, index, BLK_SNAPSHOT) < 0)
+        goto err;
+    int map_blocks = ceil(sb->inode_blocks/(double)(FS_BLOCK/4));
+    for(int i=0; i<map_blocks; i++) {
+        if(!index[i])
+            continue;
+        if(read_fs_block(sb, sb->data_block_idx + index[i]-1, map, BLK_SNAPSHOT) < 0)
+            goto err;
+        for(int j=0; j<FS_BLOCK/4; j++) {
+            if(!map[j])
+                continue;
+            int shared = is_shared(map[j]-1, sb);
+            if(shared < 0)
+                goto err;
+            if(!shared) {
+                // last snapshot holding this copy, drop what its inodes refer to
+                if(read_fs_block(sb, sb->data_block_idx + map[j]-1, copy, BLK_SNAPSHOT) < 0)
+                    goto err;
+                for(int k=0; k<INODES_PER_BLOCK(sb); k++) {
+                    inode* node = INODE_AT(sb, copy, k);
+                    if(node->valid && release_inode_blocks(sb, node) < 0)
+                        goto err;
+                }
+            }
+            if(unref_datablock(map[j]-1, sb) < 0)
+                goto err;
+        }
+        if(free_data_bitmap(index[i]-1, sb) < 0)
+            goto err;
+    }
+    if(free_data_bitmap(snap->map_idx, sb) < 0)
+        goto err;
+    snap->valid = 0;
+    if(write_super(sb) < 0)
+        goto err;
+    scratch_put(sb);
+    scratch_put(index);
+    scratch_put(map);
+    scratch_put(copy);
+    return 0;
+    err:
+        scratch_put(sb);
+        scratch_put(index);
+        scratch_put(map);
+        scratch_put(copy);
+        return -1;
+}
+
+int mount_snapshot(disk *diskptr, int id) {
+    STAT_OP(OP_MOUNT_SNAPSHOT);
+    SFS_LOCKED;
+    if(mount(diskptr) < 0)
+        return -1;
+    super_block* sb = (super_block*) scratch_get();
+    if(!sb || (STAT_IO(BLK_SUPER, 0), read_block(diskptr, 0, sb)) < 0) {
+        scratch_put(sb);
+        return -1;
+    }
+    int retval = -1;
+    for(int i=0; i<MAXSNAPSHOTS; i++) {
+        if(sb->snaps[i].valid && sb->snaps[i].id == id) {
+            mounted_snap = i;
+            retval = 0;
+        }
+    }
+    // the inode blocks cached so far are the live ones
+    if(flush_inodes(NULL) < 0)
+        retval = -1;
+    icache_reset();
+    if(retval < 0)
+        mountptr = NULL;
+    scratch_put(sb);
+    return retval;
+}
+
+// Inline deduplication keeps an in-memory index from block fingerprints to data blocks.
+// Candidates are always compared byte for byte before being shared, and blocks drop out
+// of the index when they are freed, so the index never has to be persisted.
+typedef struct dedup_entry {
+    uint64_t fp;
+    uint32_t dnumber; // data block number + 1, 0 for an empty slot
+} dedup_entry;
+
+static dedup_entry* dedup_table = NULL;
+static uint32_t dedup_capacity = 0; // power of two
+static uint32_t dedup_entries = 0;
+static uint64_t* dedup_block_fp = NULL; // fingerprint indexed for each data block, 0 if none
+static uint32_t dedup_nblocks = 0;
+static dedup_stats dedup_counters;
+
+uint64_t block_fingerprint(const void* buffer) {
+    const uint64_t* words = (const uint64_t*) buffer;
+    uint64_t lanes[4] = {0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL};
+    for(int i=0; i<FS_BLOCK/8; i+=4) {
+        for(int j=0; j<4; j++) {
+            lanes[j] += words[i+j] * 0xC2B2AE3D27D4EB4FULL;
+            lanes[j] = (lanes[j] << 31) | (lanes[j] >> 33);
+            lanes[j] *= 0x9E3779B185EBCA87ULL;
+        }
+    }
+    uint64_t h = lanes[0] ^ (lanes[1] << 7 | lanes[1] >> 57) ^ (lanes[2] << 12 | lanes[2] >> 52) ^ (lanes[3] << 18 | lanes[3] >> 46);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+static uint64_t elapsed_ns(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec-start->tv_sec)*1000000000ULL + now.tv_nsec - start->tv_nsec;
+}
+
+void dedup_reset() {
+    free(dedup_table);
+    free(dedup_block_fp);
+    dedup_table = NULL;
+    dedup_block_fp = NULL;
+    dedup_capacity = dedup_entries = dedup_nblocks = 0;
+    memset(&dedup_counters, 0, sizeof(dedup_stats));
+}
+
+static int dedup_init(super_block* sb) {
+    if(dedup_table)
+        return 0;
+    dedup_capacity = 1024;
+    dedup_table = (dedup_entry*) calloc(dedup_capacity, sizeof(dedup_entry));
+    dedup_block_fp = (uint64_t*) calloc(sb->data_blocks, sizeof(uint64_t));
+    if(!dedup_table || !dedup_block_fp) {
+        dedup_reset();
+        return -1;
+    }
+    dedup_nblocks = sb->data_blocks;
+    return 0;
+}
+
+static dedup_entry* dedup_slot(uint64_t fp) {
+    uint32_t i = fp & (dedup_capacity-1);
+    while(dedup_table[i].dnumber && dedup_table[i].fp != fp)
+        i = (i+1) & (dedup_capacity-1);
+    return dedup_table+i;
+}
+
+static void dedup_remove_slot(dedup_entry* slot) {
+    // backward shift deletion keeps linear probe chains intact without tombstones
+    uint32_t i = slot-dedup_table;
+    uint32_t j = i;
+    dedup_table[i].dnumber = 0;
+    while(1) {
+        j = (j+1) & (dedup_capacity-1);
+        if(!dedup_table[j].dnumber)
+            break;
+        uint32_t home = dedup_table[j].fp & (dedup_capacity-1);
+        if((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+            dedup_table[i] = dedup_table[j];
+            dedup_table[j].dnumber = 0;
+            i = j;
+        }
+    }
+    dedup_entries--;
+}
+
+void dedup_forget(int dnumber) {
+    if(!dedup_table || dnumber < 0 || dnumber >= dedup_nblocks || !dedup_block_fp[dnumber])
+        return;
+    dedup_entry* slot = dedup_slot(dedup_block_fp[dnumber]);
+    if(slot->dnumber == dnumber+1)
+        dedup_remove_slot(slot);
+    dedup_block_fp[dnumber] = 0;
+}
+
+void dedup_insert(super_block* sb, uint64_t fp, int dnumber) {
+    if(dedup_init(sb) < 0 || dnumber < 0 || dnumber >= dedup_nblocks)
+        return;
+    // the block was rewritten, whatever it was indexed under is stale now
+    dedup_forget(dnumber);
+    if((dedup_entries+1)*2 > dedup_capacity) {
+        dedup_entry* old = dedup_table;
+        uint32_t old_capacity = dedup_capacity;
+        dedup_entry* grown = (dedup_entry*) calloc(old_capacity*2, sizeof(dedup_entry));
+        if(!grown)
+            return;
+        dedup_table = grown;
+        dedup_capacity = old_capacity*2;
+        for(uint32_t i=0; i<old_capacity; i++) {
+            if(old[i].dnumber)
+                *dedup_slot(old[i].fp) = old[i];
+        }
+        free(old);
+    }
+    dedup_entry* slot = dedup_slot(fp);
+    if(slot->dnumber) {
+        // same fingerprint, different contents: the newest block wins
+        dedup_block_fp[slot->dnumber-1] = 0;
+    } else {
+        dedup_entries++;
+    }
+    slot->fp = fp;
+    slot->dnumber = dnumber+1;
+    dedup_block_fp[dnumber] = fp;
+}
+
+// Points block blocknum of the file at an existing block with identical contents, if the
+// index knows one. Returns 1 if the block was shared, 0 if it has to be written, -1 on error.
+int dedup_block(block_map* map, uint32_t blocknum, void* buffer, uint64_t* fp) {
+    super_block* sb = map->sb;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int retval = 0;
+    *fp = block_fingerprint(buffer);
+    dedup_counters.lookups++;
+    if(dedup_init(sb) < 0) {
+        dedup_counters.write_ns += elapsed_ns(&start);
+        return 0;
+    }
+    dedup_entry* slot = dedup_slot(*fp);
+    if(!slot->dnumber) {
+        dedup_counters.write_ns += elapsed_ns(&start);
+        return 0;
+    }
+    int candidate = slot->dnumber-1;
+    char* existing = (char*) scratch_get();
+    if(!existing)
+        goto done;
+    int64_t old_block = map_get(map, blocknum);
+    if(old_block < 0) {
+        retval = -1;
+        goto done;
+    }
+    if(old_block == candidate)
+        goto done;
+    if(read_fs_block(sb, sb->data_block_idx + candidate, existing, DATA_CLASS(map->node)) < 0 || memcmp(existing, buffer, FS_BLOCK))
+        goto done;
+    if(ref_datablock(candidate, sb) < 0 || map_set(map, blocknum, candidate) < 0) {
+        retval = -1;
+        goto done;
+    }
+    if(unref_datablock(old_block, sb) < 0) {
+        retval = -1;
+        goto done;
+    }
+    dedup_counters.hits++;
+    retval = 1;
+    done:
+        scratch_put(existing);
+        dedup_counters.write_ns += elapsed_ns(&start);
+        return retval;
+}
+
+int set_dedup(int enable) {
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    dedup_enabled = enable ? 1 : 0;
+    return 0;
+}
+
+int get_dedup_stats(dedup_stats* stats) {
+    SFS_LOCKED;
+    if(!stats)
+        return -1;
+    *stats = dedup_counters;
+    stats->index_entries = dedup_entries;
+    stats->index_bytes = (uint64_t) dedup_capacity*sizeof(dedup_entry) + (uint64_t) dedup_nblocks*sizeof(uint64_t);
+    return 0;
+}
+
+// Compressed files keep the usual block map, indexed by logical block, but group the
+// blocks into clusters of CLUSTER_BLOCKS. A cluster reaching into its last block that
+// compresses into fewer blocks stores a stream (4 byte length followed by the codec
+// output) in its first slots and NO_BLOCK in the rest; any other cluster is stored raw,
+// one block per slot.
+// Clusters are rewritten as a whole into newly allocated blocks, so shared blocks are
+// never modified in place.
+#define CLUSTER_SIZE (CLUSTER_BLOCKS*FS_BLOCK)
+
+static char* cluster_cache = NULL; // last cluster decompressed by read_compressed
+static int cluster_cache_inumber = -1;
+static int cluster_cache_idx = -1;
+
+void invalidate_cluster_cache() {
+    cluster_cache_inumber = -1;
+    cluster_cache_idx = -1;
+}
+
+// Switches the derived sizes to another block size. Buffers kept across calls were sized
+// for the old one, so they are dropped.
+static void set_block_size(uint32_t size) {
+    if(size == fs_block)
+        return;
+    reset_csum_cache();
+    invalidate_cluster_cache();
+    free(cluster_cache);
+    cluster_cache = NULL;
+    fs_block = size;
+}
+
+uint32_t fs_block_size() {
+    SFS_LOCKED;
+    return fs_block;
+}
+
+// Reads the logical contents of cluster c into out (CLUSTER_SIZE bytes).
+int load_cluster(block_map* map, uint32_t c, char* out) {
+    super_block* sb = map->sb;
+    uint32_t first = c*CLUSTER_BLOCKS;
+    if(map->blocks <= first)
+        return 0;
+    uint32_t mapped = map->blocks - first;
+    if(mapped > CLUSTER_BLOCKS)
+        mapped = CLUSTER_BLOCKS;
+    int64_t last = map_get(map, first + mapped-1);
+    if(last < 0)
+        return -1;
+    if(mapped == CLUSTER_BLOCKS && last == NO_BLOCK) {
+        char* stream = (char*) malloc(CLUSTER_SIZE);
+        if(!stream)
+            return -1;
+        for(int i=0; i<CLUSTER_BLOCKS-1; i++) {
+            int64_t block = map_get(map, first + i);
+            if(block == NO_BLOCK)
+                break;
+            if(block < 0 || read_fs_block(sb, sb->data_block_idx + block, stream + i*FS_BLOCK, DATA_CLASS(map->node)) < 0) {
+                free(stream);
+                return -1;
+            }
+        }
+        uint32_t stream_len;
+        memcpy(&stream_len, stream, sizeof(uint32_t));
+        if(stream_len > CLUSTER_SIZE-FS_BLOCK-sizeof(uint32_t) || lz_decompress(stream+sizeof(uint32_t), stream_len, out, CLUSTER_SIZE) != CLUSTER_SIZE) {
+            STAT_ERROR(ERR_CORRUPT);
+            free(stream);
+            return -1;
+        }
+        free(stream);
+        return 0;
+    }
+    for(uint32_t i=0; i<mapped; i++) {
+        int64_t block = map_get(map, first + i);
+        if(block < 0 || read_fs_block(sb, sb->data_block_idx + block, out + i*FS_BLOCK, DATA_CLASS(map->node)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Writes len bytes of cluster c to new blocks and releases the old_mapped blocks it used.
+int store_cluster(block_map* map, uint32_t c, char* in, int len, int old_mapped) {
+    super_block* sb = map->sb;
+    uint32_t first = c*CLUSTER_BLOCKS;
+    int new_blocks[CLUSTER_BLOCKS];
+    uint32_t old_blocks[CLUSTER_BLOCKS];
+    for(int i=0; i<old_mapped; i++) {
+        int64_t block = map_get(map, first + i);
+        if(block < 0)
+            return -1;
+        old_blocks[i] = block;
+    }
+    int nblocks = ceil(len/(double)FS_BLOCK);
+    // every block the cluster covers gets a slot, so the map reaches as far as the file size
+    int slots = nblocks;
+    char* out = in;
+    char* stream = NULL;
+    if(nblocks == CLUSTER_BLOCKS) {
+        stream = (char*) malloc(CLUSTER_SIZE);
+        if(!stream)
+            return -1;
+        int stream_len = lz_compress(in, CLUSTER_SIZE, stream+sizeof(uint32_t), CLUSTER_SIZE-FS_BLOCK-sizeof(uint32_t));
+        if(stream_len > 0) {
+            memcpy(stream, &stream_len, sizeof(uint32_t));
+            nblocks = ceil((stream_len+sizeof(uint32_t))/(double)FS_BLOCK);
+            out = stream;
+        }
+    }
+    if(out == in && len%FS_BLOCK)
+        memset(in+len, 0, FS_BLOCK - len%FS_BLOCK);
+    for(int i=0; i<nblocks; i++) {
+        new_blocks[i] = find_free_datablock(sb);
+        if(new_blocks[i] < 0 || write_fs_block(sb, sb->data_block_idx + new_blocks[i], out + i*FS_BLOCK, DATA_CLASS(map->node)) < 0) {
+            for(int j=0; j<=i; j++) {
+                if(new_blocks[j] >= 0)
+                    free_data_bitmap(new_blocks[j], sb);
+            }
+            free(stream);
+            return -1;
+        }
+    }
+    for(int i=0; i<slots; i++) {
+        if(map_set(map, first + i, (i < nblocks) ? (uint32_t) new_blocks[i] : NO_BLOCK) < 0) {
+            free(stream);
+            return -1;
+        }
+    }
+    for(int i=0; i<old_mapped; i++) {
+        if(unref_datablock(old_blocks[i], sb) < 0) {
+            free(stream);
+            return -1;
+        }
+    }
+    free(stream);
+    return 0;
+}
+
+int64_t write_compressed(super_block* sb, inode* node, int inumber, char* data, uint64_t length, uint64_t offset) {
+    uint64_t max = MAX_FILE_BLOCKS(sb)*FS_BLOCK;
+    if(offset >= max)
+        return 0;
+    if(length > max-offset)
+        length = max-offset;
+    uint64_t end = offset+length;
+    block_map map;
+    map_open(&map, sb, node);
+    char* cluster = (char*) malloc(CLUSTER_SIZE);
+    if(!cluster) {
+        return -1;
+    }
+    if(cluster_cache_inumber == inumber)
+        invalidate_cluster_cache();
+    uint64_t byteswritten = 0;
+    for(uint32_t c=offset/CLUSTER_SIZE; c<=(end-1)/CLUSTER_SIZE; c++) {
+        uint64_t start = (uint64_t) c*CLUSTER_SIZE;
+        uint64_t size = FILE_SIZE(sb, node);
+        int old_len = (size <= start) ? 0 : (size-start > CLUSTER_SIZE) ? CLUSTER_SIZE : size-start;
+        if(old_len > 0 && load_cluster(&map, c, cluster) < 0)
+            break;
+        uint64_t from = (offset > start) ? offset : start;
+        uint64_t to = (end < start+CLUSTER_SIZE) ? end : start+CLUSTER_SIZE;
+        memcpy(cluster + (from-start), data + (from-offset), to-from);
+        int new_len = (to-start > (uint64_t) old_len) ? to-start : old_len;
+        if(store_cluster(&map, c, cluster, new_len, ceil(old_len/(double)FS_BLOCK)) < 0)
+            break;
+        if(start+new_len > size)
+            set_file_size(sb, node, start+new_len);
+        byteswritten = to-offset;
+    }
+    int64_t retval = byteswritten;
+    if(map_flush(&map) < 0)
+        retval = -1;
+    map_close(&map);
+    free(cluster);
+    return retval;
+}
+
+int64_t read_compressed(super_block* sb, inode* node, int inumber, char* data, uint64_t length, uint64_t offset) {
+    if(length > FILE_SIZE(sb, node) - offset)
+        length = FILE_SIZE(sb, node) - offset;
+    uint64_t end = offset+length;
+    if(!cluster_cache) {
+        cluster_cache = (char*) malloc(CLUSTER_SIZE);
+        if(!cluster_cache)
+            return -1;
+    }
+    block_map map;
+    map_open(&map, sb, node);
+    for(uint32_t c=offset/CLUSTER_SIZE; c<=(end-1)/CLUSTER_SIZE; c++) {
+        if(cluster_cache_inumber != inumber || cluster_cache_idx != (int) c) {
+            invalidate_cluster_cache();
+            if(load_cluster(&map, c, cluster_cache) < 0) {
+                map_close(&map);
+                return -1;
+            }
+            cluster_cache_inumber = inumber;
+            cluster_cache_idx = c;
+        }
+        uint64_t start = (uint64_t) c*CLUSTER_SIZE;
+        uint64_t from = (offset > start) ? offset : start;
+        uint64_t to = (end < start+CLUSTER_SIZE) ? end : start+CLUSTER_SIZE;
+        memcpy(data + (from-offset), cluster_cache + (from-start), to-from);
+    }
+    map_close(&map);
+    return length;
+}
+
+int truncate_compressed(super_block* sb, inode* node, int inumber, uint64_t size) {
+    uint32_t c = size/CLUSTER_SIZE;
+    int keep = size - (uint64_t) c*CLUSTER_SIZE;
+    block_map map;
+    map_open(&map, sb, node);
+    char* cluster = (char*) malloc(CLUSTER_SIZE);
+    block_batch batch = {NULL, 0, 0};
+    indirect_batch indirects = {NULL, 0, 0};
+    if(!cluster)
+        goto err;
+    if(cluster_cache_inumber == inumber)
+        invalidate_cluster_cache();
+    // the cluster cut in the middle is rewritten raw, everything after it goes away
+    if(keep > 0 && load_cluster(&map, c, cluster) < 0)
+        goto err;
+    if(map_trim(&map, c*CLUSTER_BLOCKS, &batch, &indirects) < 0)
+        goto err;
+    if(resolve_indirects(sb, &indirects, &batch) < 0 || batch_release(sb, &batch) < 0)
+        goto err;
+    set_file_size(sb, node, (uint64_t) c*CLUSTER_SIZE);
+    if(keep > 0) {
+        if(store_cluster(&map, c, cluster, keep, 0) < 0)
+            goto err;
+        set_file_size(sb, node, size);
+    }
+    if(map_flush(&map) < 0)
+        goto err;
+    free(batch.blocks);
+    free(indirects.refs);
+    map_close(&map);
+    free(cluster);
+    return 0;
+    err:
+        free(batch.blocks);
+        free(indirects.refs);
+        map_close(&map);
+        free(cluster);
+        return -1;
+}
+
+int set_compression(int inumber, int enable) {
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    if(mounted_snap >= 0) {
+        printf("ERR: Snapshot is mounted read-only.\n");
+        return -1;
+    }
+    super_block* sb = (super_block*) scratch_get();
+    inode* buffer = (inode*) scratch_get();
+    if(!sb || !buffer || read_super(sb) < 0 || inumber < 0 || inumber >= sb->inodes)
+        goto err;
+    if(snap_preserve(sb, inumber/INODES_PER_BLOCK(sb)) < 0 || read_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+        goto err;
+    inode* node = INODE_AT(sb, buffer, inumber);
+    // the layout can only be chosen while there is no data to convert
+    if(!node->valid || FILE_SIZE(sb, node) > 0)
+        goto err;
+    if(enable)
+        node->flags = (node->flags & ~INODE_INLINE) | INODE_COMPRESSED;
+    else
+        node->flags &= ~INODE_COMPRESSED;
+    if(write_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+        goto err;
+    scratch_put(sb);
+    scratch_put(buffer);
+    return 0;
+    err:
+        scratch_put(sb);
+        scratch_put(buffer);
+        return -1;
+}
+
+// Each step is idempotent, so a logged rename can be applied again after a crash at any point.
+static int apply_rename(rename_intent* intent) {
+    dir_item current;
+    if(write_i(intent->dst_dir, (char*) &intent->item, sizeof(dir_item), intent->dst_offset) != sizeof(dir_item))
+        return -1;
+    if(read_i(intent->src_dir, (char*) &current, sizeof(dir_item), intent->src_offset) != sizeof(dir_item))
+        return -1;
+    if(current.valid && current.inumber == intent->item.inumber) {
+        current.valid = 0;
+        if(write_i(intent->src_dir, (char*) &current, sizeof(dir_item), intent->src_offset) != sizeof(dir_item))
+            return -1;
+    }
+    // the replaced inode loses the name once: after that its link count no longer matches
+    if(intent->replaced >= 0 && intent->replaced != intent->item.inumber && get_link_count(intent->replaced) == (int) intent->replaced_links)
+        return unlink_inode(intent->replaced) < 0 ? -1 : 0;
+    return 0;
+}
+
+static int write_rename_log(rename_intent* intent) {
+    super_block* sb = (super_block*) scratch_get();
+    if(!sb || read_super(sb) < 0) {
+        scratch_put(sb);
+        return -1;
+    }
+    if(intent)
+        sb->rename_log = *intent;
+    else
+        memset(&sb->rename_log, 0, sizeof(rename_intent));
+    int retval = write_super(sb);
+    scratch_put(sb);
+    return retval;
+}
+
+// Rewrites the two directory slots the rename touches with what they hold, so that their
+// blocks are private and allocated before the commit point and clearing the old entry
+// cannot run out of space. prev is set to the destination slot, zeros past the end.
+static int prepare_rename(rename_intent* intent, dir_item* prev) {
+    dir_item current;
+    memset(prev, 0, sizeof(dir_item));
+    read_i(intent->dst_dir, (char*) prev, sizeof(dir_item), intent->dst_offset);
+    if(write_i(intent->dst_dir, (char*) prev, sizeof(dir_item), intent->dst_offset) != sizeof(dir_item))
+        return -1;
+    if(read_i(intent->src_dir, (char*) &current, sizeof(dir_item), intent->src_offset) != sizeof(dir_item))
+        return -1;
+    if(write_i(intent->src_dir, (char*) &current, sizeof(dir_item), intent->src_offset) != sizeof(dir_item))
+        return -1;
+    return 0;
+}
+
+// The super block write that logs the intent is the commit point of the rename.
+int rename_entry(rename_intent *intent) {
+    STAT_OP(OP_RENAME_ENTRY);
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    if(mounted_snap >= 0) {
+        printf("ERR: Snapshot is mounted read-only.\n");
+        return -1;
+    }
+    dir_item prev, current;
+    if(prepare_rename(intent, &prev) < 0)
+        return -1;
+    intent->valid = 1;
+    if(write_rename_log(intent) < 0)
+        return -1;
+    if(apply_rename(intent) < 0) {
+        // undone while the old entry is still there, otherwise left in the log for mount to
+        // finish; never both names
+        if(read_i(intent->src_dir, (char*) &current, sizeof(dir_item), intent->src_offset) != sizeof(dir_item)
+            || !current.valid || current.inumber != intent->item.inumber
+            || write_i(intent->dst_dir, (char*) &prev, sizeof(dir_item), intent->dst_offset) != sizeof(dir_item))
+            return -1;
+        write_rename_log(NULL);
+        return -1;
+    }
+    if(write_rename_log(NULL) < 0)
+        return -1;
+    return 0;
+}
+
+int replay_rename(super_block* sb) {
+    if(!sb->rename_log.valid)
+        return 0;
+    rename_intent intent = sb->rename_log;
+    if(apply_rename(&intent) < 0)
+        printf("ERR: Unable to finish an interrupted rename.\n");
+    return write_rename_log(NULL);
+}
+// Deferred deletion: with async unlink on, removing a file only flags its inode as an
+// orphan and queues it in the super block. A background thread frees the queued inodes a
+// few at a time, letting go of the lock and pausing between passes.
+static int reclaim_batch = 16;
+static int reclaim_pause_us = 1000;
+static int reclaimer_started = 0;
+static int reclaim_wanted = 0;
+static pthread_t reclaimer;
+static pthread_mutex_t reclaim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+
+// Queues the inode in buffer for the reclaimer. Returns 1 if it was queued (or already is),
+// 0 if the queue is full and the caller has to free it now, -1 on error.
+int queue_orphan(super_block* sb, inode* buffer, int inumber) {
+    inode* node = INODE_AT(sb, buffer, inumber);
+    if(node->flags & INODE_ORPHAN)
+        return 1;
+    if(sb->orphan_count >= MAX_ORPHANS)
+        return 0;
+    node->flags |= INODE_ORPHAN;
+    node->link_count = 1;
+    if(write_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+        return -1;
+    sb->orphans[sb->orphan_count++] = inumber;
+    if(write_super(sb) < 0)
+        return -1;
+    wake_reclaimer();
+    return 1;
+}
+
+// Frees up to max queued orphans (all of them if max is negative) and returns how many
+// were taken off the queue.
+int reclaim_orphans(int max) {
+    STAT_OP(OP_RECLAIM_ORPHANS);
+    SFS_LOCKED;
+    if(!mountptr || mounted_snap >= 0)
+        return 0;
+    super_block* sb = (super_block*) scratch_get();
+    inode* buffer = (inode*) scratch_get();
+    int inumbers[MAX_ORPHANS];
+    if(!sb || !buffer || read_super(sb) < 0)
+        goto err;
+    int n = sb->orphan_count;
+    if(max >= 0 && n > max)
+        n = max;
+    // an inode freed directly in the meantime may have been reused, so only flagged ones go
+    int count = 0;
+    for(int i=0; i<n; i++) {
+        uint32_t inumber = sb->orphans[i];
+        if(inumber >= sb->inodes || read_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0)
+            continue;
+        inode* node = INODE_AT(sb, buffer, inumber);
+        if(node->valid && (node->flags & INODE_ORPHAN))
+            inumbers[count++] = inumber;
+    }
+    if(count && remove_inodes(inumbers, count) < 0)
+        goto err;
+    // the inodes are gone before they leave the queue, a crash in between is redone by mount
+    if(read_super(sb) < 0)
+        goto err;
+    sb->orphan_count -= n;
+    memmove(sb->orphans, sb->orphans+n, sb->orphan_count*sizeof(uint32_t));
+    if(n && write_super(sb) < 0)
+        goto err;
+    scratch_put(sb);
+    scratch_put(buffer);
+    return n;
+    err:
+        scratch_put(sb);
+        scratch_put(buffer);
+        return -1;
+}
+
+static void* reclaimer_main(void* arg) {
+    for(;;) {
+        pthread_mutex_lock(&reclaim_mutex);
+        while(!reclaim_wanted)
+            pthread_cond_wait(&reclaim_cond, &reclaim_mutex);
+        reclaim_wanted = 0;
+        pthread_mutex_unlock(&reclaim_mutex);
+        for(;;) {
+            // the rate is picked up on every pass so a change applies to the queue at hand
+            pthread_mutex_lock(&reclaim_mutex);
+            int batch = reclaim_batch;
+            struct timespec pause = {reclaim_pause_us/1000000, (reclaim_pause_us%1000000)*1000L};
+            pthread_mutex_unlock(&reclaim_mutex);
+            if(reclaim_orphans(batch) <= 0)
+                break;
+            nanosleep(&pause, NULL);
+        }
+        flush_discards();
+    }
+    return NULL;
+}
+
+void wake_reclaimer() {
+    pthread_mutex_lock(&reclaim_mutex);
+    if(!reclaimer_started) {
+        if(pthread_create(&reclaimer, NULL, reclaimer_main, NULL) != 0) {
+            printf("ERR: Could not start the reclaimer.\n");
+            pthread_mutex_unlock(&reclaim_mutex);
+            return;
+        }
+        pthread_detach(reclaimer);
+        reclaimer_started = 1;
+    }
+    reclaim_wanted = 1;
+    pthread_cond_signal(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_mutex);
+}
+
+int set_async_unlink(int enable) {
+    SFS_LOCKED;
+    async_unlink = enable ? 1 : 0;
+    return 0;
+}
+
+int set_reclaim_rate(int inodes_per_pass, int pause_us) {
+    if(inodes_per_pass <= 0 || pause_us < 0)
+        return -1;
+    pthread_mutex_lock(&reclaim_mutex);
+    reclaim_batch = inodes_per_pass;
+    reclaim_pause_us = pause_us;
+    pthread_mutex_unlock(&reclaim_mutex);
+    return 0;
+}
+
+int pending_orphans() {
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    super_block* sb = (super_block*) scratch_get();
+    if(!sb || read_super(sb) < 0) {
+        scratch_put(sb);
+        return -1;
+    }
+    int count = sb->orphan_count;
+    scratch_put(sb);
+    return count;
+}
+
+// Per-directory quotas. The super block records which directories are tenants and their
+// limits. Which tenant each inode belongs to, and how much each tenant uses, is kept in
+// memory: it is rebuilt by walking the tenant directories the first time it is needed
+// after mount and updated as files grow, shrink and go away from then on.
+static uint8_t* quota_owner = NULL; // tenant slot+1 for each inode, 0 if it is in no tenant
+static uint32_t quota_owner_inodes = 0;
+static int quota_loaded = 0;
+static quota_usage quota_used[MAX_QUOTAS];
+
+void quota_reset() {
+    free(quota_owner);
+    quota_owner = NULL;
+    quota_owner_inodes = 0;
+    quota_loaded = 0;
+    memset(quota_used, 0, sizeof(quota_used));
+}
+
+// Data blocks a file of this size maps, counting its indirect blocks. Compressed files are
+// charged for their logical size.
+static uint64_t size_charge(super_block* sb, int flags, uint64_t size) {
+    if((flags & INODE_INLINE) && size <= INLINE_CAPACITY(sb))
+        return 0;
+    uint64_t per = MAP_ENTRIES(sb);
+    uint64_t n_blocks = (size+FS_BLOCK-1)/FS_BLOCK;
+    uint64_t charge = n_blocks + (n_blocks > 5);
+    if(n_blocks > 5+per)
+        charge += 1 + (n_blocks-5-per+per-1)/per;
+    return charge;
+}
+
+// Fills the fields quotas look at, with the size read in the layout of the format.
+static int load_inode(super_block* sb, int inumber, inode64* node) {
+    char* buffer = (char*) scratch_get();
+    if(!buffer || read_inode_block(sb, inumber/INODES_PER_BLOCK(sb), buffer) < 0) {
+        scratch_put(buffer);
+        return -1;
+    }
+    inode* found = INODE_AT(sb, buffer, inumber);
+    memset(node, 0, sizeof(inode64));
+    node->valid = found->valid;
+    node->flags = found->flags;
+    node->link_count = found->link_count;
+    node->size = FILE_SIZE(sb, found);
+    scratch_put(buffer);
+    return 0;
+}
+
+static int quota_alloc_owner(super_block* sb) {
+    if(quota_owner)
+        return 0;
+    quota_owner = (uint8_t*) calloc(sb->inodes, 1);
+    if(!quota_owner)
+        return -1;
+    quota_owner_inodes = sb->inodes;
+    return 0;
+}
+
+// Adds root and everything below it to the tenant in slot. Nothing changes if part of the
+// tree already belongs to another tenant.
+static int quota_adopt_tree(super_block* sb, int root, int slot) {
+    int capacity = 256, count = 0, next = 0;
+    int* tree = (int*) malloc(capacity*sizeof(int));
+    dir_item* items = (dir_item*) malloc(64*sizeof(dir_item));
+    quota_usage usage;
+    memset(&usage, 0, sizeof(quota_usage));
+    if(!tree || !items)
+        goto err;
+    // entries hold the inode number shifted left with the low bit set for directories
+    tree[count++] = root << 1 | 1;
+    quota_owner[root] = slot+1;
+    // tree doubles as the queue of inodes still to look at
+    for(; next<count; next++) {
+        inode64 node;
+        int dir = tree[next] >> 1;
+        if(load_inode(sb, dir, &node) < 0)
+            goto err;
+        usage.blocks += size_charge(sb, node.flags, node.size);
+        usage.bytes += node.size;
+        usage.inodes++;
+        if(!(tree[next] & 1))
+            continue;
+        for(uint32_t offset=0; offset<node.size; offset+=64*sizeof(dir_item)) {
+            int got = read_i(dir, (char*) items, 64*sizeof(dir_item), offset);
+            if(got < 0)
+                goto err;
+            for(int i=0; i<got/(int) sizeof(dir_item); i++) {
+                uint32_t inumber = items[i].inumber;
+                if(!items[i].valid || inumber >= sb->inodes || quota_owner[inumber] == slot+1)
+                    continue;
+                if(quota_owner[inumber]) {
+                    printf("Directory holds another quota directory.\n");
+                    goto err;
+                }
+                if(count == capacity) {
+                    int* grown = (int*) realloc(tree, 2*capacity*sizeof(int));
+                    if(!grown)
+                        goto err;
+                    tree = grown;
+                    capacity *= 2;
+                }
+                tree[count++] = inumber << 1 | (items[i].is_dir ? 1 : 0);
+                quota_owner[inumber] = slot+1;
+            }
+        }
+    }
+    quota_used[slot].blocks += usage.blocks;
+    quota_used[slot].bytes += usage.bytes;
+    quota_used[slot].inodes += usage.inodes;
+    free(tree);
+    free(items);
+    return 0;
+    err:
+        for(int i=0; tree && i<count; i++)
+            quota_owner[tree[i] >> 1] = 0;
+        free(tree);
+        free(items);
+        return -1;
+}
+
+static int quota_load(super_block* sb) {
+    if(quota_loaded)
+        return 0;
+    memset(quota_used, 0, sizeof(quota_used));
+    if(quota_owner)
+        memset(quota_owner, 0, quota_owner_inodes);
+    for(int i=0; i<MAX_QUOTAS; i++) {
+        if(!sb->quotas[i].root)
+            continue;
+        if(quota_alloc_owner(sb) < 0)
+            return -1;
+        // the limits are copied here so that get_quota_inode needs only memory
+        quota_used[i].max_blocks = sb->quotas[i].max_blocks;
+        quota_used[i].max_inodes = sb->quotas[i].max_inodes;
+        if(quota_adopt_tree(sb, sb->quotas[i].root, i) < 0)
+            return -1;
+    }
+    quota_loaded = 1;
+    return 0;
+}
+
+// Tenant slot of inumber, -1 if it belongs to none.
+static int tenant_of(super_block* sb, int inumber) {
+    if(mounted_snap >= 0 || quota_load(sb) < 0 || !quota_owner || inumber < 0 || inumber >= quota_owner_inodes)
+        return -1;
+    return quota_owner[inumber]-1;
+}
+
+int quota_tenant(int inumber) {
+    SFS_LOCKED;
+    if(!mountptr)
+        return -1;
+    super_block* sb = (super_block*) scratch_get();
+    if(!sb || read_super(sb) < 0) {
+        scratch_put(sb);
+        return -1;
+    }
+    int tenant = tenant_of(sb, inumber);
+    scratch_put(sb);
+    return tenant;
+}
+
+// Refuses a write to node that would take its tenant over its block limit.
+int quota_write_check(super_block* sb, int inumber, inode* node, uint64_t length, uint64_t offset) {
+    int t = tenant_of(sb, inumber);
+    if(t < 0 || !quota_used[t].max_blocks)
+        return 0;
+    uint64_t end = offset+length;
+    if(end > MAX_FILE_BLOCKS(sb)*FS_BLOCK)
+        end = MAX_FILE_BLOCKS(sb)*FS_BLOCK;
+    uint64_t size = FILE_SIZE(sb, node);
+    if(end <= size)
+        return 0;
+    uint64_t blocks = quota_used[t].blocks - size_charge(sb, node->flags, size) + size_charge(sb, node->flags, end);
+    if(blocks > quota_used[t].max_blocks) {
+        STAT_ERROR(ERR_QUOTA);
+        return -1;
+    }
+    return 0;
+}
+
+// Charges the tenant of inumber for the change from the flags and size node had before.
+void quota_update(super_block* sb, int inumber, int before_flags, uint64_t before_size, inode* node) {
+    int t = tenant_of(sb, inumber);
+    if(t < 0)
+        return;
+    uint64_t size = FILE_SIZE(sb, node);
+    quota_used[t].blocks += size_charge(sb, node->flags, size) - size_charge(sb, before_flags, before_size);
+    quota_used[t].bytes += size - before_size;
+}
+
+// Called as node is freed. Removing the root of a tenant ends the tenant.
+int quota_release(super_block* sb, int inumber, inode* node) {
+    int t = node->valid ? tenant_of(sb, inumber) : -1;
+    if(t < 0)
+        return 0;
+    quota_used[t].blocks -= size_charge(sb, node->flags, FILE_SIZE(sb, node));
+    quota_used[t].bytes -= FILE_SIZE(sb, node);
+    quota_used[t].inodes--;
+    quota_owner[inumber] = 0;
+    if(sb->quotas[t].root != inumber)
+        return 0;
+    for(uint32_t i=0; i<quota_owner_inodes; i++) {
+        if(quota_owner[i] == t+1)
+            quota_owner[i] = 0;
+    }
+    memset(quota_used+t, 0, sizeof(quota_usage));
+    memset(sb->quotas+t, 0, sizeof(dir_quota));
+    return write_super(sb);
+}
+
+int quota_adopt(int parent, int inumber) {
+    SFS_LOCKED;
+    if(!mountptr)
+        return -1;
+    super_block* sb = (super_block*) scratch_get();
+    inode64 node;
+    if(!sb || read_super(sb) < 0 || inumber < 0 || inumber >= sb->inodes || load_inode(sb, inumber, &node) < 0) {
+        scratch_put(sb);
+        return -1;
+    }
+    int t = tenant_of(sb, parent);
+    if(t < 0 || quota_owner[inumber] == t+1) {
+        scratch_put(sb);
+        return 0;
+    }
+    if(quota_used[t].max_inodes && quota_used[t].inodes >= quota_used[t].max_inodes) {
+        STAT_ERROR(ERR_QUOTA);
+        scratch_put(sb);
+        return -1;
+    }
+    quota_owner[inumber] = t+1;
+    quota_used[t].inodes++;
+    quota_used[t].blocks += size_charge(sb, node.flags, node.size);
+    quota_used[t].bytes += node.size;
+    scratch_put(sb);
+    return 0;
+}
+
+int set_quota_inode(int inumber, uint32_t max_blocks, uint32_t max_inodes) {
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    if(mounted_snap >= 0) {
+        printf("ERR: Snapshot is mounted read-only.\n");
+        return -1;
+    }
+    super_block* sb = (super_block*) scratch_get();
+    inode64 node;
+    if(!sb || read_super(sb) < 0 || inumber <= 0 || inumber >= sb->inodes || load_inode(sb, inumber, &node) < 0)
+        goto err;
+    if(!node.valid || !(node.flags & INODE_DIRECTORY) || quota_load(sb) < 0)
+        goto err;
+    int t = tenant_of(sb, inumber);
+    if(t >= 0 && sb->quotas[t].root != inumber) {
+        printf("Directory is inside another quota directory.\n");
+        goto err;
+    }
+    if(t < 0) {
+        for(t=0; t<MAX_QUOTAS && sb->quotas[t].root; t++);
+        if(t == MAX_QUOTAS) {
+            printf("Quota table is full.\n");
+            goto err;
+        }
+        if(quota_alloc_owner(sb) < 0 || quota_adopt_tree(sb, inumber, t) < 0)
+            goto err;
+        sb->quotas[t].root = inumber;
+    }
+    sb->quotas[t].max_blocks = max_blocks;
+    sb->quotas[t].max_inodes = max_inodes;
+    quota_used[t].max_blocks = max_blocks;
+    quota_used[t].max_inodes = max_inodes;
+    if(write_super(sb) < 0)
+        goto err;
+    scratch_put(sb);
+    return 0;
+    err:
+        scratch_put(sb);
+        return -1;
+}
+
+int get_quota_inode(int inumber, quota_usage* usage) {
+    SFS_LOCKED;
+    if(!mountptr) {
+        printf("ERR: Disk not mounted.\n");
+        return -1;
+    }
+    super_block* sb = (super_block*) scratch_get();
+    if(!sb || read_super(sb) < 0 || quota_load(sb) < 0) {
+        scratch_put(sb);
+        return -1;
+    }
+    int t = tenant_of(sb, inumber);
+    scratch_put(sb);
+    if(t < 0) {
+        return -1;
+    }
+    *usage = quota_used[t];
+    return 0;
+}
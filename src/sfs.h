@@ -1,17 +1,128 @@
 #include<stdint.h>
+#include<stddef.h>
 
 #define MAX_LEN 256
+#define MAX_PATH_LEN 4096 // bytes in a path, including the terminating zero
+#define MAXSNAPSHOTS 16
+#define MAX_INODE_SIZE 1024
+#define UNINIT_GROUPS 16384 // groups of metadata blocks that can be left for lazy zeroing
+#define MAX_ORPHANS 128 // removed inodes queued for the background reclaimer
+#define MAX_QUOTAS 16 // directories with their own space accounting
+#define MIN_BLOCK_SIZE 4096 // file system block sizes selectable at format time, each a run of disk blocks
+#define MAX_BLOCK_SIZE 65536
+
+// on-disk formats
+#define SFS_FORMAT_32 0 // 32 bit file sizes and block pointers, the layout of every older image
+#define SFS_FORMAT_64 1 // 64 bit file sizes and block pointers, and a double indirect block
+
+// inode flags
+#define INODE_COMPRESSED 1 // data is stored in compressed clusters of CLUSTER_BLOCKS blocks
+#define INODE_INLINE 2 // data is stored in the inode itself, from direct[] to the end of the inode
+#define INODE_DIRECTORY 4 // the file holds dir_items
+#define INODE_ORPHAN 8 // removed, waiting in the super block for its blocks to be reclaimed
+#define CLUSTER_BLOCKS 4
 
 const static uint32_t MAGIC = 12345;
 
+// what a block holds, metadata classes are always verified against their checksum
+#define BLK_BITMAP 0
+#define BLK_REFCOUNT 1
+#define BLK_INODE 2
+#define BLK_INDIRECT 3
+#define BLK_DIRECTORY 4
+#define BLK_SNAPSHOT 5
+#define BLK_DATA 6
+#define BLK_SUPER 7
+#define BLK_CSUM 8
+#define BLK_CLASSES 9
+
 
 typedef struct inode {
-	uint32_t valid; // 0 if invalid
+	uint8_t valid; // 0 if invalid
+	uint8_t flags; // INODE_* flags
+	uint16_t link_count; // directory entries naming the inode
 	uint32_t size; // logical size of the file
 	uint32_t direct[5]; // direct data block pointer
 	uint32_t indirect; // indirect pointer
 } inode;
 
+// inode of SFS_FORMAT_64; valid, flags and link_count are where they are in inode
+typedef struct inode64 {
+	uint8_t valid; // 0 if invalid
+	uint8_t flags; // INODE_* flags
+	uint16_t link_count; // directory entries naming the inode
+	uint32_t reserved;
+	uint64_t size; // logical size of the file
+	uint64_t direct[5]; // direct data block pointer
+	uint64_t indirect; // indirect pointer
+	uint64_t double_indirect; // pointer to a block of indirect pointers
+} inode64;
+
+
+#define MAXBLOCKS 1029 // blocks a file can map at the default 4 KB block size
+#define WIDE_FORMAT(sb) ((sb)->format == SFS_FORMAT_64)
+// block pointers per indirect block
+#define MAP_ENTRIES(sb) (FS_BLOCK_SIZE(sb)/(WIDE_FORMAT(sb) ? 8 : 4))
+#define MAX_FILE_BLOCKS(sb) (5 + (uint64_t) MAP_ENTRIES(sb) + (WIDE_FORMAT(sb) ? (uint64_t) MAP_ENTRIES(sb)*MAP_ENTRIES(sb) : 0))
+// block map slots of a compressed cluster beyond the blocks holding the stream
+#define NO_BLOCK UINT32_MAX
+
+// file systems formatted before inode_size was recorded use plain 32 byte inodes
+#define INODE_SIZE(sb) ((sb)->inode_size ? (sb)->inode_size : sizeof(inode))
+// smallest inode of the format, larger ones start out holding their data inline
+#define MIN_INODE_SIZE(sb) (WIDE_FORMAT(sb) ? 128 : sizeof(inode))
+#define FILE_SIZE(sb, node) (WIDE_FORMAT(sb) ? ((inode64*) (node))->size : (node)->size)
+#define FS_BLOCK_SIZE(sb) ((sb)->block_size ? (sb)->block_size : (uint32_t) BLOCKSIZE)
+#define INODES_PER_BLOCK(sb) (FS_BLOCK_SIZE(sb)/INODE_SIZE(sb))
+#define INODE_AT(sb, buffer, inumber) ((inode*) ((char*) (buffer) + ((inumber)%INODES_PER_BLOCK(sb))*INODE_SIZE(sb)))
+// inline files keep their data where the block map would be, up to the end of the inode
+#define INLINE_OFFSET(sb) (WIDE_FORMAT(sb) ? offsetof(inode64, direct) : offsetof(inode, direct))
+#define INLINE_DATA(sb, node) ((char*) (node) + INLINE_OFFSET(sb))
+#define INLINE_CAPACITY(sb) ((int) (INODE_SIZE(sb) - INLINE_OFFSET(sb)))
+// inodes written before link counts were kept have one name
+#define LINKS(node) ((node)->link_count ? (node)->link_count : 1)
+// a removed file waiting for the reclaimer is as gone as a free inode
+#define LIVE(node) ((node)->valid && !((node)->flags & INODE_ORPHAN))
+
+
+typedef struct snapshot {
+	uint32_t valid; // 0 if the slot is free
+	uint32_t id; // snapshot id, increasing with creation time
+	uint32_t map_idx; // data block holding pointers to the preserved inode block map
+	uint32_t reserved;
+} snapshot;
+
+
+typedef struct dir_item {
+    uint8_t valid;
+    uint8_t is_dir;
+    char filename[MAX_LEN];
+    uint8_t filename_len;
+    uint32_t inumber;    
+} dir_item;
+
+
+// A rename is logged in the super block before any directory is touched and replayed by
+// mount, so a crash part way through still ends with exactly one of the two entries.
+typedef struct rename_intent {
+	uint32_t valid;	// non-zero while a rename is in progress
+	uint32_t src_dir;	// directory inode and offset of the entry being moved
+	uint32_t src_offset;
+	uint32_t dst_dir;	// directory inode and offset the entry is written to
+	uint32_t dst_offset;
+	int32_t replaced;	// inode of the target entry being replaced, -1 if none
+	uint32_t replaced_links;	// link count of replaced before the rename dropped its entry
+	dir_item item;	// the entry as it is written at the destination
+} rename_intent;
+
+
+// a directory whose subtree is accounted on its own, 0 limits are not enforced
+typedef struct dir_quota {
+	uint32_t root;	// directory inode, 0 if the slot is free
+	uint32_t max_blocks;	// data blocks the files below root may map
+	uint32_t max_inodes;	// inodes below root, root included
+} dir_quota;
+
 
 typedef struct super_block {
 	uint32_t magic_number;	// File system magic number
@@ -25,22 +136,110 @@ typedef struct super_block {
 	uint32_t data_block_bitmap_idx;	// Block number of the first data bitmap block
 	uint32_t data_block_idx;	// Block number of the first data block
 	uint32_t data_blocks;  // Number of blocks reserved as data blocks
+
+	uint32_t refcount_block_idx;	// Block number of the first data block refcount block
+	uint32_t cow_active;	// Non-zero once any data block may carry more than one reference
+	uint32_t snap_next_id;	// Id given to the next snapshot
+	snapshot snaps[MAXSNAPSHOTS];	// Snapshot table
+	uint32_t inode_size;	// Bytes per on-disk inode, a power of two from 32 to MAX_INODE_SIZE
+	uint32_t csum_block_idx;	// Block number of the first block checksum block
+	uint32_t csum_blocks;	// Number of block checksum blocks, 0 if checksums are disabled
+	uint32_t uninit_group_blocks;	// Metadata blocks per lazily zeroed group, 0 if all were zeroed by format
+	uint32_t uninit[UNINIT_GROUPS/32];	// Bit map of metadata groups that have not been zeroed yet
+	rename_intent rename_log;	// Rename to finish at mount
+	uint32_t orphan_count;	// Inodes in orphans still to be reclaimed
+	uint32_t orphans[MAX_ORPHANS];	// Removed inodes whose blocks are freed in the background
+	dir_quota quotas[MAX_QUOTAS];	// Directories with quotas
+	uint32_t block_size;	// Bytes per file system block, BLOCKSIZE times a power of two; 0 means BLOCKSIZE
+	uint32_t format;	// SFS_FORMAT_*, 0 in images written before there was a choice
 } super_block;
 
-typedef struct dir_item {
-    uint8_t valid;
+typedef struct format_opts {
+	uint32_t inode_size; // 0 for the default 32 byte inode, larger inodes keep small files inline
+	uint32_t checksums; // non-zero to keep a CRC32C of every block and verify metadata on read
+	uint32_t block_size; // 0 for BLOCKSIZE, otherwise a power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE
+	uint32_t format; // SFS_FORMAT_32 by default, SFS_FORMAT_64 for files and volumes past 4 GB
+} format_opts;
+
+typedef struct csum_stats {
+	uint64_t computed; // checksums computed for written blocks
+	uint64_t verified; // blocks checked on read
+	uint64_t corrupted; // blocks that failed the check
+	uint64_t csum_ns; // time spent computing checksums
+} csum_stats;
+
+typedef struct dedup_stats {
+	uint64_t lookups; // data blocks hashed on the write path
+	uint64_t hits; // blocks shared with an existing block instead of being written
+	uint64_t write_ns; // time spent hashing, looking up and verifying
+	uint64_t index_entries; // fingerprints held in the index
+	uint64_t index_bytes; // memory used by the index
+} dedup_stats;
+
+typedef struct quota_usage {
+	uint64_t blocks; // data blocks mapped by the files of the directory, indirect blocks included
+	uint64_t bytes; // sum of the file sizes
+	uint64_t inodes; // files and directories, the quota directory included
+	uint32_t max_blocks; // limits, 0 if not enforced
+	uint32_t max_inodes;
+} quota_usage;
+
+// public calls counted by sfs_get_stats; calls made by other calls are counted too
+enum sfs_op {
+	OP_FORMAT, OP_MOUNT, OP_CREATE_FILE, OP_REMOVE_FILE, OP_STAT, OP_READ_I, OP_WRITE_I,
+	OP_FIT_TO_SIZE, OP_LINK_INODE, OP_UNLINK_INODE, OP_REMOVE_INODES, OP_CLONE_FILE,
+	OP_GET_FILESIZE, OP_CREATE_SNAPSHOT, OP_DELETE_SNAPSHOT, OP_MOUNT_SNAPSHOT,
+	OP_RENAME_ENTRY, OP_RECLAIM_ORPHANS, OP_READ_FILE, OP_WRITE_FILE, OP_CREATE_DIR,
+	OP_REMOVE_DIR, OP_CREATE_FILE_BY_PATH, OP_REMOVE_FILE_BY_PATH, OP_RENAME_PATH,
+	OP_LINK_PATH, OP_FIND_DIR, OP_OPEN_DIR, OP_READDIR_BATCH, SFS_OPS
+};
+
+// failures counted instead of printed from deep inside the file system
+enum sfs_error {
+	ERR_NO_SPACE, // no free data block
+	ERR_NO_INODES, // no free inode
+	ERR_CHECKSUM, // a block failed its checksum
+	ERR_CORRUPT, // a compressed cluster did not decompress
+	ERR_QUOTA, // a write or a new inode would have gone over a quota
+	SFS_ERRORS
+};
+
+#define STAT_BUCKETS 32 // bucket i of a latency histogram counts calls of [2^i, 2^(i+1)) ns
+
+typedef struct op_stats {
+	uint64_t calls;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t hist[STAT_BUCKETS];
+} op_stats;
+
+typedef struct sfs_stats {
+	uint64_t disk_reads; // all block reads and writes of the mounted disk
+	uint64_t disk_writes;
+	uint64_t class_reads[BLK_CLASSES]; // block traffic of the file system by BLK_* class
+	uint64_t class_writes[BLK_CLASSES];
+	uint64_t errors[SFS_ERRORS];
+	op_stats ops[SFS_OPS];
+} sfs_stats;
+
+// what readdir_batch returns for each valid entry of a directory
+typedef struct dir_entry {
+    uint32_t inumber;
     uint8_t is_dir;
-    char filename[MAX_LEN];
-    uint8_t filename_len;
-    uint32_t inumber;    
-} dir_item;
+    uint8_t name_len;
+    char name[MAX_LEN];
+} dir_entry;
 
 int format(disk *diskptr);
 
+int format_ex(disk *diskptr, format_opts *opts);
+
 int mount(disk *diskptr);
 
 int create_file();
 
+int create_dir_file();
+
 int remove_file(int inumber);
 
 int stat(int inumber);
@@ -51,7 +250,77 @@ int write_i(int inumber, char *data, int length, int offset);
 
 int fit_to_size(int inumber, int size);
 
+// read_i, write_i, fit_to_size and get_filesize for files of any size; the int calls
+// fail on sizes and offsets they cannot represent
+int64_t read_i64(int inumber, char *data, uint64_t length, uint64_t offset);
+int64_t write_i64(int inumber, char *data, uint64_t length, uint64_t offset);
+int fit_to_size64(int inumber, uint64_t size);
+int64_t get_filesize64(int inumber);
+
+// add or drop a name of the inode, the file is removed with its last name; both return
+// the new link count
+int link_inode(int inumber);
+int unlink_inode(int inumber);
+int get_link_count(int inumber);
+// drops one link of each inode in the array, which gets sorted, removing whole trees at once
+int remove_inodes(int *inumbers, int count);
+
+// with async unlink on, removing a file's last name returns right away and a background
+// thread frees its blocks, inodes_per_pass at a time with a pause of pause_us in between
+int set_async_unlink(int enable);
+int set_reclaim_rate(int inodes_per_pass, int pause_us);
+// frees up to max queued orphans in the caller (all if max < 0), returns how many went
+int reclaim_orphans(int max);
+int pending_orphans();
+
+// Freed data blocks are discarded on the disk in batches at the end of each operation. With
+// async discard on, the reclaimer thread issues them instead. flush_discards issues the
+// queued ones now and returns how many there were.
+int set_async_discard(int enable);
+int flush_discards();
+
+// quotas on directory inodes; writes past max_blocks and new inodes past max_inodes fail
+int set_quota_inode(int inumber, uint32_t max_blocks, uint32_t max_inodes);
+int get_quota_inode(int inumber, quota_usage *usage);
+// quota of the directory tree inumber is in, -1 if none; quota_adopt charges a new inode
+// to the quota of its parent directory
+int quota_tenant(int inumber);
+int quota_adopt(int parent, int inumber);
+
+// new inode sharing the data blocks of src_inumber, copied on write
+int clone_file(int src_inumber);
+
+// store the (still empty) file in compressed clusters
+int set_compression(int inumber, int enable);
+
+// verify data blocks (not only metadata) against their checksums on read, off by default
+int set_verify_data(int enable);
+int get_csum_stats(csum_stats *stats);
+
+// inline deduplication of written data blocks, off by default
+int set_dedup(int enable);
+int get_dedup_stats(dedup_stats *stats);
+
 int get_filesize(int inumber);
+// bytes per file system block of the mounted disk
+uint32_t fs_block_size();
+
+// snapshot of the counters since the last reset, all zero except the disk totals when
+// built with -DSFS_NO_STATS
+int sfs_get_stats(sfs_stats *stats);
+void sfs_reset_stats();
+const char* sfs_op_name(int op);
+const char* sfs_class_name(int cls);
+const char* sfs_error_name(int error);
+
+// point-in-time snapshots of the whole filesystem, blocks are shared copy-on-write
+int create_snapshot();
+int list_snapshots(int *ids, int max);
+int delete_snapshot(int id);
+int mount_snapshot(disk *diskptr, int id);
+
+// moves a directory entry as logged in intent, replacing intent->replaced if it is not -1
+int rename_entry(rename_intent *intent);
 
 int read_file(char *filepath, char *data, int length, int offset);
 int write_file(char *filepath, char *data, int length, int offset);
@@ -60,5 +329,18 @@ int create_dir(char *dirpath);
 int remove_dir(char *dirpath);
 
 int init_dirsys(disk* diskptr);
+// inode of the directory at dirpath, -1 if there is none
+int find_dir(char* dirpath);
 int create_file_by_path(char* filepath);
-int remove_file_by_path(char* filepath);
\ No newline at end of file
+int rename_path(char *oldpath, char *newpath);
+int link_path(char *existing, char *newpath);
+int remove_file_by_path(char* filepath);
+// quotas on top level directories, a limit of 0 is not enforced
+int set_quota(char *dirpath, uint32_t max_blocks, uint32_t max_inodes);
+int get_quota_usage(char *dirpath, quota_usage *usage);
+
+// directory listing: open_dir returns a handle, readdir_batch fills up to max entries
+// and returns how many it filled (0 at the end of the directory)
+int open_dir(char *dirpath);
+int readdir_batch(int dirfd, dir_entry *entries, int max);
+int close_dir(int dirfd);
\ No newline at end of file
@@ -0,0 +1,702 @@
+#include "disk.h"
+#include "sfs.h"
+#include "crc32c.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Offline consistency checker for SFS images written with save_disk().
+//
+// The inode table, including the inode blocks preserved by snapshots, is scanned in
+// parallel and every reference to a data block is counted in a shared array. Those
+// counts are what the data bitmap and the refcount region should say, so both are then
+// diffed against them, again in parallel. The checker works on the loaded image in place
+// instead of going through read_block(), which keeps the scan at memory speed.
+
+// exit codes, as for e2fsck
+#define FSCK_OK 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+#define MAX_THREADS 64
+#define CHUNK 16 // items handed to a worker at a time
+#define REPORT_LIMIT 10 // problems of one kind that are printed, the rest are only counted
+
+// a file system block is a run of fs_block/BLOCKSIZE disk blocks, contiguous in a loaded image
+#define BLOCK(n) ((void*) diskptr->block_arr[(size_t) (n)*(fs_block/BLOCKSIZE)])
+#define DATA(d) BLOCK(sb->data_block_idx + (d))
+#define TestBit(A,k)    ( A[(k/32)] & (1 << (k%32)) )
+
+enum {
+    P_BAD_POINTER, // block pointer outside the data region
+    P_BAD_SIZE, // size larger than the block map can hold
+    P_FREE_IN_USE, // referenced block marked free
+    P_LEAKED, // block marked used that nothing refers to
+    P_DUPLICATE, // block claimed more often than its refcount allows
+    P_REFCOUNT_HIGH, // refcount larger than the number of references
+    P_INODE_BITMAP, // inode bitmap disagrees with the inode table
+    P_DANGLING_ENTRY, // directory entry naming a free inode
+    P_WRONG_TYPE, // directory entry type disagrees with the inode
+    P_UNREACHABLE, // inode no directory refers to
+    P_LINK_COUNT, // link count disagrees with the directory entries
+    P_CHECKSUM, // block contents do not match the stored checksum
+    P_KINDS
+};
+
+static const char* problem_names[P_KINDS] = {
+    "bad block pointers", "bad file sizes", "referenced blocks marked free", "leaked blocks",
+    "duplicate claims", "refcounts too high", "inode bitmap mismatches", "dangling directory entries",
+    "directory entry type mismatches", "unreachable inodes", "wrong link counts", "checksum mismatches"
+};
+
+static disk* diskptr;
+static super_block* sb;
+static uint32_t fs_block = BLOCKSIZE;
+static int repair = 0;
+static int nthreads = 1;
+static uint64_t problems[P_KINDS];
+static uint64_t unfixed = 0; // problems left in the image
+static uint32_t* refs; // references found to each data block
+static uint32_t* links; // directory entries found for each inode
+static uint8_t* reached; // inodes found walking the tree from the root
+static uint8_t* dirty; // disk blocks changed by repairs
+
+// scan jobs: the live inode blocks, followed by the copies preserved for snapshots
+typedef struct scan_job {
+    uint32_t blocknr; // disk block holding the inodes
+    uint32_t iblock; // inode block it is (a copy of)
+    uint32_t live;
+} scan_job;
+
+static scan_job* jobs;
+static uint32_t njobs;
+
+static void report(int kind, int fixable, const char* fmt, ...) {
+    uint64_t seen = __atomic_fetch_add(problems+kind, 1, __ATOMIC_RELAXED);
+    if(!repair || !fixable)
+        __atomic_fetch_add(&unfixed, 1, __ATOMIC_RELAXED);
+    if(seen < REPORT_LIMIT) {
+        va_list args;
+        va_start(args, fmt);
+        vprintf(fmt, args);
+        va_end(args);
+    }
+}
+
+typedef struct work {
+    uint32_t items;
+    uint32_t next; // first item not handed out yet
+    void (*fn)(uint32_t item);
+} work;
+
+static void* worker(void* arg) {
+    work* w = (work*) arg;
+    while(1) {
+        uint32_t start = __atomic_fetch_add(&w->next, CHUNK, __ATOMIC_RELAXED);
+        if(start >= w->items)
+            break;
+        uint32_t end = (start + CHUNK < w->items) ? start + CHUNK : w->items;
+        for(uint32_t i=start; i<end; i++)
+            w->fn(i);
+    }
+    return NULL;
+}
+
+// runs fn on every item in [0, items) spread over the worker threads
+static void parallel_for(uint32_t items, void (*fn)(uint32_t item)) {
+    work w = {items, 0, fn};
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+    for(int i=1; i<nthreads; i++) {
+        if(pthread_create(threads+started, NULL, worker, &w) == 0)
+            started++;
+    }
+    worker(&w);
+    for(int i=0; i<started; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static uint32_t claim(uint32_t dnumber) {
+    return __atomic_fetch_add(refs+dnumber, 1, __ATOMIC_RELAXED);
+}
+
+static uint32_t* refcount_of(uint32_t dnumber) {
+    return (uint32_t*) BLOCK(sb->refcount_block_idx + dnumber/(fs_block/4)) + dnumber%(fs_block/4);
+}
+
+// Slots 0-4 are the direct pointers of an inode, 5 the indirect and 6 the double indirect
+// pointer. Pointers and map entries are 64 bit wide in SFS_FORMAT_64.
+static uint64_t pointer(inode* node, int slot) {
+    inode64* wide = (inode64*) node;
+    if(!WIDE_FORMAT(sb))
+        return (slot < 5) ? node->direct[slot] : (slot == 5) ? node->indirect : NO_BLOCK;
+    return (slot < 5) ? wide->direct[slot] : (slot == 5) ? wide->indirect : wide->double_indirect;
+}
+
+static uint64_t entry(uint64_t dnumber, uint32_t i) {
+    return WIDE_FORMAT(sb) ? ((uint64_t*) DATA(dnumber))[i] : ((uint32_t*) DATA(dnumber))[i];
+}
+
+static void set_size(inode* node, uint64_t size) {
+    if(WIDE_FORMAT(sb))
+        ((inode64*) node)->size = size;
+    else
+        node->size = size;
+}
+
+// blocks of [first, first+count) below blocks
+static uint32_t span(uint32_t blocks, uint32_t first, uint32_t count) {
+    if(blocks <= first)
+        return 0;
+    return blocks-first < count ? blocks-first : count;
+}
+
+// Data block of block blocknum of the file, whose map up to there is valid. The indirect
+// blocks on the way are stored in path, NO_BLOCK where there is none.
+static uint64_t block_of(inode* node, uint32_t blocknum, uint64_t path[2]) {
+    uint32_t per = MAP_ENTRIES(sb);
+    path[0] = path[1] = NO_BLOCK;
+    if(blocknum < 5)
+        return pointer(node, blocknum);
+    if(blocknum-5 < per) {
+        path[0] = pointer(node, 5);
+        return entry(path[0], blocknum-5);
+    }
+    blocknum -= 5+per;
+    path[0] = pointer(node, 6);
+    path[1] = entry(path[0], blocknum/per);
+    return entry(path[1], blocknum%per);
+}
+
+// Number of leading blocks of the file whose pointers are all valid.
+static uint32_t valid_blocks(inode* node, uint32_t n_blocks) {
+    int compressed = node->flags & INODE_COMPRESSED;
+    uint32_t per = MAP_ENTRIES(sb);
+    for(uint32_t i=0; i<n_blocks; i++) {
+        // the indirect blocks are checked before the first block that goes through them
+        if(i == 5 && pointer(node, 5) >= sb->data_blocks)
+            return i;
+        if(i == 5+per && pointer(node, 6) >= sb->data_blocks)
+            return i;
+        if(i >= 5+per && (i-5-per)%per == 0 && entry(pointer(node, 6), (i-5-per)/per) >= sb->data_blocks)
+            return i;
+        uint64_t path[2];
+        uint64_t dnumber = block_of(node, i, path);
+        if(dnumber >= sb->data_blocks && !(compressed && dnumber == NO_BLOCK))
+            return i;
+    }
+    return n_blocks;
+}
+
+// Copies len bytes at offset of the file in inode block blocknr to or from buf. Writes are
+// refused for blocks that are shared, since other files or snapshots see the same contents.
+static int file_bytes(inode* node, uint32_t blocknr, uint64_t offset, char* buf, uint32_t len, int write) {
+    if(node->flags & INODE_INLINE) {
+        if(write) {
+            memcpy(INLINE_DATA(sb, node) + offset, buf, len);
+            dirty[blocknr] = 1;
+        } else {
+            memcpy(buf, INLINE_DATA(sb, node) + offset, len);
+        }
+        return 0;
+    }
+    while(len > 0) {
+        uint64_t path[2];
+        uint64_t dnumber = block_of(node, offset/fs_block, path);
+        uint32_t start = offset%fs_block;
+        uint32_t count = (fs_block-start < len) ? fs_block-start : len;
+        if(write) {
+            if(*refcount_of(dnumber) || (path[0] != NO_BLOCK && *refcount_of(path[0])) || (path[1] != NO_BLOCK && *refcount_of(path[1])))
+                return -1;
+            memcpy((char*) DATA(dnumber) + start, buf, count);
+            dirty[sb->data_block_idx + dnumber] = 1;
+        } else {
+            memcpy(buf, (char*) DATA(dnumber) + start, count);
+        }
+        offset += count;
+        buf += count;
+        len -= count;
+    }
+    return 0;
+}
+
+static void scan_dir(inode* node, uint32_t blocknr, int inumber, uint64_t limit) {
+    if(node->flags & INODE_COMPRESSED) {
+        printf("Directory inode %d is compressed, entries not checked.\n", inumber);
+        return;
+    }
+    dir_item entry;
+    for(uint64_t offset=0; offset+sizeof(dir_item)<=limit; offset+=sizeof(dir_item)) {
+        file_bytes(node, blocknr, offset, (char*) &entry, sizeof(dir_item), 0);
+        if(!entry.valid)
+            continue;
+        entry.filename[MAX_LEN-1] = '\0';
+        inode* target = NULL;
+        if(entry.inumber < sb->inodes) {
+            void* iblock = BLOCK(sb->inode_block_idx + entry.inumber/INODES_PER_BLOCK(sb));
+            target = INODE_AT(sb, iblock, entry.inumber);
+        }
+        if(!target || !target->valid) {
+            entry.valid = 0;
+            int fixed = repair && file_bytes(node, blocknr, offset, (char*) &entry, sizeof(dir_item), 1) == 0;
+            report(P_DANGLING_ENTRY, fixed, "Directory inode %d: entry \"%s\" refers to free inode %u%s.\n", inumber, entry.filename, entry.inumber, fixed ? ", removed" : "");
+            continue;
+        }
+        __atomic_fetch_add(links+entry.inumber, 1, __ATOMIC_RELAXED);
+        int is_dir = (target->flags & INODE_DIRECTORY) ? 1 : 0;
+        if(entry.is_dir != is_dir) {
+            entry.is_dir = is_dir;
+            int fixed = repair && file_bytes(node, blocknr, offset, (char*) &entry, sizeof(dir_item), 1) == 0;
+            report(P_WRONG_TYPE, fixed, "Directory inode %d: entry \"%s\" has the wrong type%s.\n", inumber, entry.filename, fixed ? ", fixed" : "");
+        }
+    }
+}
+
+static void scan_inode(scan_job* job, inode* node, int inumber) {
+    const char* where = job->live ? "" : " (snapshot copy)";
+    int fixable = job->live;
+    uint64_t size = FILE_SIZE(sb, node);
+    if(node->flags & INODE_INLINE) {
+        if(size > (uint64_t) INLINE_CAPACITY(sb)) {
+            report(P_BAD_SIZE, fixable, "Inode %d%s: inline size %lu larger than the inode.\n", inumber, where, (unsigned long) size);
+            size = INLINE_CAPACITY(sb);
+            if(repair && fixable) {
+                set_size(node, size);
+                dirty[job->blocknr] = 1;
+            }
+        }
+        if(job->live && (node->flags & INODE_DIRECTORY))
+            scan_dir(node, job->blocknr, inumber, size);
+        return;
+    }
+    uint64_t n_blocks = (size + fs_block-1)/fs_block;
+    if(n_blocks > MAX_FILE_BLOCKS(sb)) {
+        report(P_BAD_SIZE, fixable, "Inode %d%s: size %lu larger than the block map.\n", inumber, where, (unsigned long) size);
+        n_blocks = MAX_FILE_BLOCKS(sb);
+        if(repair && fixable) {
+            set_size(node, MAX_FILE_BLOCKS(sb)*fs_block);
+            dirty[job->blocknr] = 1;
+        }
+    }
+    uint32_t keep = valid_blocks(node, n_blocks);
+    if(keep < n_blocks) {
+        // compressed files can only be cut at a cluster boundary
+        if(node->flags & INODE_COMPRESSED)
+            keep -= keep%CLUSTER_BLOCKS;
+        report(P_BAD_POINTER, fixable, "Inode %d%s: bad block pointer at block %u%s.\n", inumber, where, keep, (repair && fixable) ? ", truncated" : "");
+        if(repair && fixable) {
+            set_size(node, (uint64_t) keep*fs_block);
+            dirty[job->blocknr] = 1;
+        }
+    }
+    for(uint32_t i=0; i<keep && i<5; i++) {
+        if(pointer(node, i) != NO_BLOCK)
+            claim(pointer(node, i));
+    }
+    // the references held by an indirect block are counted once, by whoever finds it first
+    uint32_t per = MAP_ENTRIES(sb);
+    uint32_t n = span(keep, 5, per);
+    if(n && claim(pointer(node, 5)) == 0) {
+        for(uint32_t i=0; i<n; i++) {
+            if(entry(pointer(node, 5), i) != NO_BLOCK)
+                claim(entry(pointer(node, 5), i));
+        }
+    }
+    // the double indirect block holds the references of its leaves, each leaf those of its blocks
+    n = span(keep, 5+per, per*per);
+    if(n && claim(pointer(node, 6)) == 0) {
+        for(uint32_t j=0; j*per<n; j++) {
+            uint64_t leaf = entry(pointer(node, 6), j);
+            if(claim(leaf) != 0)
+                continue;
+            for(uint32_t i=0; i<span(n, j*per, per); i++) {
+                if(entry(leaf, i) != NO_BLOCK)
+                    claim(entry(leaf, i));
+            }
+        }
+    }
+    if(job->live && (node->flags & INODE_DIRECTORY))
+        scan_dir(node, job->blocknr, inumber, (size < (uint64_t) keep*fs_block) ? size : (uint64_t) keep*fs_block);
+}
+
+static void scan_job_fn(uint32_t item) {
+    scan_job* job = jobs+item;
+    void* buffer = BLOCK(job->blocknr);
+    for(uint32_t i=0; i<INODES_PER_BLOCK(sb); i++) {
+        int inumber = job->iblock*INODES_PER_BLOCK(sb) + i;
+        inode* node = INODE_AT(sb, buffer, inumber);
+        if(node->valid)
+            scan_inode(job, node, inumber);
+    }
+}
+
+// Claims the blocks of every snapshot map and queues the inode block copies they hold.
+// The maps are small, so this runs before the parallel scan.
+static int scan_snapshots() {
+    uint32_t map_blocks = (sb->inode_blocks + fs_block/4-1)/(fs_block/4);
+    for(int s=0; s<MAXSNAPSHOTS; s++) {
+        snapshot* snap = sb->snaps+s;
+        if(!snap->valid)
+            continue;
+        if(snap->map_idx >= sb->data_blocks) {
+            printf("Snapshot %u: bad map block %u.\n", snap->id, snap->map_idx);
+            return -1;
+        }
+        claim(snap->map_idx);
+        uint32_t* index = (uint32_t*) DATA(snap->map_idx);
+        for(uint32_t i=0; i<map_blocks; i++) {
+            if(!index[i])
+                continue;
+            if(index[i]-1 >= sb->data_blocks) {
+                printf("Snapshot %u: bad map block %u.\n", snap->id, index[i]-1);
+                return -1;
+            }
+            claim(index[i]-1);
+            uint32_t* map = (uint32_t*) DATA(index[i]-1);
+            for(uint32_t j=0; j<fs_block/4 && i*(fs_block/4)+j<sb->inode_blocks; j++) {
+                if(!map[j])
+                    continue;
+                if(map[j]-1 >= sb->data_blocks) {
+                    printf("Snapshot %u: bad inode block copy %u.\n", snap->id, map[j]-1);
+                    return -1;
+                }
+                // a copy is shared by all the snapshots taken before it was made
+                if(claim(map[j]-1) == 0) {
+                    jobs[njobs].blocknr = sb->data_block_idx + map[j]-1;
+                    jobs[njobs].iblock = i*(fs_block/4)+j;
+                    jobs[njobs].live = 0;
+                    njobs++;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static void check_data_bitmap(uint32_t item) {
+    uint32_t* bitmap = (uint32_t*) BLOCK(sb->data_block_bitmap_idx + item);
+    uint32_t first = item*8*fs_block;
+    for(uint32_t k=0; k<8*fs_block; k++) {
+        uint32_t dnumber = first+k;
+        int used = TestBit(bitmap, k) ? 1 : 0;
+        if(dnumber >= sb->data_blocks) {
+            if(used) {
+                report(P_LEAKED, 1, "Data bitmap marks block %u past the end of the data region.\n", dnumber);
+                if(repair)
+                    bitmap[k/32] &= ~(1 << (k%32));
+            }
+            continue;
+        }
+        uint32_t found = refs[dnumber];
+        if(found && !used)
+            report(P_FREE_IN_USE, 1, "Block %u is in use but marked free.\n", dnumber);
+        if(!found && used)
+            report(P_LEAKED, 1, "Block %u is marked used but nothing refers to it.\n", dnumber);
+        uint32_t* count = refcount_of(dnumber);
+        uint32_t expected = found ? found-1 : 0;
+        if(expected > *count)
+            report(P_DUPLICATE, 1, "Block %u is claimed %u times, refcount allows %u.\n", dnumber, found, *count+1);
+        else if(expected < *count)
+            report(P_REFCOUNT_HIGH, 1, "Block %u has refcount %u but %u references.\n", dnumber, *count, found);
+        if(!repair)
+            continue;
+        // shared blocks are copied on write, so a duplicate claim is repaired by
+        // accounting for it in the refcount
+        if(found != 0 && !used)
+            bitmap[k/32] |= 1 << (k%32);
+        if(found == 0 && used)
+            bitmap[k/32] &= ~(1 << (k%32));
+        if(*count != expected) {
+            *count = expected;
+            dirty[sb->refcount_block_idx + dnumber/(fs_block/4)] = 1;
+        }
+    }
+    if(repair)
+        dirty[sb->data_block_bitmap_idx + item] = 1;
+}
+
+static void check_inode_bitmap(uint32_t item) {
+    uint32_t* bitmap = (uint32_t*) BLOCK(sb->inode_bitmap_block_idx + item);
+    for(uint32_t k=0; k<8*fs_block; k++) {
+        uint32_t inumber = item*8*fs_block+k;
+        if(inumber >= sb->inodes)
+            break;
+        void* iblock = BLOCK(sb->inode_block_idx + inumber/INODES_PER_BLOCK(sb));
+        int valid = INODE_AT(sb, iblock, inumber)->valid ? 1 : 0;
+        int used = TestBit(bitmap, k) ? 1 : 0;
+        if(valid == used)
+            continue;
+        report(P_INODE_BITMAP, 1, "Inode %u is %s but marked %s.\n", inumber, valid ? "valid" : "free", used ? "used" : "free");
+        if(repair) {
+            bitmap[k/32] ^= 1 << (k%32);
+            dirty[sb->inode_bitmap_block_idx + item] = 1;
+        }
+    }
+}
+
+// removed inodes still queued for the reclaimer have no name yet are in use
+static int is_orphan(inode* node, uint32_t inumber) {
+    if(!(node->flags & INODE_ORPHAN))
+        return 0;
+    for(uint32_t i=0; i<sb->orphan_count && i<MAX_ORPHANS; i++) {
+        if(sb->orphans[i] == inumber)
+            return 1;
+    }
+    return 0;
+}
+
+// Bytes of the directory in node that scan_inode checked entries in.
+static uint64_t dir_limit(inode* node) {
+    uint64_t size = FILE_SIZE(sb, node);
+    if(node->flags & INODE_INLINE)
+        return (size < (uint64_t) INLINE_CAPACITY(sb)) ? size : INLINE_CAPACITY(sb);
+    uint64_t n_blocks = (size + fs_block-1)/fs_block;
+    if(n_blocks > MAX_FILE_BLOCKS(sb))
+        n_blocks = MAX_FILE_BLOCKS(sb);
+    uint64_t keep = (uint64_t) valid_blocks(node, n_blocks)*fs_block;
+    return (size < keep) ? size : keep;
+}
+
+// Marks every inode that can be reached from the root directory. Entries found by the scan
+// only show that each inode has a parent, a cycle of directories cut off from the root has
+// those as well. Returns -1 if a directory on the way could not be read, or out of memory.
+static int walk_tree() {
+    uint32_t* stack = (uint32_t*) malloc(sb->inodes*sizeof(uint32_t));
+    if(!stack)
+        return -1;
+    int retval = 0;
+    uint32_t top = 0;
+    stack[top++] = 0;
+    reached[0] = 1;
+    while(top > 0) {
+        uint32_t inumber = stack[--top];
+        uint32_t blocknr = sb->inode_block_idx + inumber/INODES_PER_BLOCK(sb);
+        inode* node = INODE_AT(sb, BLOCK(blocknr), inumber);
+        if(!(node->flags & INODE_DIRECTORY))
+            continue;
+        if(node->flags & INODE_COMPRESSED) {
+            retval = -1;
+            continue;
+        }
+        uint64_t limit = dir_limit(node);
+        dir_item entry;
+        for(uint64_t offset=0; offset+sizeof(dir_item)<=limit; offset+=sizeof(dir_item)) {
+            file_bytes(node, blocknr, offset, (char*) &entry, sizeof(dir_item), 0);
+            if(!entry.valid || entry.inumber >= sb->inodes || reached[entry.inumber])
+                continue;
+            inode* target = INODE_AT(sb, BLOCK(sb->inode_block_idx + entry.inumber/INODES_PER_BLOCK(sb)), entry.inumber);
+            if(!target->valid)
+                continue;
+            reached[entry.inumber] = 1;
+            stack[top++] = entry.inumber;
+        }
+    }
+    free(stack);
+    return retval;
+}
+
+static void check_links(uint32_t item) {
+    void* buffer = BLOCK(sb->inode_block_idx + item);
+    for(uint32_t i=0; i<INODES_PER_BLOCK(sb); i++) {
+        uint32_t inumber = item*INODES_PER_BLOCK(sb) + i;
+        inode* node = INODE_AT(sb, buffer, inumber);
+        if(inumber == 0 || !node->valid)
+            continue;
+        if(!links[inumber] && is_orphan(node, inumber))
+            continue;
+        if(!links[inumber]) {
+            report(P_UNREACHABLE, 0, "Inode %u is not in any directory.\n", inumber);
+            continue;
+        }
+        if(reached && !reached[inumber])
+            report(P_UNREACHABLE, 0, "Inode %u is only in directories cut off from the root.\n", inumber);
+        if(links[inumber] != LINKS(node)) {
+            report(P_LINK_COUNT, 1, "Inode %u has link count %u but %u directory entries.\n", inumber, LINKS(node), links[inumber]);
+            if(repair) {
+                node->link_count = links[inumber];
+                dirty[sb->inode_block_idx + item] = 1;
+            }
+        }
+    }
+}
+
+// Blocks changed by repairs get a new checksum, every other block in use is verified.
+static void check_csum(uint32_t item) {
+    uint32_t blocknr = item+1; // the super block is not checksummed
+    if(blocknr >= sb->csum_block_idx && blocknr < sb->csum_block_idx + sb->csum_blocks)
+        return;
+    if(blocknr >= sb->data_block_idx && !refs[blocknr - sb->data_block_idx])
+        return;
+    uint32_t* entry = (uint32_t*) BLOCK(sb->csum_block_idx + blocknr/(fs_block/4)) + blocknr%(fs_block/4);
+    if(!*entry && !dirty[blocknr])
+        return;
+    uint32_t csum = crc32c(0, BLOCK(blocknr), fs_block);
+    if(!csum)
+        csum = 1;
+    if(dirty[blocknr])
+        *entry = csum;
+    else if(*entry != csum)
+        report(P_CHECKSUM, 0, "Block %u does not match its checksum.\n", blocknr);
+}
+
+static int check_super() {
+    if(sb->magic_number != MAGIC) {
+        printf("Bad magic number.\n");
+        return -1;
+    }
+    if(FS_BLOCK_SIZE(sb) < MIN_BLOCK_SIZE || FS_BLOCK_SIZE(sb) > MAX_BLOCK_SIZE || (FS_BLOCK_SIZE(sb) & (FS_BLOCK_SIZE(sb)-1))) {
+        printf("Bad block size %u.\n", FS_BLOCK_SIZE(sb));
+        return -1;
+    }
+    fs_block = FS_BLOCK_SIZE(sb);
+    if(sb->format > SFS_FORMAT_64) {
+        printf("Unknown format %u.\n", sb->format);
+        return -1;
+    }
+    uint32_t size = INODE_SIZE(sb);
+    if(size < MIN_INODE_SIZE(sb) || size > MAX_INODE_SIZE || (size & (size-1))) {
+        printf("Bad inode size %u.\n", size);
+        return -1;
+    }
+    if((uint64_t) (sb->blocks+1)*(fs_block/BLOCKSIZE) > diskptr->blocks || sb->inode_bitmap_block_idx != 1 || sb->data_block_bitmap_idx <= sb->inode_bitmap_block_idx || sb->refcount_block_idx <= sb->data_block_bitmap_idx
+        || sb->csum_block_idx < sb->refcount_block_idx || sb->csum_block_idx + sb->csum_blocks != sb->inode_block_idx
+        || sb->inode_block_idx + sb->inode_blocks != sb->data_block_idx || sb->data_block_idx + sb->data_blocks > sb->blocks+1
+        || sb->inodes != sb->inode_blocks*INODES_PER_BLOCK(sb)
+        || (uint64_t) (sb->refcount_block_idx - sb->data_block_bitmap_idx)*8*fs_block < sb->data_blocks
+        || (uint64_t) (sb->csum_block_idx - sb->refcount_block_idx)*(fs_block/4) < sb->data_blocks
+        || (uint64_t) sb->uninit_group_blocks*UNINIT_GROUPS < (sb->uninit_group_blocks ? sb->data_block_idx - sb->inode_bitmap_block_idx : 0)) {
+        printf("Bad layout in the super block.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Metadata groups that format left for lazy zeroing read as zeros, so zero them in the image.
+static void zero_uninit_groups() {
+    uint32_t metadata_blocks = sb->data_block_idx - sb->inode_bitmap_block_idx;
+    for(uint32_t group=0; sb->uninit_group_blocks && group*sb->uninit_group_blocks<metadata_blocks; group++) {
+        if(!TestBit(sb->uninit, group))
+            continue;
+        uint32_t first = sb->inode_bitmap_block_idx + group*sb->uninit_group_blocks;
+        for(uint32_t i=first; i<first+sb->uninit_group_blocks && i<sb->data_block_idx; i++)
+            memset(BLOCK(i), 0, fs_block);
+        sb->uninit[group/32] &= ~(1u << (group%32));
+    }
+}
+
+static double elapsed_ms(struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec-start->tv_sec)*1e3 + (end.tv_nsec-start->tv_nsec)/1e6;
+}
+
+int main(int argc, char** argv) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while((opt = getopt(argc, argv, "rj:")) != -1) {
+        if(opt == 'r') {
+            repair = 1;
+        } else if(opt == 'j') {
+            nthreads = atoi(optarg);
+        } else {
+            optind = argc+1;
+            break;
+        }
+    }
+    if(optind != argc-1) {
+        printf("usage: %s [-r] [-j threads] image\n", argv[0]);
+        return FSCK_ERROR;
+    }
+    if(nthreads < 1)
+        nthreads = 1;
+    if(nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+    diskptr = load_disk(argv[optind]);
+    if(!diskptr) {
+        printf("Cannot load image %s.\n", argv[optind]);
+        return FSCK_ERROR;
+    }
+    sb = (super_block*) BLOCK(0);
+    if(check_super() < 0) {
+        free_disk(diskptr);
+        return FSCK_ERROR;
+    }
+    refs = (uint32_t*) calloc(sb->data_blocks, sizeof(uint32_t));
+    links = (uint32_t*) calloc(sb->inodes, sizeof(uint32_t));
+    reached = (uint8_t*) calloc(sb->inodes, 1);
+    dirty = (uint8_t*) calloc(diskptr->blocks, 1);
+    jobs = (scan_job*) malloc((sb->inode_blocks + (uint64_t) MAXSNAPSHOTS*sb->inode_blocks)*sizeof(scan_job));
+    if(!refs || !links || !reached || !dirty || !jobs) {
+        printf("Out of memory.\n");
+        return FSCK_ERROR;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    zero_uninit_groups();
+    for(uint32_t i=0; i<sb->inode_blocks; i++) {
+        jobs[i].blocknr = sb->inode_block_idx + i;
+        jobs[i].iblock = i;
+        jobs[i].live = 1;
+    }
+    njobs = sb->inode_blocks;
+    if(scan_snapshots() < 0)
+        return FSCK_ERROR;
+    parallel_for(njobs, scan_job_fn);
+    parallel_for(sb->refcount_block_idx - sb->data_block_bitmap_idx, check_data_bitmap);
+    parallel_for(sb->data_block_bitmap_idx - sb->inode_bitmap_block_idx, check_inode_bitmap);
+    inode* root = INODE_AT(sb, BLOCK(sb->inode_block_idx), 0);
+    if(root->valid && (root->flags & INODE_DIRECTORY)) {
+        if(walk_tree() < 0) {
+            printf("Directory tree not walked, reachability not checked.\n");
+            free(reached);
+            reached = NULL;
+        }
+        parallel_for(sb->inode_blocks, check_links);
+    }
+    if(sb->csum_blocks)
+        parallel_for(sb->blocks, check_csum);
+    double ms = elapsed_ms(&start);
+
+    uint64_t total = 0;
+    uint32_t in_use = 0;
+    int shared = 0;
+    for(uint32_t i=0; i<sb->data_blocks; i++) {
+        in_use += refs[i] != 0;
+        shared |= refs[i] > 1;
+    }
+    if(shared && !sb->cow_active) {
+        printf("Shared blocks found but copy-on-write is not enabled.\n");
+        total++;
+        if(repair)
+            sb->cow_active = 1;
+        else
+            unfixed++;
+    }
+    for(int i=0; i<P_KINDS; i++) {
+        if(problems[i])
+            printf("%llu %s\n", (unsigned long long) problems[i], problem_names[i]);
+        total += problems[i];
+    }
+    printf("%s: %u inodes, %u of %u data blocks in use, checked in %.1f ms with %d threads\n", argv[optind], sb->inodes, in_use, sb->data_blocks, ms, nthreads);
+    int retval = FSCK_OK;
+    if(total && repair && total > unfixed) {
+        if(save_disk(diskptr, argv[optind]) < 0) {
+            printf("Cannot write image %s.\n", argv[optind]);
+            retval = FSCK_ERROR;
+        }
+    }
+    if(retval == FSCK_OK && total)
+        retval = unfixed ? FSCK_UNCORRECTED : FSCK_CORRECTED;
+    free(refs);
+    free(links);
+    free(reached);
+    free(dirty);
+    free(jobs);
+    free_disk(diskptr);
+    return retval;
+}
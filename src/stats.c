@@ -0,0 +1,82 @@
+#include "disk.h"
+#include "sfs.h"
+#include "stats.h"
+#include <string.h>
+#include <time.h>
+
+// Counters are bumped with relaxed atomics: the directory layer and the reclaimer call in
+// from more than one thread, and no counter has to agree with another one exactly.
+static sfs_stats stats;
+
+static const char* op_names[SFS_OPS] = {
+    "format", "mount", "create_file", "remove_file", "stat", "read_i", "write_i",
+    "fit_to_size", "link_inode", "unlink_inode", "remove_inodes", "clone_file",
+    "get_filesize", "create_snapshot", "delete_snapshot", "mount_snapshot",
+    "rename_entry", "reclaim_orphans", "read_file", "write_file", "create_dir",
+    "remove_dir", "create_file_by_path", "remove_file_by_path", "rename_path",
+    "link_path", "find_dir", "open_dir", "readdir_batch"
+};
+
+static const char* class_names[BLK_CLASSES] = {
+    "bitmap", "refcount", "inode", "indirect", "directory", "snapshot", "data", "super", "checksum"
+};
+
+static const char* error_names[SFS_ERRORS] = {
+    "no_space", "no_inodes", "checksum", "corrupt", "quota"
+};
+
+const char* sfs_op_name(int op) {
+    return op >= 0 && op < SFS_OPS ? op_names[op] : NULL;
+}
+
+const char* sfs_class_name(int cls) {
+    return cls >= 0 && cls < BLK_CLASSES ? class_names[cls] : NULL;
+}
+
+const char* sfs_error_name(int error) {
+    return error >= 0 && error < SFS_ERRORS ? error_names[error] : NULL;
+}
+
+#ifndef SFS_NO_STATS
+uint64_t stat_clock() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000ull + t.tv_nsec;
+}
+
+void stat_op_end(op_timer* timer) {
+    uint64_t ns = stat_clock() - timer->start;
+    op_stats* op = stats.ops + timer->op;
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if(bucket >= STAT_BUCKETS)
+        bucket = STAT_BUCKETS-1;
+    __atomic_fetch_add(&op->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&op->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(op->hist+bucket, 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&op->max_ns, __ATOMIC_RELAXED);
+    while(ns > max && !__atomic_compare_exchange_n(&op->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void stat_io(int cls, int write) {
+    __atomic_fetch_add((write ? stats.class_writes : stats.class_reads) + cls, 1, __ATOMIC_RELAXED);
+}
+
+void stat_error(int error) {
+    __atomic_fetch_add(stats.errors + error, 1, __ATOMIC_RELAXED);
+}
+#endif
+
+// Copies the counters word by word; a snapshot taken while calls are running may mix
+// counts from just before and just after some of them.
+void stat_snapshot(sfs_stats* out) {
+    uint64_t* src = (uint64_t*) &stats;
+    uint64_t* dst = (uint64_t*) out;
+    for(size_t i=0; i<sizeof(sfs_stats)/sizeof(uint64_t); i++)
+        dst[i] = __atomic_load_n(src+i, __ATOMIC_RELAXED);
+}
+
+void sfs_reset_stats() {
+    uint64_t* words = (uint64_t*) &stats;
+    for(size_t i=0; i<sizeof(sfs_stats)/sizeof(uint64_t); i++)
+        __atomic_store_n(words+i, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,27 @@
+#include <stdint.h>
+
+// Counters behind sfs_get_stats. STAT_OP times the rest of the enclosing function as one
+// call of op. Building with -DSFS_NO_STATS compiles all of it out.
+#ifndef SFS_NO_STATS
+typedef struct op_timer {
+    int op;
+    uint64_t start;
+} op_timer;
+
+uint64_t stat_clock();
+void stat_op_end(op_timer* timer);
+void stat_io(int cls, int write);
+void stat_error(int error);
+
+#define STAT_OP(op) op_timer stat_timer __attribute__((cleanup(stat_op_end))) = {op, stat_clock()}
+#define STAT_IO(cls, write) stat_io(cls, write)
+#define STAT_ERROR(error) stat_error(error)
+#else
+#define STAT_OP(op)
+#define STAT_IO(cls, write) ((void) 0)
+#define STAT_ERROR(error) ((void) 0)
+#endif
+
+// copies the counters into out, sfs_get_stats adds the disk totals
+struct sfs_stats;
+void stat_snapshot(struct sfs_stats* out);
@@ -0,0 +1,216 @@
+#include "disk.h"
+#include "sfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+// Regression checks for cases that once broke the file system. Each check runs against a
+// fresh file system, prints what failed and the program exits with the number of failures.
+
+#define DISK_SIZE (64<<20)
+#define CYCLE_IMAGE "/tmp/sfs_tests_cycle.img"
+#define FILE_DISK "/tmp/sfs_tests_disk.img"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+        printf("%s:%d: %s failed\n", __func__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while(0)
+
+static disk* fresh_disk() {
+    disk* diskptr = create_disk(DISK_SIZE);
+    if(!diskptr || format(diskptr) < 0 || mount(diskptr) < 0 || init_dirsys(diskptr) < 0) {
+        printf("Cannot set up a file system.\n");
+        exit(1);
+    }
+    return diskptr;
+}
+
+// a directory moved below itself would be cut off from the root together with its subtree
+static void rename_into_itself() {
+    disk* diskptr = fresh_disk();
+    CHECK(create_dir("a") == 0 && create_dir("a/b") == 0);
+    CHECK(rename_path("a", "a/x") < 0);
+    CHECK(rename_path("a/", "a/x") < 0);
+    CHECK(rename_path("a", "./a/x") < 0);
+    CHECK(rename_path("/a", "a/b/x") < 0);
+    CHECK(rename_path("a", "a/./x") < 0);
+    CHECK(find_dir("a") >= 0 && find_dir("a/b") >= 0);
+    // a name that only starts like the directory is not below it
+    CHECK(create_dir("ab") == 0);
+    CHECK(rename_path("a", "ab/a") == 0);
+    CHECK(find_dir("ab/a/b") >= 0);
+    free_disk(diskptr);
+}
+
+// Builds by hand the image rename_into_itself used to leave behind: "a" is taken out of the
+// root and named from its own subdirectory instead, so every inode still has one entry.
+static void fsck_detached_cycle() {
+    disk* diskptr = fresh_disk();
+    CHECK(create_dir("a") == 0 && create_dir("a/b") == 0 && create_file_by_path("a/b/f") >= 0);
+    int a = find_dir("a");
+    int b = find_dir("a/b");
+    dir_item item;
+    int offset;
+    for(offset=0; read_i(0, (char*) &item, sizeof(dir_item), offset) == sizeof(dir_item); offset+=sizeof(dir_item)) {
+        if(item.valid && item.inumber == (uint32_t) a)
+            break;
+    }
+    CHECK(item.valid && item.inumber == (uint32_t) a);
+    item.valid = 0;
+    CHECK(write_i(0, (char*) &item, sizeof(dir_item), offset) == sizeof(dir_item));
+    item.valid = 1;
+    CHECK(write_i(b, (char*) &item, sizeof(dir_item), get_filesize(b)) == sizeof(dir_item));
+    CHECK(find_dir("a") < 0);
+    CHECK(save_disk(diskptr, CYCLE_IMAGE) == 0);
+    free_disk(diskptr);
+    // a, b and f are reported and nothing can repair them
+    int status = system("./sfsck " CYCLE_IMAGE " | grep -c 'cut off from the root' | grep -qx 3");
+    CHECK(status == 0);
+    status = system("./sfsck " CYCLE_IMAGE " >/dev/null");
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 4);
+    remove(CYCLE_IMAGE);
+}
+
+// reopening an image file with a smaller size must not cut off its last blocks
+static void reopen_smaller_disk_file() {
+    remove(FILE_DISK);
+    char block[BLOCKSIZE], check[BLOCKSIZE];
+    memset(block, 0x5a, BLOCKSIZE);
+    disk* diskptr = open_disk_file(FILE_DISK, sizeof(disk) + 64*BLOCKSIZE);
+    CHECK(diskptr && diskptr->blocks == 64);
+    CHECK(write_block(diskptr, 63, block) == 0);
+    free_disk(diskptr);
+    CHECK(open_disk_file(FILE_DISK, sizeof(disk) + 32*BLOCKSIZE) == NULL);
+    diskptr = open_disk_file(FILE_DISK, 0);
+    CHECK(diskptr && diskptr->blocks == 64);
+    CHECK(read_block(diskptr, 63, check) == 0 && !memcmp(block, check, BLOCKSIZE));
+    free_disk(diskptr);
+    diskptr = open_disk_file(FILE_DISK, sizeof(disk) + 128*BLOCKSIZE);
+    CHECK(diskptr && diskptr->blocks == 128);
+    CHECK(read_block(diskptr, 63, check) == 0 && !memcmp(block, check, BLOCKSIZE));
+    free_disk(diskptr);
+    remove(FILE_DISK);
+}
+
+// A file removed with async unlink is queued for the reclaimer, but is gone for every call
+// just as after a sync remove. A clone of it would be neither a live file nor ever reclaimed.
+static void use_removed_file() {
+    disk* diskptr = fresh_disk();
+    char data[3*BLOCKSIZE];
+    memset(data, 7, sizeof data);
+    int first = create_file();
+    int second = create_file();
+    CHECK(write_i(first, data, sizeof data, 0) == sizeof data && write_i(second, data, sizeof data, 0) == sizeof data);
+    // the reclaimer takes the first orphan and then pauses long enough to leave the second
+    CHECK(set_reclaim_rate(1, 10000000) == 0 && set_async_unlink(1) == 0);
+    CHECK(remove_file(first) == 0 && remove_file(second) == 0);
+    CHECK(clone_file(second) < 0);
+    CHECK(get_filesize(second) < 0 && get_link_count(second) < 0 && stat(second) < 0);
+    CHECK(read_i(second, data, BLOCKSIZE, 0) < 0 && write_i(second, data, BLOCKSIZE, 0) < 0);
+    CHECK(fit_to_size(second, 0) < 0);
+    CHECK(set_async_unlink(0) == 0);
+    reclaim_orphans(-1);
+    CHECK(pending_orphans() == 0);
+    CHECK(set_reclaim_rate(16, 1000) == 0);
+    free_disk(diskptr);
+}
+
+// valid entries in the directory at path
+static int count_entries(char* path) {
+    dir_entry entries[16];
+    int dirfd = open_dir(path);
+    if(dirfd < 0)
+        return -1;
+    int total = 0, n;
+    while((n = readdir_batch(dirfd, entries, 16)) > 0)
+        total += n;
+    close_dir(dirfd);
+    return total;
+}
+
+// A rename that fails after its commit point must still end with exactly one of the two
+// names. The snapshot shares the block of s and the disk is full, so the old entry cannot
+// be cleared, while d is private and has room for the new one in its block.
+static void rename_on_full_disk() {
+    disk* diskptr = fresh_disk();
+    CHECK(create_dir("s") == 0);
+    int x = create_file_by_path("s/x");
+    CHECK(x >= 0);
+    CHECK(create_snapshot() >= 0);
+    CHECK(create_dir("d") == 0 && create_file_by_path("d/z") >= 0);
+    static char data[1<<20];
+    memset(data, 3, sizeof data);
+    int nfillers = 0, full = 0;
+    char name[16];
+    while(!full && nfillers < 64) {
+        snprintf(name, sizeof name, "f%d", nfillers);
+        int filler = create_file_by_path(name);
+        CHECK(filler >= 0);
+        for(int offset=0; offset<(4<<20); offset+=sizeof data) {
+            if(write_i(filler, data, sizeof data, offset) != sizeof data) {
+                full = 1;
+                break;
+            }
+        }
+        nfillers++;
+    }
+    CHECK(full);
+    CHECK(rename_path("s/x", "d/y") < 0);
+    CHECK(count_entries("s") == 1 && count_entries("d") == 1);
+    CHECK(get_link_count(x) == 1);
+    CHECK(save_disk(diskptr, CYCLE_IMAGE) == 0);
+    CHECK(system("./sfsck " CYCLE_IMAGE " >/dev/null") == 0);
+    remove(CYCLE_IMAGE);
+    // with space again the rename goes through
+    for(int i=0; i<nfillers; i++) {
+        snprintf(name, sizeof name, "f%d", i);
+        CHECK(remove_file_by_path(name) == 0);
+    }
+    CHECK(rename_path("s/x", "d/y") == 0);
+    CHECK(count_entries("s") == 0 && count_entries("d") == 2);
+    free_disk(diskptr);
+}
+
+// a listing reads each block of the directory once, whatever the file system block size
+static void list_large_blocks() {
+    uint32_t sizes[] = {4096, 16384, 65536};
+    for(int i=0; i<3; i++) {
+        disk* diskptr = create_disk(DISK_SIZE);
+        format_opts opts;
+        memset(&opts, 0, sizeof opts);
+        opts.block_size = sizes[i];
+        CHECK(format_ex(diskptr, &opts) == 0 && mount(diskptr) == 0 && init_dirsys(diskptr) == 0);
+        CHECK(create_dir("d") == 0);
+        char name[32];
+        for(int n=0; n<3000; n++) {
+            snprintf(name, sizeof name, "d/f%d", n);
+            CHECK(create_file_by_path(name) >= 0);
+        }
+        // open_dir reads the one block of the root to find d
+        int blocks = (get_filesize(find_dir("d")) + sizes[i]-1)/sizes[i] + 1;
+        uint64_t before, after, writes;
+        disk_io_totals(diskptr, &before, &writes);
+        CHECK(count_entries("d") == 3000);
+        disk_io_totals(diskptr, &after, &writes);
+        if(after-before != (uint64_t) blocks*(sizes[i]/BLOCKSIZE))
+            printf("%u byte blocks: %lu disk reads for %d blocks\n", sizes[i], (unsigned long) (after-before), blocks);
+        CHECK(after-before == (uint64_t) blocks*(sizes[i]/BLOCKSIZE));
+        free_disk(diskptr);
+    }
+}
+
+int main() {
+    rename_into_itself();
+    fsck_detached_cycle();
+    reopen_smaller_disk_file();
+    use_removed_file();
+    rename_on_full_disk();
+    list_large_blocks();
+    printf("%d failures\n", failures);
+    return failures;
+}
@@ -0,0 +1,204 @@
+#include "disk.h"
+#include "sfs.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Bounded multi-producer ring: a producer claims a position by moving head forward, fills
+// the slot and publishes it by setting the slot's seq to position+1. The writer thread
+// takes published slots in order and hands them back with seq = position+size.
+typedef struct trace_slot {
+    uint64_t seq;
+    trace_record rec;
+} trace_slot;
+
+#define TRACE_BATCH 1024 // records per fwrite
+
+// disk block ranges of the traced file system, re-read whenever its super block is written
+typedef struct trace_layout {
+    uint32_t valid;
+    uint32_t inode_bitmap;
+    uint32_t data_bitmap;
+    uint32_t refcount;
+    uint32_t csum;
+    uint32_t inode;
+    uint32_t data;
+} trace_layout;
+
+static disk* traced;
+static FILE* trace_fp;
+static trace_slot* ring;
+static uint64_t ring_mask;
+static uint64_t head;
+static uint64_t tail;
+static long dropped;
+static uint64_t start_ns;
+static int running;
+static pthread_t writer;
+static trace_layout layout;
+
+static uint64_t trace_clock() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000ull + t.tv_nsec;
+}
+
+// The fields are stored one by one without a lock, so a record racing a format may be
+// classified by a mix of the old and the new layout.
+static void read_layout(const void* block) {
+    const super_block* sb = (const super_block*) block;
+    trace_layout l = {0};
+    if(sb->magic_number == MAGIC) {
+        uint32_t k = FS_BLOCK_SIZE(sb)/BLOCKSIZE; // disk blocks per file system block
+        l.valid = 1;
+        l.inode_bitmap = sb->inode_bitmap_block_idx*k;
+        l.data_bitmap = sb->data_block_bitmap_idx*k;
+        l.refcount = sb->refcount_block_idx*k;
+        l.csum = sb->csum_block_idx*k;
+        l.inode = sb->inode_block_idx*k;
+        l.data = sb->data_block_idx*k;
+    }
+    uint32_t* dst = (uint32_t*) &layout;
+    uint32_t* src = (uint32_t*) &l;
+    for(size_t i=0; i<sizeof(trace_layout)/sizeof(uint32_t); i++)
+        __atomic_store_n(dst+i, src[i], __ATOMIC_RELAXED);
+}
+
+static uint8_t classify(uint32_t blocknr) {
+    if(blocknr == 0)
+        return BLK_SUPER;
+    if(!__atomic_load_n(&layout.valid, __ATOMIC_RELAXED))
+        return TRACE_UNKNOWN;
+    if(blocknr >= __atomic_load_n(&layout.data, __ATOMIC_RELAXED))
+        return BLK_DATA;
+    if(blocknr >= __atomic_load_n(&layout.inode, __ATOMIC_RELAXED))
+        return BLK_INODE;
+    if(blocknr >= __atomic_load_n(&layout.csum, __ATOMIC_RELAXED))
+        return BLK_CSUM;
+    if(blocknr >= __atomic_load_n(&layout.refcount, __ATOMIC_RELAXED))
+        return BLK_REFCOUNT;
+    if(blocknr >= __atomic_load_n(&layout.inode_bitmap, __ATOMIC_RELAXED))
+        return BLK_BITMAP;
+    return BLK_SUPER;
+}
+
+static void trace_hook(disk* diskptr, uint32_t blocknr, int write, const void* block_data) {
+    if(diskptr != traced)
+        return;
+    if(write && blocknr == 0)
+        read_layout(block_data);
+    uint64_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    trace_slot* slot;
+    for(;;) {
+        slot = ring + (pos & ring_mask);
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if(seq == pos) {
+            if(__atomic_compare_exchange_n(&head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(seq < pos) {
+            // the writer has not caught up with the slot a lap ago
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->rec.ns = trace_clock() - start_ns;
+    slot->rec.blocknr = blocknr;
+    slot->rec.write = write;
+    slot->rec.cls = classify(blocknr);
+    slot->rec.pad = 0;
+    __atomic_store_n(&slot->seq, pos+1, __ATOMIC_RELEASE);
+}
+
+// moves the published records at the tail of the ring to the file, returns how many
+static int drain() {
+    trace_record batch[TRACE_BATCH];
+    int n = 0;
+    while(n < TRACE_BATCH) {
+        trace_slot* slot = ring + (tail & ring_mask);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail+1)
+            break;
+        batch[n++] = slot->rec;
+        __atomic_store_n(&slot->seq, tail+ring_mask+1, __ATOMIC_RELEASE);
+        tail++;
+    }
+    if(n && fwrite(batch, sizeof(trace_record), n, trace_fp) != (size_t) n)
+        printf("ERR: Could not write the trace.\n");
+    return n;
+}
+
+static void* writer_main(void* arg) {
+    while(__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        if(!drain())
+            usleep(200);
+    }
+    while(drain())
+        ;
+    return NULL;
+}
+
+int trace_start(disk *diskptr, const char *path, int ring_records) {
+    if(traced || !diskptr || ring_records < 1) {
+        return -1;
+    }
+    uint64_t size = 1;
+    while(size < (uint64_t) ring_records)
+        size <<= 1;
+    ring = (trace_slot*) malloc(size*sizeof(trace_slot));
+    if(!ring) {
+        return -1;
+    }
+    for(uint64_t i=0; i<size; i++)
+        ring[i].seq = i;
+    ring_mask = size-1;
+    head = tail = 0;
+    dropped = 0;
+    trace_fp = fopen(path, "wb");
+    if(!trace_fp)
+        goto err;
+    trace_header header = {TRACE_MAGIC, diskptr->blocks, sizeof(trace_record)};
+    if(fwrite(&header, sizeof(header), 1, trace_fp) != 1)
+        goto err;
+    layout.valid = 0;
+    char* block = (char*) malloc(BLOCKSIZE);
+    if(block && peek_block(diskptr, 0, block) == 0)
+        read_layout(block);
+    free(block);
+    start_ns = trace_clock();
+    running = 1;
+    if(pthread_create(&writer, NULL, writer_main, NULL))
+        goto err;
+    traced = diskptr;
+    disk_set_trace_hook(trace_hook);
+    return 0;
+    err:
+        if(trace_fp)
+            fclose(trace_fp);
+        trace_fp = NULL;
+        free(ring);
+        ring = NULL;
+        return -1;
+}
+
+long trace_stop() {
+    if(!traced) {
+        return -1;
+    }
+    // in-flight hooks finish with ring before the writer drains it and it is freed
+    disk_set_trace_hook(NULL);
+    traced = NULL;
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+    long lost = dropped;
+    if(fclose(trace_fp))
+        lost = -1;
+    trace_fp = NULL;
+    free(ring);
+    ring = NULL;
+    return lost;
+}
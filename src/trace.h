@@ -0,0 +1,31 @@
+#include <stdint.h>
+
+// Block level I/O tracing. While a trace runs, every read_block/write_block on the traced
+// disk is put in a lock-free ring by the calling thread and a background thread appends
+// the records to the trace file. Records that do not fit in a full ring are dropped and
+// counted, the caller never waits.
+
+#define TRACE_MAGIC 0x31435254534653ull // "SFSTRC1"
+#define TRACE_UNKNOWN 0xff // class of blocks on a disk without a valid super block
+
+// trace file header, followed by trace_record entries until the end of the file
+typedef struct trace_header {
+	uint64_t magic;
+	uint32_t blocks;	// blocks of the traced disk
+	uint32_t record_size;	// sizeof(trace_record)
+} trace_header;
+
+typedef struct trace_record {
+	uint64_t ns;	// time since trace_start
+	uint32_t blocknr;
+	uint8_t write;	// 0 read, 1 write
+	uint8_t cls;	// BLK_* class from the super block layout, TRACE_UNKNOWN if none
+	uint16_t pad;
+} trace_record;
+
+// starts tracing diskptr into path, ring_records rounded up to a power of two
+int trace_start(disk *diskptr, const char *path, int ring_records);
+
+// writes out the records still in the ring and closes the file; returns the records
+// dropped because the ring was full. No block I/O on the traced disk may run concurrently.
+long trace_stop();